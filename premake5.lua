@@ -19,6 +19,13 @@ newoption {
     description = "Defer filtering, primarily pixel format conversions, until the media is ready to be converted and uploaded. This can improve performance since filtering is not happening in hardware, but might not be possible to do in FFmpeg!"
 }
 
+newoption {
+    trigger = "faults",
+    value = "bool",
+    default = "false",
+    description = "Compiles in fault injection for storage and capture, and the -f option to run the recorder against it with a simulated camera"
+}
+
 newaction {
     trigger = "clean",
     description = "Cleans all build products",
@@ -77,6 +84,14 @@ project "dashcam"
         defines { "DEFERRED_FILTERING=0" }
     filter {}
 
+    filter { "options:faults=true" }
+        defines { "FAULT_INJECTION=1" }
+    filter {}
+
+    filter { "options:faults=false" }
+        defines { "FAULT_INJECTION=0" }
+    filter {}
+
     files { "src/**.cpp", "src/**.h" }
 
     -- Enable Tracy client during profiling builds
@@ -1,6 +1,7 @@
 #!/usr/bin/python3
 
 import argparse
+import mimetypes
 import os
 from pydrive2.auth import GoogleAuth
 from pydrive2.drive import GoogleDrive
@@ -42,7 +43,7 @@ def login():
     return login_service_account()
 
 def main():
-    parser = argparse.ArgumentParser(description="Tool to upload mp4 files to Google Drive")
+    parser = argparse.ArgumentParser(description="Tool to upload mp4 files, and their thumbnail sprites, to Google Drive")
     parser.add_argument("-f", "--file", required=True)
     parsedArgs = parser.parse_args()
 
@@ -55,7 +56,7 @@ def main():
         "parents": [{
             "id": parentFolder
         }],
-        "mimeType": "video/mp4"
+        "mimeType": mimetypes.guess_type(parsedArgs.file)[0] or "application/octet-stream"
     })
     f.SetContentFile(parsedArgs.file)
     f.Upload()
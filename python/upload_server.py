@@ -0,0 +1,179 @@
+#!/usr/bin/python3
+
+# Local stand-in for the resumable upload endpoint, for trying out the native uploader without a real backend.
+#   POST /uploads with Upload-Length, Upload-Name and optionally Upload-Checksum (crc32=<hex>) creates a session, returned in Location.
+#   PUT /uploads/<id> with Content-Range stores a chunk at its offset. Chunks can arrive in any order.
+#   POST /uploads/<id> with Upload-Complete: 1 moves the file into the destination once every byte has arrived and the checksum matches.
+# --fail-rate drops a fraction of chunk requests mid-body to simulate a flaky link, --token requires a bearer token.
+
+import argparse
+import os
+import random
+import threading
+import uuid
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+sessions = {}
+sessionsLock = threading.Lock()
+
+class Session:
+    def __init__(self, name, length, path, checksum):
+        self.name = name
+        self.length = length
+        self.path = path
+        self.checksum = checksum
+        self.ranges = []
+
+    def verify(self):
+        if self.checksum is None:
+            return True
+
+        checksum = 0
+        with open(self.path, "rb") as file:
+            while data := file.read(1 << 20):
+                checksum = zlib.crc32(data, checksum)
+
+        return self.checksum == "crc32=%08x" % checksum
+
+    def received(self):
+        # Merge the stored ranges and count the bytes covered.
+        total = 0
+        end = 0
+        for first, last in sorted(self.ranges):
+            first = max(first, end)
+            if last + 1 > first:
+                total += last + 1 - first
+                end = last + 1
+        return total
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def reply(self, status, headers={}):
+        self.send_response(status)
+        for name, value in headers.items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def authorized(self):
+        if args.token and self.headers.get("Authorization") != "Bearer " + args.token:
+            self.drain()
+            self.reply(401)
+            return False
+        return True
+
+    def drain(self):
+        length = int(self.headers.get("Content-Length", 0))
+        while length > 0:
+            length -= len(self.rfile.read(min(length, 1 << 20)))
+
+    def session(self):
+        with sessionsLock:
+            return sessions.get(self.path.rsplit("/", 1)[-1])
+
+    def do_POST(self):
+        if not self.authorized():
+            return
+
+        if self.path == "/uploads":
+            self.drain()
+            name = os.path.basename(self.headers.get("Upload-Name", "upload"))
+            length = int(self.headers["Upload-Length"])
+            id = uuid.uuid4().hex
+            path = os.path.join(args.dest, "." + id + ".part")
+
+            with open(path, "wb") as file:
+                file.truncate(length)
+
+            with sessionsLock:
+                sessions[id] = Session(name, length, path, self.headers.get("Upload-Checksum"))
+
+            self.reply(201, { "Location": "/uploads/" + id })
+            return
+
+        session = self.session()
+        self.drain()
+
+        if session is None:
+            self.reply(404)
+        elif self.headers.get("Upload-Complete") != "1":
+            self.reply(400)
+        elif session.received() != session.length:
+            self.reply(409)
+        elif not session.verify():
+            # Corrupted on the way, the client has to start over.
+            with sessionsLock:
+                sessions.pop(self.path.rsplit("/", 1)[-1], None)
+            os.remove(session.path)
+            self.reply(422)
+        else:
+            os.replace(session.path, os.path.join(args.dest, session.name))
+            with sessionsLock:
+                sessions.pop(self.path.rsplit("/", 1)[-1], None)
+            print("Received", session.name, session.length, "bytes")
+            self.reply(201)
+
+    def do_PUT(self):
+        if not self.authorized():
+            return
+
+        session = self.session()
+        if session is None:
+            self.drain()
+            self.reply(404)
+            return
+
+        # "bytes <first>-<last>/<length>"
+        first, last = map(int, self.headers["Content-Range"].split()[1].split("/")[0].split("-"))
+        length = int(self.headers.get("Content-Length", 0))
+        if last - first + 1 != length or last >= session.length:
+            self.drain()
+            self.reply(416)
+            return
+
+        failAt = random.randrange(length) if random.random() < args.fail_rate else None
+
+        with open(session.path, "r+b") as file:
+            file.seek(first)
+            remaining = length
+            while remaining > 0:
+                if failAt is not None and length - remaining >= failAt:
+                    self.close_connection = True
+                    self.connection.shutdown(2)
+                    return
+
+                data = self.rfile.read(min(remaining, 64 * 1024))
+                if not data:
+                    return
+                file.write(data)
+                remaining -= len(data)
+
+        session.ranges.append((first, last))
+        self.reply(204)
+
+    def log_message(self, format, *arguments):
+        if args.verbose:
+            super().log_message(format, *arguments)
+
+def main():
+    global args
+
+    parser = argparse.ArgumentParser(description="Local stand-in for the resumable upload endpoint")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--dest", default="./uploads")
+    parser.add_argument("--token", default=None)
+    parser.add_argument("--fail-rate", type=float, default=0.0)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    os.makedirs(args.dest, exist_ok=True)
+
+    print("Listening on port", args.port, "with upload.url = http://localhost:" + str(args.port) + "/uploads")
+    ThreadingHTTPServer(("", args.port), Handler).serve_forever()
+
+    return 0
+
+if __name__ == "__main__":
+    exit(code=main())
@@ -0,0 +1,298 @@
+#include "bitstream.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+// NAL unit types, from table 7-1 of the H.264 specification.
+constexpr uint8_t nalSlice = 1;
+constexpr uint8_t nalIdrSlice = 5;
+constexpr uint8_t nalSei = 6;
+constexpr uint8_t nalAccessUnitDelimiter = 9;
+
+// Reads Exp-Golomb codes from a NAL unit payload, skipping the emulation prevention bytes (00 00 03) on the way.
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+    bool readBit(uint32_t& bit) {
+        if (bitsLeft == 0) {
+            if (position >= size) {
+                return false;
+            }
+
+            if (zeros >= 2 && data[position] == 0x03) {
+                zeros = 0;
+                if (++position >= size) {
+                    return false;
+                }
+            }
+
+            current = data[position++];
+            zeros = current == 0 ? zeros + 1 : 0;
+            bitsLeft = 8;
+        }
+
+        bit = (current >> --bitsLeft) & 1;
+
+        return true;
+    }
+
+    // ue(v), an unsigned Exp-Golomb code.
+    bool readUnsigned(uint32_t& value) {
+        int leadingZeros = 0;
+        uint32_t bit = 0;
+
+        while (readBit(bit) && bit == 0) {
+            if (++leadingZeros > 31) {
+                return false;
+            }
+        }
+
+        if (bit != 1) {
+            return false;
+        }
+
+        value = 0;
+        for (int i = 0; i < leadingZeros; ++i) {
+            if (!readBit(bit)) {
+                return false;
+            }
+
+            value = (value << 1) | bit;
+        }
+
+        value += (1U << leadingZeros) - 1;
+
+        return true;
+    }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t position = 0;
+    uint8_t current = 0;
+    int bitsLeft = 0;
+    int zeros = 0;
+};
+
+size_t findStartCode(const uint8_t* data, size_t size, size_t from) {
+    size_t i = from;
+
+    // Compares 16 candidate positions at once, each against the two bytes after it.
+#if defined(__ARM_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    for (; i + 18 <= size; i += 16) {
+        const auto matches = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(data + i), zero), vceqq_u8(vld1q_u8(data + i + 1), zero)),
+            vceqq_u8(vld1q_u8(data + i + 2), one));
+
+        // Narrows each byte of the comparison to a nibble of a 64 bit mask.
+        const auto mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        if (mask != 0) {
+            return i + __builtin_ctzll(mask) / 4;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; i + 18 <= size; i += 16) {
+        const auto first = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), zero);
+        const auto second = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1)), zero);
+        const auto third = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 2)), one);
+
+        const auto mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(first, second), third));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    // Scalar fallback, and the tail of the vectorized paths.
+    for (; i + 3 <= size; ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+StreamIndex indexStream(const uint8_t* data, size_t size, bool closed) {
+    ZoneScoped;
+
+    StreamIndex index{ .size = size };
+
+    // The access unit being gathered.
+    size_t unitStart = 0;
+    bool unitStarted = false;
+    bool hasPicture = false;
+    bool isKeyframe = false;
+    uint32_t sliceType = 0;
+
+    const auto endUnit = [&](size_t end) {
+        if (hasPicture) {
+            ++index.frames;
+
+            // Slice types 5-9 mean the same as 0-4, with every slice of the picture of that type.
+            switch (sliceType % 5) {
+                case 0:
+                case 3:
+                    ++index.predictedFrames;
+                    break;
+                case 1:
+                    ++index.bidirectionalFrames;
+                    break;
+                default:
+                    ++index.intraFrames;
+                    break;
+            }
+
+            if (isKeyframe) {
+                index.keyframeOffsets.push_back(unitStart);
+            }
+        }
+
+        index.validSize = end;
+        unitStart = end;
+        hasPicture = false;
+        isKeyframe = false;
+    };
+
+    for (auto position = findStartCode(data, size, 0); position < size;) {
+        const auto payload = position + 3;
+        const auto next = findStartCode(data, size, payload);
+
+        // The zero byte of a four byte start code belongs to the unit it starts.
+        const auto nalStart = position > 0 && data[position - 1] == 0 ? position - 1 : position;
+
+        // A set forbidden bit is garbage, like the zeros a power loss can leave past the end of the data.
+        if (payload < next && (data[payload] & 0x80) == 0) {
+            const uint8_t type = data[payload] & 0x1F;
+
+            // Section 7.4.1.2.3: a new access unit starts with a delimiter, parameter sets or SEI, or with the first slice of a new picture.
+            // Only first_mb_in_slice is checked for the latter, the recorded streams don't use arbitrary slice order.
+            bool startsUnit = false;
+            uint32_t firstMacroblock = 0;
+            uint32_t currentSliceType = 0;
+            const bool isSlice = type == nalSlice || type == nalIdrSlice;
+
+            if (isSlice) {
+                BitReader reader{ data + payload + 1, next - payload - 1 };
+                if (!reader.readUnsigned(firstMacroblock) || !reader.readUnsigned(currentSliceType)) {
+                    position = next;
+                    continue;
+                }
+
+                startsUnit = hasPicture && firstMacroblock == 0;
+            } else if ((type >= nalSei && type <= nalAccessUnitDelimiter) || (type >= 14 && type <= 18)) {
+                startsUnit = hasPicture;
+            }
+
+            if (startsUnit) {
+                endUnit(nalStart);
+            } else if (!unitStarted) {
+                unitStart = nalStart;
+            }
+
+            unitStarted = true;
+
+            if (isSlice) {
+                if (!hasPicture) {
+                    sliceType = currentSliceType;
+                }
+
+                hasPicture = true;
+                isKeyframe = isKeyframe || type == nalIdrSlice;
+            }
+        }
+
+        position = next;
+    }
+
+    // Trailing zeros may pad a closed stream, they're not part of any unit.
+    if (closed && unitStarted) {
+        auto end = size;
+        while (end > unitStart && data[end - 1] == 0) {
+            --end;
+        }
+
+        endUnit(end);
+    }
+
+    return index;
+}
+
+std::optional<StreamIndex> indexSegment(const std::filesystem::path& path, bool closed) {
+    ZoneScoped;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    const size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return StreamIndex{};
+    }
+
+    void* memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        return std::nullopt;
+    }
+
+    // Read once, front to back. Aggressive read-ahead keeps the scan waiting on the card as little as possible.
+    madvise(memory, size, MADV_SEQUENTIAL);
+    madvise(memory, size, MADV_WILLNEED);
+
+    auto index = indexStream(static_cast<const uint8_t*>(memory), size, closed);
+
+    munmap(memory, size);
+
+    return index;
+}
+
+std::optional<StreamIndex> recoverSegment(const std::filesystem::path& path) {
+    ZoneScoped;
+
+    auto index = indexSegment(path, false);
+    if (!index) {
+        return std::nullopt;
+    }
+
+    // Nothing whole to keep means this might not be H.264 at all, leave it be.
+    if (index->validSize > 0 && index->validSize < index->size) {
+        if (truncate(path.c_str(), index->validSize) != 0) {
+            std::cerr << "Failed to truncate " << path << " to its last whole frame.\n";
+            return index;
+        }
+
+        std::cout << "Recovered " << path << ": " << index->frames << " frames, " << index->keyframeOffsets.size() << " keyframes, dropped "
+            << index->size - index->validSize << " bytes of the last frame.\n";
+
+        index->size = index->validSize;
+    }
+
+    return index;
+}
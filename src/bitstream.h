@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <filesystem>
+
+// Indexes H.264 Annex-B streams, like the recorded segments, without decoding them. Only start codes, NAL unit headers and the first two
+// fields of each slice header are looked at, so a whole segment is indexed about as fast as it can be read.
+
+// What a stream holds, counted in access units. An access unit is one coded frame with the parameter sets and SEI that come with it.
+struct StreamIndex {
+    uint64_t frames = 0;
+    uint64_t intraFrames = 0;
+    uint64_t predictedFrames = 0;
+    uint64_t bidirectionalFrames = 0;
+    std::vector<uint64_t> keyframeOffsets{};  // Start of each access unit with an IDR picture, where playback can begin.
+    uint64_t validSize = 0;  // End of the last whole access unit.
+    uint64_t size = 0;
+};
+
+// Offset of the first start code prefix (00 00 01) at or past from, or size if there's none. Vectorized with NEON or SSE2 when available.
+size_t findStartCode(const uint8_t* data, size_t size, size_t from);
+
+// Indexes a stream in memory. A stream that wasn't closed may have been cut off anywhere, so its last access unit is left out of the
+// index, it can't be known to be whole.
+StreamIndex indexStream(const uint8_t* data, size_t size, bool closed);
+
+// Maps the file and indexes it. Empty if it can't be read.
+std::optional<StreamIndex> indexSegment(const std::filesystem::path& path, bool closed);
+
+// Truncates a segment cut off by a crash or power loss after its last whole access unit, so that it converts and plays back cleanly.
+// Returns the index of what's left, empty if it can't be read.
+std::optional<StreamIndex> recoverSegment(const std::filesystem::path& path);
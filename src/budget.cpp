@@ -0,0 +1,201 @@
+#include "budget.h"
+#include "log.h"
+
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+using namespace std::literals::chrono_literals;
+
+// How long a BLOCKING allocation will wait for memory before giving up. Bounds the stall if a downstream stage is wedged.
+constexpr auto maxBlockingWait = 1s;
+
+const char* poolNames[] = {
+    "packets",
+    "frames",
+    "write buffers",
+    "ring buffers",
+    "codec"
+};
+
+static_assert(sizeof(poolNames) / sizeof(*poolNames) == static_cast<size_t>(MemoryPool::COUNT));
+
+std::mutex budgetLock{};
+std::condition_variable budgetReleased{};
+MemoryStats budgetStats{};
+
+void initializeMemoryBudget(size_t budget) {
+    std::scoped_lock scopeLock{ budgetLock };
+    budgetStats.budget = budget;
+
+    std::cout << "Memory budget is " << budget / (1024 * 1024) << " MB.\n";
+}
+
+void commitMemory(MemoryPool pool, size_t bytes) {
+    const auto index = static_cast<size_t>(pool);
+
+    budgetStats.used += bytes;
+    budgetStats.poolUsed[index] += bytes;
+
+    if (budgetStats.used > budgetStats.highWater) {
+        budgetStats.highWater = budgetStats.used;
+    }
+
+    if (budgetStats.poolUsed[index] > budgetStats.poolHighWater[index]) {
+        budgetStats.poolHighWater[index] = budgetStats.poolUsed[index];
+    }
+}
+
+bool acquireMemory(MemoryPool pool, size_t bytes, MemoryPriority priority) {
+    std::unique_lock scopeLock{ budgetLock };
+
+    // An empty budget always admits one allocation, otherwise an object larger than the budget could never make progress.
+    const auto fits = [&]() { return budgetStats.used == 0 || budgetStats.used + bytes <= budgetStats.budget; };
+
+    if (!fits()) {
+        switch (priority) {
+            case MemoryPriority::DROPPABLE:
+                budgetStats.dropped++;
+                return false;
+            case MemoryPriority::BLOCKING: {
+                ZoneScopedN("memory_back_pressure");
+
+                budgetStats.blocked++;
+                if (!budgetReleased.wait_for(scopeLock, maxBlockingWait, fits)) {
+                    budgetStats.dropped++;
+                    return false;
+                }
+                break;
+            }
+            case MemoryPriority::CRITICAL:
+                budgetStats.overcommitted++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    commitMemory(pool, bytes);
+
+    return true;
+}
+
+void releaseMemory(MemoryPool pool, size_t bytes) {
+    {
+        std::scoped_lock scopeLock{ budgetLock };
+        const auto index = static_cast<size_t>(pool);
+
+        budgetStats.used -= bytes;
+        budgetStats.poolUsed[index] -= bytes;
+    }
+
+    budgetReleased.notify_all();
+}
+
+MemoryStats getMemoryStats() {
+    std::scoped_lock scopeLock{ budgetLock };
+
+    return budgetStats;
+}
+
+void reportMemory() {
+    constexpr size_t kb = 1024;
+    const auto stats = getMemoryStats();
+
+    logInfo("Memory: %zu KB used, %zu KB high-water of %zu KB budget. Dropped: %llu, blocked: %llu, overcommitted: %llu", stats.used / kb,
+        stats.highWater / kb, stats.budget / kb, static_cast<unsigned long long>(stats.dropped),
+        static_cast<unsigned long long>(stats.blocked), static_cast<unsigned long long>(stats.overcommitted));
+
+    // A single line, the log limits lines per call site.
+    std::string pools;
+    for (size_t i = 0; i < static_cast<size_t>(MemoryPool::COUNT); ++i) {
+        pools += std::string{ " " } + poolNames[i] + " " + std::to_string(stats.poolUsed[i] / kb) + "/"
+            + std::to_string(stats.poolHighWater[i] / kb) + " KB,";
+    }
+
+    pools.pop_back();
+    logInfo("Memory pools, used/high-water:%s", pools.c_str());
+}
+
+size_t packetMemory(const AVPacket* packet) {
+    // Packets from the demuxer and encoder are reference counted, the backing buffer is what's actually held.
+    return packet->buf ? packet->buf->size : packet->size;
+}
+
+size_t frameMemory(const AVFrame* frame) {
+    size_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; ++i) {
+        bytes += frame->buf[i]->size;
+    }
+
+    return bytes;
+}
+
+bool chargePacket(AVPacket*& packet, MemoryPriority priority) {
+    const auto bytes = packetMemory(packet);
+
+    if (!acquireMemory(MemoryPool::PACKETS, bytes, priority)) {
+        av_packet_free(&packet);
+        return false;
+    }
+
+    TracyAllocN(packet, bytes, poolNames[static_cast<size_t>(MemoryPool::PACKETS)]);
+
+    return true;
+}
+
+bool chargeFrame(AVFrame*& frame, MemoryPriority priority) {
+    const auto bytes = frameMemory(frame);
+
+    if (!acquireMemory(MemoryPool::FRAMES, bytes, priority)) {
+        av_frame_free(&frame);
+        return false;
+    }
+
+    TracyAllocN(frame, bytes, poolNames[static_cast<size_t>(MemoryPool::FRAMES)]);
+
+    return true;
+}
+
+bool makeFrameWritable(AVFrame* frame) {
+    const auto before = frameMemory(frame);
+
+    if (av_frame_make_writable(frame) < 0) {
+        return false;
+    }
+
+    // The frame is already in flight, so the copy can't be refused.
+    if (const auto after = frameMemory(frame); after > before) {
+        acquireMemory(MemoryPool::FRAMES, after - before, MemoryPriority::CRITICAL);
+    } else if (after < before) {
+        releaseMemory(MemoryPool::FRAMES, before - after);
+    }
+
+    return true;
+}
+
+void freePacket(AVPacket** packet) {
+    if (*packet) {
+        releaseMemory(MemoryPool::PACKETS, packetMemory(*packet));
+        TracyFreeN(*packet, poolNames[static_cast<size_t>(MemoryPool::PACKETS)]);
+        av_packet_free(packet);
+    }
+}
+
+void freeFrame(AVFrame** frame) {
+    if (*frame) {
+        releaseMemory(MemoryPool::FRAMES, frameMemory(*frame));
+        TracyFreeN(*frame, poolNames[static_cast<size_t>(MemoryPool::FRAMES)]);
+        av_frame_free(frame);
+    }
+}
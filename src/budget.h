@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct AVPacket;
+struct AVFrame;
+
+// Categories of memory tracked by the budget. Each pool keeps its own usage and high-water mark.
+enum class MemoryPool : uint8_t {
+    PACKETS = 0,
+    FRAMES = 1,
+    WRITE_BUFFERS = 2,
+    RING_BUFFERS = 3,
+    CODEC = 4,
+    COUNT
+};
+
+// Determines what happens to an allocation when the budget is exhausted.
+enum class MemoryPriority : uint8_t {
+    DROPPABLE = 0,  // Fails immediately, the caller throws away the work. Used for fresh captures, which are the cheapest thing to lose.
+    BLOCKING = 1,  // Waits for downstream stages to release memory, applying back-pressure. Fails if nothing is released in time.
+    CRITICAL = 2  // Always succeeds and may overshoot the budget. Used where dropping would corrupt the output stream.
+};
+
+struct MemoryStats {
+    size_t budget = 0;
+    size_t used = 0;
+    size_t highWater = 0;
+    size_t poolUsed[static_cast<size_t>(MemoryPool::COUNT)]{};
+    size_t poolHighWater[static_cast<size_t>(MemoryPool::COUNT)]{};
+    uint64_t dropped = 0;  // DROPPABLE or BLOCKING allocations that were refused.
+    uint64_t blocked = 0;  // BLOCKING allocations that had to wait.
+    uint64_t overcommitted = 0;  // CRITICAL allocations that pushed usage past the budget.
+};
+
+void initializeMemoryBudget(size_t budget);
+bool acquireMemory(MemoryPool pool, size_t bytes, MemoryPriority priority);
+void releaseMemory(MemoryPool pool, size_t bytes);
+MemoryStats getMemoryStats();
+void reportMemory();
+
+// Bytes referenced by FFmpeg objects, as charged against the budget.
+size_t packetMemory(const AVPacket* packet);
+size_t frameMemory(const AVFrame* frame);
+
+// Charge an allocated packet or frame against the budget. On failure the object is freed and the pointer is nulled.
+bool chargePacket(AVPacket*& packet, MemoryPriority priority);
+bool chargeFrame(AVFrame*& frame, MemoryPriority priority);
+
+// Copies the frame's buffers if they're shared, so it can be drawn on, and keeps the charge in step with the new buffers.
+bool makeFrameWritable(AVFrame* frame);
+
+// Free a charged packet or frame and release its memory from the budget. The object must not be unreferenced beforehand.
+void freePacket(AVPacket** packet);
+void freeFrame(AVFrame** frame);
@@ -1,67 +1,145 @@
 #pragma once
 
+#include <atomic>
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <optional>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 
 #include <tracy/Tracy.hpp>
 
+// Counters for tuning the capacity, they only ever increase.
+struct ChannelStats {
+    size_t capacity = 0;
+    uint64_t blockedUs = 0;  // Time writers spent waiting for room.
+    uint64_t pops = 0;
+    uint64_t queued = 0;  // Sum of the items left behind by each pop, for the mean occupancy.
+};
+
 // Simple blocking multithreaded queue.
 template <typename T>
 class Channel {
 public:
-    Channel(size_t maxSize);
+    // Named channels show up in the profiler, with their depth plotted under the name. The name must outlive the channel.
+    Channel(size_t maxSize, const char* name = nullptr);
     ~Channel() = default;
 
     void push(const T& element);
+
+    // Pushes only if there's room, never waits.
+    bool tryPush(const T& element);
     T pop();
     std::optional<T> tryPop();
 
+    // Waits up to the timeout for an element to arrive.
+    template <typename Rep, typename Period>
+    std::optional<T> popFor(const std::chrono::duration<Rep, Period>& timeout);
+
+    // Takes effect right away. Shrinking never drops anything, writers just wait until the queue is below the new capacity.
+    void setCapacity(size_t maxSize);
+    ChannelStats getStats();
+
+    // Time writers spent waiting for room. Cheap, doesn't take the lock.
+    uint64_t getBlockedUs() const { return blockedUs.load(std::memory_order_relaxed); }
+
 private:
+#ifdef TRACY_ENABLE
+    using Condition = std::condition_variable_any;  // The profiled mutex isn't a std::mutex.
+#else
+    using Condition = std::condition_variable;
+#endif
+
+    void plotDepth() const {
+        if (name) {
+            TracyPlot(name, static_cast<int64_t>(buffer.size()));
+        }
+    }
+
+    // Called with the lock held, after an element was taken.
+    void countPop() {
+        ++pops;
+        queued += buffer.size();
+        plotDepth();
+    }
+
     size_t maxQueueSize;
+    const char* name;
     std::queue<T> buffer{};
-    std::mutex lock{};
-    std::condition_variable dequeueVar{};
-    std::condition_variable enqueueVar{};
+    std::atomic<uint64_t> blockedUs{ 0 };
+    uint64_t pops = 0;
+    uint64_t queued = 0;
+    TracyLockable(std::mutex, lock);
+    Condition dequeueVar{};
+    Condition enqueueVar{};
 };
 
 template <typename T>
-inline Channel<T>::Channel(size_t maxSize) {
-    maxQueueSize = maxSize;
+inline Channel<T>::Channel(size_t maxSize, const char* name) : maxQueueSize(maxSize), name(name) {
+    if (name) {
+        LockableName(lock, name, strlen(name));
+    }
 }
 
 template <typename T>
 inline void Channel<T>::push(const T& element) {
-    //ZoneScoped;
+    ZoneScoped;
 
     {
-        std::unique_lock scopeLock{ lock };
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
 
         // Check if the queue has exceeded the set depth. If so, pause and wait for it to drain.
         if (maxQueueSize > 0 && buffer.size() >= maxQueueSize) {
+            const auto start = std::chrono::steady_clock::now();
             dequeueVar.wait(scopeLock, [this]() { return buffer.size() < maxQueueSize; });
+
+            const auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            blockedUs.fetch_add(waited.count(), std::memory_order_relaxed);
         }
 
         buffer.emplace(std::move(element));
+        plotDepth();
     }
 
     enqueueVar.notify_one();
 }
 
+template <typename T>
+inline bool Channel<T>::tryPush(const T& element) {
+    ZoneScoped;
+
+    {
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
+
+        if (maxQueueSize > 0 && buffer.size() >= maxQueueSize) {
+            return false;
+        }
+
+        buffer.emplace(std::move(element));
+        plotDepth();
+    }
+
+    enqueueVar.notify_one();
+
+    return true;
+}
+
 template <typename T>
 inline T Channel<T>::pop() {
-    //ZoneScoped;
+    ZoneScoped;
 
     T result;
     {
-        std::unique_lock scopeLock{ lock };
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
 
         // Wait until an element arrives in the buffer.
         enqueueVar.wait(scopeLock, [this]() { return !buffer.empty(); });
 
         result = std::move(buffer.front());
         buffer.pop();
+        countPop();
     }
 
     dequeueVar.notify_one();
@@ -69,17 +147,41 @@ inline T Channel<T>::pop() {
     return result;
 }
 
+template <typename T>
+template <typename Rep, typename Period>
+inline std::optional<T> Channel<T>::popFor(const std::chrono::duration<Rep, Period>& timeout) {
+    ZoneScoped;
+
+    std::optional<T> result{};
+    {
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
+
+        if (enqueueVar.wait_for(scopeLock, timeout, [this]() { return !buffer.empty(); })) {
+            result = std::move(buffer.front());
+            buffer.pop();
+            countPop();
+        }
+    }
+
+    if (result) {
+        dequeueVar.notify_one();
+    }
+
+    return result;
+}
+
 template <typename T>
 inline std::optional<T> Channel<T>::tryPop() {
-    //ZoneScoped;
+    ZoneScoped;
 
     std::optional<T> result{};
     {
-        std::unique_lock scopeLock{ lock };
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
 
         if (!buffer.empty()) {
             result = std::move(buffer.front());
             buffer.pop();
+            countPop();
         }
     }
 
@@ -89,3 +191,21 @@ inline std::optional<T> Channel<T>::tryPop() {
 
     return result;
 }
+
+template <typename T>
+inline void Channel<T>::setCapacity(size_t maxSize) {
+    {
+        std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
+        maxQueueSize = maxSize;
+    }
+
+    // Writers waiting on the old capacity may fit now.
+    dequeueVar.notify_all();
+}
+
+template <typename T>
+inline ChannelStats Channel<T>::getStats() {
+    std::unique_lock<LockableBase(std::mutex)> scopeLock{ lock };
+
+    return ChannelStats{ .capacity = maxQueueSize, .blockedUs = getBlockedUs(), .pops = pops, .queued = queued };
+}
@@ -0,0 +1,526 @@
+#include "config.h"
+
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <sched.h>
+
+#include <tracy/Tracy.hpp>
+
+Config config{};
+
+bool parseInt(const std::string& value, long long& result) {
+    try {
+        size_t end = 0;
+        result = std::stoll(value, &end);
+
+        return end == value.size();
+    } catch (...) {
+        return false;
+    }
+}
+
+std::string trim(const std::string& text) {
+    const auto first = text.find_first_not_of(" \t\r");
+    if (first == std::string::npos) {
+        return {};
+    }
+
+    const auto last = text.find_last_not_of(" \t\r");
+
+    return text.substr(first, last - first + 1);
+}
+
+// Parses the value and stores it in the config. Returns false if the value is malformed.
+using ConfigSetter = std::function<bool(Config&, const std::string&)>;
+
+ConfigSetter intSetting(int Config::*field, long long min, long long max) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < min || result > max) {
+            return false;
+        }
+
+        target.*field = static_cast<int>(result);
+
+        return true;
+    };
+}
+
+ConfigSetter boolSetting(bool Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        if (value == "true" || value == "1") {
+            target.*field = true;
+        } else if (value == "false" || value == "0") {
+            target.*field = false;
+        } else {
+            return false;
+        }
+
+        return true;
+    };
+}
+
+ConfigSetter millisecondSetting(std::chrono::milliseconds Config::*field, long long min, long long max) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < min || result > max) {
+            return false;
+        }
+
+        target.*field = std::chrono::milliseconds{ result };
+
+        return true;
+    };
+}
+
+ConfigSetter kilobyteSetting(size_t Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < 4) {
+            return false;
+        }
+
+        target.*field = static_cast<size_t>(result) * 1024ULL;
+
+        return true;
+    };
+}
+
+// Stored as a fraction.
+ConfigSetter percentSetting(double Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < 1 || result > 100) {
+            return false;
+        }
+
+        target.*field = result / 100.0;
+
+        return true;
+    };
+}
+
+ConfigSetter layoutSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, PipelineLayout> layouts{
+            { "threaded", PipelineLayout::THREADED },
+            { "fused", PipelineLayout::FUSED },
+            { "compact", PipelineLayout::COMPACT }
+        };
+
+        if (auto layout = layouts.find(value); layout != layouts.end()) {
+            target.pipelineLayout = layout->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter doubleSetting(double Config::*field, double min, double max) {
+    return [=](Config& target, const std::string& value) {
+        try {
+            size_t end = 0;
+            const auto result = std::stod(value, &end);
+            if (end != value.size() || result < min || result > max) {
+                return false;
+            }
+
+            target.*field = result;
+
+            return true;
+        } catch (...) {
+            return false;
+        }
+    };
+}
+
+ConfigSetter parkingModeSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, ParkingMode> modes{
+            { "reduced_rate", ParkingMode::REDUCED_RATE },
+            { "keyframes", ParkingMode::KEYFRAMES },
+            { "pause", ParkingMode::PAUSE }
+        };
+
+        if (auto mode = modes.find(value); mode != modes.end()) {
+            target.parkingMode = mode->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter overlayPositionSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, OverlayPosition> positions{
+            { "top_left", OverlayPosition::TOP_LEFT },
+            { "top_right", OverlayPosition::TOP_RIGHT },
+            { "bottom_left", OverlayPosition::BOTTOM_LEFT },
+            { "bottom_right", OverlayPosition::BOTTOM_RIGHT }
+        };
+
+        if (auto position = positions.find(value); position != positions.end()) {
+            target.overlayPosition = position->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter uploadAuthSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, UploadAuth> modes{
+            { "none", UploadAuth::NONE },
+            { "bearer", UploadAuth::BEARER },
+            { "command", UploadAuth::COMMAND }
+        };
+
+        if (auto mode = modes.find(value); mode != modes.end()) {
+            target.uploadAuth = mode->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter uploadOrderSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, UploadOrder> orders{
+            { "newest", UploadOrder::NEWEST },
+            { "oldest", UploadOrder::OLDEST }
+        };
+
+        if (auto order = orders.find(value); order != orders.end()) {
+            target.uploadOrder = order->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter logLevelSetting() {
+    return [](Config& target, const std::string& value) {
+        static const std::map<std::string, LogLevel> levels{
+            { "debug", LogLevel::DEBUG },
+            { "info", LogLevel::INFO },
+            { "warning", LogLevel::WARNING },
+            { "error", LogLevel::ERROR }
+        };
+
+        if (auto level = levels.find(value); level != levels.end()) {
+            target.logLevel = level->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter stringSetting(std::string Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        if (value.empty()) {
+            return false;
+        }
+
+        target.*field = value;
+
+        return true;
+    };
+}
+
+ConfigSetter kilobitSetting(int64_t Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < 1) {
+            return false;
+        }
+
+        target.*field = result * 1000;
+
+        return true;
+    };
+}
+
+ConfigSetter megabyteSetting(size_t Config::*field) {
+    return [=](Config& target, const std::string& value) {
+        long long result;
+        if (!parseInt(value, result) || result < 1) {
+            return false;
+        }
+
+        target.*field = static_cast<size_t>(result) * 1024ULL * 1024ULL;
+
+        return true;
+    };
+}
+
+// Accepts a comma separated list of CPUs or CPU ranges, e.g. "0,2-3".
+ConfigSetter cpuSetting(size_t stage) {
+    return [=](Config& target, const std::string& value) {
+        std::vector<int> cpus;
+        std::stringstream list{ value };
+        std::string item;
+
+        while (std::getline(list, item, ',')) {
+            item = trim(item);
+
+            long long first, last;
+            if (auto dash = item.find('-'); dash != std::string::npos) {
+                if (!parseInt(item.substr(0, dash), first) || !parseInt(item.substr(dash + 1), last)) {
+                    return false;
+                }
+            } else if (parseInt(item, first)) {
+                last = first;
+            } else {
+                return false;
+            }
+
+            if (first < 0 || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+
+            for (auto cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+
+        target.schedules[stage].cpus = cpus;
+
+        return true;
+    };
+}
+
+ConfigSetter policySetting(size_t stage) {
+    return [=](Config& target, const std::string& value) {
+        static const std::map<std::string, SchedulePolicy> policies{
+            { "other", SchedulePolicy::OTHER },
+            { "batch", SchedulePolicy::BATCH },
+            { "idle", SchedulePolicy::IDLE },
+            { "fifo", SchedulePolicy::FIFO },
+            { "rr", SchedulePolicy::RR }
+        };
+
+        if (auto policy = policies.find(value); policy != policies.end()) {
+            target.schedules[stage].policy = policy->second;
+            return true;
+        }
+
+        return false;
+    };
+}
+
+ConfigSetter prioritySetting(size_t stage) {
+    return [=](Config& target, const std::string& value) {
+        // Covers both niceness (-20 to 19) and real-time priorities (1 to 99), the policy determines which applies.
+        long long result;
+        if (!parseInt(value, result) || result < -20 || result > 99) {
+            return false;
+        }
+
+        target.schedules[stage].priority = static_cast<int>(result);
+
+        return true;
+    };
+}
+
+// Accepts "none", "idle", or "rt:<level>" and "be:<level>" with a level from 0 (highest) to 7.
+ConfigSetter ioSetting(size_t stage) {
+    return [=](Config& target, const std::string& value) {
+        auto& schedule = target.schedules[stage];
+
+        if (value == "none" || value == "idle") {
+            schedule.ioClass = value == "none" ? IoClass::NONE : IoClass::IDLE;
+            return true;
+        }
+
+        const auto separator = value.find(':');
+        if (separator == std::string::npos) {
+            return false;
+        }
+
+        const auto ioClass = value.substr(0, separator);
+        long long level;
+        if (!parseInt(value.substr(separator + 1), level) || level < 0 || level > 7) {
+            return false;
+        }
+
+        if (ioClass == "rt") {
+            schedule.ioClass = IoClass::REALTIME;
+        } else if (ioClass == "be") {
+            schedule.ioClass = IoClass::BEST_EFFORT;
+        } else {
+            return false;
+        }
+
+        schedule.ioLevel = static_cast<int>(level);
+
+        return true;
+    };
+}
+
+std::map<std::string, ConfigSetter> buildSettings() {
+    std::map<std::string, ConfigSetter> settings{
+        { "memory.budget_mb", megabyteSetting(&Config::memoryBudget) },
+        { "encoder.output_buffers", intSetting(&Config::encoderOutputBuffers, 1, 256) },
+        { "encoder.capture_buffers", intSetting(&Config::encoderCaptureBuffers, 1, 256) },
+        { "encoder.bitrate_kbps", kilobitSetting(&Config::encoderBitRate) },
+        { "retention.hours", intSetting(&Config::retentionHours, 0, 24 * 365) },
+        { "retention.min_bitrate_kbps", kilobitSetting(&Config::retentionMinBitRate) },
+        { "retention.max_bitrate_kbps", kilobitSetting(&Config::retentionMaxBitRate) },
+        { "retention.interval_ms", millisecondSetting(&Config::retentionInterval, 1000, 3600000) },
+        { "segment.max_duration_ms", millisecondSetting(&Config::segmentMaxDuration, 0, 86400000) },
+        { "segment.max_size_mb", megabyteSetting(&Config::segmentMaxSize) },
+        { "pipeline.layout", layoutSetting() },
+        { "pipeline.auto_depth", boolSetting(&Config::pipelineAutoDepth) },
+        { "pipeline.depth", intSetting(&Config::pipelineDepth, 1, 64) },
+        { "pipeline.max_depth", intSetting(&Config::pipelineMaxDepth, 1, 64) },
+        { "pipeline.max_latency_ms", millisecondSetting(&Config::pipelineMaxLatency, 10, 10000) },
+        { "parking.enabled", boolSetting(&Config::parkingEnabled) },
+        { "parking.threshold", doubleSetting(&Config::parkingThreshold, 0.0, 255.0) },
+        { "parking.idle_seconds", intSetting(&Config::parkingIdleSeconds, 1, 86400) },
+        { "parking.mode", parkingModeSetting() },
+        { "parking.interval_ms", millisecondSetting(&Config::parkingInterval, 1, 600000) },
+        { "proxy.enabled", boolSetting(&Config::proxyEnabled) },
+        { "proxy.width", intSetting(&Config::proxyWidth, 16, 1920) },
+        { "proxy.height", intSetting(&Config::proxyHeight, 16, 1080) },
+        { "proxy.fps", intSetting(&Config::proxyFrameRate, 1, 60) },
+        { "proxy.bitrate_kbps", kilobitSetting(&Config::proxyBitRate) },
+        { "proxy.encoder", stringSetting(&Config::proxyEncoder) },
+        { "overlay.enabled", boolSetting(&Config::overlayEnabled) },
+        { "overlay.position", overlayPositionSetting() },
+        { "overlay.scale", intSetting(&Config::overlayScale, 2, 16) },
+        { "overlay.margin", intSetting(&Config::overlayMargin, 0, 540) },
+        { "overlay.time_format", stringSetting(&Config::overlayTimeFormat) },
+        { "overlay.speed_file", stringSetting(&Config::overlaySpeedFile) },
+        { "thumbnail.enabled", boolSetting(&Config::thumbnailEnabled) },
+        { "thumbnail.interval_ms", millisecondSetting(&Config::thumbnailInterval, 100, 3600000) },
+        { "thumbnail.width", intSetting(&Config::thumbnailWidth, 16, 640) },
+        { "thumbnail.height", intSetting(&Config::thumbnailHeight, 16, 360) },
+        { "thumbnail.columns", intSetting(&Config::thumbnailColumns, 1, 32) },
+        { "thumbnail.rows", intSetting(&Config::thumbnailRows, 1, 32) },
+        { "thumbnail.quality", intSetting(&Config::thumbnailQuality, 2, 31) },
+        { "upload.url", stringSetting(&Config::uploadUrl) },
+        { "upload.auth", uploadAuthSetting() },
+        { "upload.token_file", stringSetting(&Config::uploadTokenFile) },
+        { "upload.auth_command", stringSetting(&Config::uploadAuthCommand) },
+        { "upload.chunk_kb", kilobyteSetting(&Config::uploadChunkSize) },
+        { "upload.connections", intSetting(&Config::uploadConnections, 1, 16) },
+        { "upload.retries", intSetting(&Config::uploadRetries, 1, 100) },
+        { "upload.timeout_ms", millisecondSetting(&Config::uploadTimeout, 1000, 600000) },
+        { "upload.order", uploadOrderSetting() },
+        { "upload.concurrent", boolSetting(&Config::uploadConcurrent) },
+        { "upload.poll_ms", millisecondSetting(&Config::uploadPollInterval, 1000, 3600000) },
+        { "upload.min_cpu_percent", percentSetting(&Config::uploadMinCpuShare) },
+        { "upload.max_cpu_percent", percentSetting(&Config::uploadMaxCpuShare) },
+        { "upload.min_bandwidth_kbps", kilobitSetting(&Config::uploadMinBitRate) },
+        { "upload.max_bandwidth_kbps", kilobitSetting(&Config::uploadMaxBitRate) },
+        { "log.level", logLevelSetting() },
+        { "log.window_ms", millisecondSetting(&Config::logWindow, 100, 600000) },
+        { "log.limit", intSetting(&Config::logLimit, 1, 1000) },
+        { "output.block_kb", kilobyteSetting(&Config::outputBlockSize) },
+        { "output.flush_ms", millisecondSetting(&Config::outputFlushDeadline, 1, 60000) },
+        { "output.flush_on_keyframe", boolSetting(&Config::outputFlushOnKeyframe) },
+        { "codec.decoder_contexts", intSetting(&Config::decoderContexts, 0, 16) },
+        { "codec.decoder_threads", intSetting(&Config::decoderThreads, 0, 64) },
+        { "codec.encoder_threads", intSetting(&Config::encoderThreads, 0, 64) },
+        { "codec.filter_threads", intSetting(&Config::filterThreads, 0, 64) },
+        { "fault.warmup_ms", millisecondSetting(&Config::faultWarmup, 1000, 600000) },
+        { "fault.seed", intSetting(&Config::faultSeed, 0, 2147483647) },
+        { "fault.allowed_lost_frames", intSetting(&Config::faultAllowedLostFrames, 0, 2147483647) },
+        { "fault.write_latency_ms", millisecondSetting(&Config::faultWriteLatency, 0, 60000) },
+        { "fault.write_jitter_ms", millisecondSetting(&Config::faultWriteJitter, 0, 60000) },
+        { "fault.write_stall_ms", millisecondSetting(&Config::faultWriteStall, 0, 600000) },
+        { "fault.write_stall_interval_ms", millisecondSetting(&Config::faultWriteStallInterval, 1000, 3600000) },
+        { "fault.disk_full_ms", millisecondSetting(&Config::faultDiskFull, 0, 600000) },
+        { "fault.disk_full_interval_ms", millisecondSetting(&Config::faultDiskFullInterval, 1000, 3600000) },
+        { "fault.short_write_percent", doubleSetting(&Config::faultShortWritePercent, 0.0, 100.0) },
+        { "fault.frame_drop_percent", doubleSetting(&Config::faultFrameDropPercent, 0.0, 100.0) },
+        { "fault.frame_delay_percent", doubleSetting(&Config::faultFrameDelayPercent, 0.0, 100.0) },
+        { "fault.frame_delay_ms", millisecondSetting(&Config::faultFrameDelay, 0, 60000) },
+        { "fault.corrupt_percent", doubleSetting(&Config::faultCorruptPercent, 0.0, 100.0) },
+        { "fault.disconnect_ms", millisecondSetting(&Config::faultDisconnect, 0, 600000) },
+        { "fault.disconnect_interval_ms", millisecondSetting(&Config::faultDisconnectInterval, 1000, 3600000) },
+    };
+
+    for (size_t stage = 0; stage < static_cast<size_t>(Stage::COUNT); ++stage) {
+        const auto prefix = std::string{ "schedule." } + getStageName(static_cast<Stage>(stage));
+
+        settings.emplace(prefix + ".cpus", cpuSetting(stage));
+        settings.emplace(prefix + ".policy", policySetting(stage));
+        settings.emplace(prefix + ".priority", prioritySetting(stage));
+        settings.emplace(prefix + ".io", ioSetting(stage));
+    }
+
+    return settings;
+}
+
+const std::map<std::string, ConfigSetter>& getSettings() {
+    static const auto settings = buildSettings();
+
+    return settings;
+}
+
+bool loadConfig(const std::string& path) {
+    ZoneScoped;
+
+    std::ifstream file{ path };
+    if (!file.is_open()) {
+        std::cout << "No config file found at '" << path << "', using defaults.\n";
+        return true;
+    }
+
+    const auto& settings = getSettings();
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        ++lineNumber;
+
+        // Strip comments.
+        if (auto comment = line.find('#'); comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+
+        const auto separator = line.find('=');
+        if (separator == std::string::npos) {
+            std::cerr << "Config line " << lineNumber << " is missing '='.\n";
+            return false;
+        }
+
+        const auto key = trim(line.substr(0, separator));
+        const auto value = trim(line.substr(separator + 1));
+
+        const auto setting = settings.find(key);
+        if (setting == settings.end()) {
+            std::cerr << "Unknown config key '" << key << "' on line " << lineNumber << ".\n";
+            return false;
+        }
+
+        if (!setting->second(config, value)) {
+            std::cerr << "Invalid value '" << value << "' for config key '" << key << "' on line " << lineNumber << ".\n";
+            return false;
+        }
+    }
+
+    std::cout << "Loaded config file '" << path << "'.\n";
+
+    return true;
+}
+
+const Config& getConfig() {
+    return config;
+}
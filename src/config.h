@@ -0,0 +1,197 @@
+#pragma once
+
+#include "schedule.h"
+
+#include <cstddef>
+#include <string>
+#include <chrono>
+
+constexpr const char* defaultConfigLocation = "./dashcam.conf";
+
+// Thread layouts for the recording pipeline, see run.cpp.
+enum class PipelineLayout : uint8_t {
+    THREADED = 0,  // One thread per stage.
+    FUSED = 1,  // Decode and filter share a thread, as do encode and output.
+    COMPACT = 2  // Capture on one thread, everything else on another.
+};
+
+// What the pipeline records while parked.
+enum class ParkingMode : uint8_t {
+    REDUCED_RATE = 0,  // One frame per interval, encoded normally.
+    KEYFRAMES = 1,  // One frame per interval, each encoded as a keyframe.
+    PAUSE = 2  // Nothing until motion is detected.
+};
+
+// Corner of the frame the overlay text is drawn in.
+enum class OverlayPosition : uint8_t {
+    TOP_LEFT = 0,
+    TOP_RIGHT = 1,
+    BOTTOM_LEFT = 2,
+    BOTTOM_RIGHT = 3
+};
+
+// How the native uploader authenticates.
+enum class UploadAuth : uint8_t {
+    NONE = 0,
+    BEARER = 1,  // Token read from a file.
+    COMMAND = 2  // Authorization header value printed by a command, run again when the server rejects it.
+};
+
+// Order of segments of equal priority in the upload queue.
+enum class UploadOrder : uint8_t {
+    NEWEST = 0,
+    OLDEST = 1
+};
+
+// Severity of a log message, see log.h.
+enum class LogLevel : uint8_t {
+    DEBUG = 0,
+    INFO = 1,
+    WARNING = 2,
+    ERROR = 3
+};
+
+// Runtime configuration, loaded from a simple "key = value" file. Every setting has a default, so the file is optional.
+struct Config {
+    // Hard limit on the bytes held by the recording pipeline (packets, frames, write buffers, ring buffers and codec buffers).
+    size_t memoryBudget = 256ULL * 1024ULL * 1024ULL;  // memory.budget_mb
+
+    // Buffers requested from the v4l2m2m encoder. These are allocated by the driver, so they're reserved against the budget up front.
+    int encoderOutputBuffers = 16;  // encoder.output_buffers, raw frames queued into the encoder.
+    int encoderCaptureBuffers = 64;  // encoder.capture_buffers, encoded packets queued out of the encoder. An upper bound when tuned.
+    int64_t encoderBitRate = 200000000;  // encoder.bitrate_kbps, the starting point when sized for retention.
+
+    // Retention target. The encoder's bitrate is sized so that the card holds this many hours of recordings, from the space the
+    // recordings can use and the measured output, and kept between the floor and ceiling so quality never drops below a usable level.
+    int retentionHours = 0;  // retention.hours, 0 keeps the fixed encoder.bitrate_kbps.
+    int64_t retentionMinBitRate = 2000000;  // retention.min_bitrate_kbps
+    int64_t retentionMaxBitRate = 200000000;  // retention.max_bitrate_kbps
+    std::chrono::milliseconds retentionInterval{ 60000 };  // retention.interval_ms, time between adjustments.
+
+    // Segments end at whichever bound is reached first, always on a keyframe. Small segments are culled and uploaded in small steps, and
+    // a crash costs at most the one being written.
+    std::chrono::milliseconds segmentMaxDuration{ 60000 };  // segment.max_duration_ms, 0 bounds segments by size alone.
+    size_t segmentMaxSize = 64ULL * 1024ULL * 1024ULL;  // segment.max_size_mb
+
+    PipelineLayout pipelineLayout = PipelineLayout::THREADED;  // pipeline.layout: threaded, fused or compact
+
+    // Capacity of the channels between pipeline threads. A low depth can restrict parallelism, a high one adds latency and holds more
+    // frames in memory. When tuned, each channel starts at the configured depth and follows the measured service times, see tuning.h.
+    bool pipelineAutoDepth = true;  // pipeline.auto_depth, also tunes encoder.capture_buffers.
+    int pipelineDepth = 2;  // pipeline.depth
+    int pipelineMaxDepth = 8;  // pipeline.max_depth
+    std::chrono::milliseconds pipelineMaxLatency{ 500 };  // pipeline.max_latency_ms, time items may wait in a channel before it's shrunk.
+
+    // Parking mode, entered after the scene has been still for a while. Motion restores the full frame rate on the next frame.
+    bool parkingEnabled = true;  // parking.enabled
+    double parkingThreshold = 3.0;  // parking.threshold, mean absolute luma difference per 8x8 cell between consecutive frames.
+    int parkingIdleSeconds = 30;  // parking.idle_seconds
+    ParkingMode parkingMode = ParkingMode::REDUCED_RATE;  // parking.mode: reduced_rate, keyframes or pause
+    std::chrono::milliseconds parkingInterval{ 1000 };  // parking.interval_ms, time between kept frames while parked.
+
+    // Proxy stream, a downscaled copy of the recording written next to each segment. Frames are only handed to the proxy when it has
+    // room for them, so it never holds back the main recording.
+    bool proxyEnabled = true;  // proxy.enabled
+    int proxyWidth = 854;  // proxy.width
+    int proxyHeight = 480;  // proxy.height
+    int proxyFrameRate = 5;  // proxy.fps
+    int64_t proxyBitRate = 500000;  // proxy.bitrate_kbps
+    std::string proxyEncoder = "h264_v4l2m2m";  // proxy.encoder, falls back to libx264 if it can't be opened.
+
+    // Text burned into the recording and the proxy, drawn from a bitmap font prerendered at startup. Only digits, space, ":-./" and the
+    // letters of "km/h" are drawn, anything else in the time format comes out blank.
+    bool overlayEnabled = true;  // overlay.enabled
+    OverlayPosition overlayPosition = OverlayPosition::BOTTOM_LEFT;  // overlay.position: top_left, top_right, bottom_left or bottom_right
+    int overlayScale = 4;  // overlay.scale, pixels per dot of the 5x7 font.
+    int overlayMargin = 16;  // overlay.margin, pixels from the edges of the frame.
+    std::string overlayTimeFormat = "%Y-%m-%d %H:%M:%S";  // overlay.time_format, strftime in local time.
+    std::string overlaySpeedFile{};  // overlay.speed_file, holds the current speed in km/h, e.g. written by a GPS daemon. Empty for none.
+
+    // Thumbnail sprite sheets, a grid of small JPEG tiles taken from the decoded frames at a fixed interval, with an index per segment.
+    bool thumbnailEnabled = true;  // thumbnail.enabled
+    std::chrono::milliseconds thumbnailInterval{ 10000 };  // thumbnail.interval_ms
+    int thumbnailWidth = 160;  // thumbnail.width
+    int thumbnailHeight = 90;  // thumbnail.height
+    int thumbnailColumns = 10;  // thumbnail.columns
+    int thumbnailRows = 10;  // thumbnail.rows
+    int thumbnailQuality = 5;  // thumbnail.quality, JPEG quantizer from 2 (best) to 31.
+
+    // Native resumable uploader. Files are split into chunks, several of which are in flight at once over persistent connections. Progress
+    // is kept next to each file, so interrupted uploads resume from the last chunk the server acknowledged.
+    std::string uploadUrl{};  // upload.url, empty falls back to python/upload.py.
+    UploadAuth uploadAuth = UploadAuth::NONE;  // upload.auth: none, bearer or command
+    std::string uploadTokenFile = "./upload.token";  // upload.token_file
+    std::string uploadAuthCommand{};  // upload.auth_command
+    size_t uploadChunkSize = 4ULL * 1024ULL * 1024ULL;  // upload.chunk_kb
+    int uploadConnections = 4;  // upload.connections
+    int uploadRetries = 8;  // upload.retries, attempts per chunk before the file is left for the next run.
+    std::chrono::milliseconds uploadTimeout{ 30000 };  // upload.timeout_ms, for connecting and for any single send or receive.
+    UploadOrder uploadOrder = UploadOrder::NEWEST;  // upload.order: newest or oldest, after protected segments and companion files.
+
+    // Uploading while recording. The upload path is throttled by CPU share, I/O priority (schedule.upload) and bandwidth, and the caps
+    // follow the recorder's health between these bounds.
+    bool uploadConcurrent = true;  // upload.concurrent, false picks either recording or uploading at boot.
+    std::chrono::milliseconds uploadPollInterval{ 60000 };  // upload.poll_ms, time between connectivity checks.
+    double uploadMinCpuShare = 0.05;  // upload.min_cpu_percent
+    double uploadMaxCpuShare = 0.5;  // upload.max_cpu_percent
+    int64_t uploadMinBitRate = 256000;  // upload.min_bandwidth_kbps
+    int64_t uploadMaxBitRate = 20000000;  // upload.max_bandwidth_kbps
+
+    // Logging. Messages from one call site past the limit are counted and summarized at the end of the window instead of printed.
+    LogLevel logLevel = LogLevel::INFO;  // log.level: debug, info, warning or error
+    std::chrono::milliseconds logWindow{ 5000 };  // log.window_ms
+    int logLimit = 5;  // log.limit, messages per call site per window.
+
+    // Output write coalescing. Packets are collected into page-aligned blocks and flushed when full or after the deadline, which bounds
+    // the data lost on power failure.
+    size_t outputBlockSize = 1024ULL * 1024ULL;  // output.block_kb
+    std::chrono::milliseconds outputFlushDeadline{ 2000 };  // output.flush_ms
+    bool outputFlushOnKeyframe = false;  // output.flush_on_keyframe
+
+    // MJPEG decoders running side by side, each on its own thread, with the frames put back in capture order. FFmpeg can't frame thread
+    // MJPEG, so this is what scales decoding across cores. 0 uses one per CPU allowed for the decode stage.
+    int decoderContexts = 0;  // codec.decoder_contexts
+
+    // Threads used internally by FFmpeg, 0 lets FFmpeg decide. Capping these keeps them off the cores reserved for pipeline stages.
+    // Decoders only use their own threads when there's a single decoder context.
+    int decoderThreads = 0;  // codec.decoder_threads
+    int encoderThreads = 0;  // codec.encoder_threads
+    int filterThreads = 0;  // codec.filter_threads
+
+    // Fault scenarios, only in builds made with --faults=true and run with -f, see faults.h. Periodic faults first strike when the warm-up
+    // is over and then once every interval, lasting their duration. Percentages are per frame or per write.
+    std::chrono::milliseconds faultWarmup{ 5000 };  // fault.warmup_ms, also sets the healthy latency recovery is measured against.
+    int faultSeed = 1;  // fault.seed
+    int faultAllowedLostFrames = 0;  // fault.allowed_lost_frames, losing more fails the scenario.
+    std::chrono::milliseconds faultWriteLatency{ 0 };  // fault.write_latency_ms, added to every write.
+    std::chrono::milliseconds faultWriteJitter{ 0 };  // fault.write_jitter_ms, mean of an exponentially distributed extra latency.
+    std::chrono::milliseconds faultWriteStall{ 0 };  // fault.write_stall_ms, writes block like on an SD card collecting garbage.
+    std::chrono::milliseconds faultWriteStallInterval{ 30000 };  // fault.write_stall_interval_ms
+    std::chrono::milliseconds faultDiskFull{ 0 };  // fault.disk_full_ms, writes fail with ENOSPC.
+    std::chrono::milliseconds faultDiskFullInterval{ 60000 };  // fault.disk_full_interval_ms
+    double faultShortWritePercent = 0.0;  // fault.short_write_percent, writes that only take part of the data.
+    double faultFrameDropPercent = 0.0;  // fault.frame_drop_percent, frames the camera never delivers.
+    double faultFrameDelayPercent = 0.0;  // fault.frame_delay_percent
+    std::chrono::milliseconds faultFrameDelay{ 0 };  // fault.frame_delay_ms, the frames behind a delayed one wait too.
+    double faultCorruptPercent = 0.0;  // fault.corrupt_percent, frames delivered with a damaged header.
+    std::chrono::milliseconds faultDisconnect{ 0 };  // fault.disconnect_ms, the camera drops off the bus and can't be reopened.
+    std::chrono::milliseconds faultDisconnectInterval{ 60000 };  // fault.disconnect_interval_ms
+
+    // Per-stage scheduling: schedule.<stage>.cpus, .policy, .priority and .io
+    // Capture runs real-time so its cadence isn't disturbed by the codec threads, output runs real-time with a high I/O priority so it
+    // can keep draining the pipeline.
+    StageSchedule schedules[static_cast<size_t>(Stage::COUNT)]{
+        { {}, SchedulePolicy::FIFO, 50 },  // input
+        {},  // decode
+        {},  // filter
+        {},  // encode
+        { {}, SchedulePolicy::RR, 40, IoClass::BEST_EFFORT, 0 },  // output
+        { {}, SchedulePolicy::OTHER, 10, IoClass::BEST_EFFORT, 7 },  // proxy, never at the expense of the main recording.
+        { {}, SchedulePolicy::IDLE, 0, IoClass::IDLE },  // thumbnail, only runs on otherwise idle CPU time.
+        { {}, SchedulePolicy::OTHER, 19, IoClass::BEST_EFFORT, 7 }  // upload, inherited by the converter.
+    };
+};
+
+// Loads the configuration file at the given path. A missing file is not an error, the defaults are used instead.
+bool loadConfig(const std::string& path);
+const Config& getConfig();
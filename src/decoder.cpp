@@ -0,0 +1,149 @@
+#include "decoder.h"
+#include "budget.h"
+#include "schedule.h"
+#include "recovery.h"
+#include "profile.h"
+#include "log.h"
+
+#include <algorithm>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+// A corrupt MJPEG frame only costs that frame. Anything else flushes the decoder, which is all it takes to get a clean state back.
+void recoverDecoder(AVCodecContext* decoder, int error) {
+    char buffer[256];
+    av_make_error_string(buffer, sizeof(buffer), error);
+
+    if (const auto errorClass = classifyError(error); errorClass == ErrorClass::CORRUPT_DATA || errorClass == ErrorClass::TRANSIENT) {
+        logWarning("Skipped a frame the decoder rejected: %s", buffer);
+        recordRecovery(RecoveryAction::SKIP_FRAME);
+        return;
+    }
+
+    logWarning("Decoding error: %s, resetting the decoder.", buffer);
+    avcodec_flush_buffers(decoder);
+    recordRecovery(RecoveryAction::RESET_DECODER);
+}
+
+void decodePacket(AVCodecContext* decoder, AVPacket* packet, std::vector<AVFrame*>& frames, MemoryPriority priority) {
+    int ret;
+    {
+        ZoneScopedN("decoder_fill");
+
+        if (ret = avcodec_send_packet(decoder, packet); ret < 0) {
+            recoverDecoder(decoder, ret);
+        }
+    }
+
+    // Cleanup
+    freePacket(&packet);
+
+    while (ret >= 0) {
+        auto* frame = av_frame_alloc();
+
+        {
+            ZoneScopedN("decoder_drain");
+            ret = avcodec_receive_frame(decoder, frame);
+        }
+
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            // Finished the job, return to the parent loop.
+            av_frame_free(&frame);
+            break;
+        } else if (ret < 0) {
+            av_frame_free(&frame);
+            recoverDecoder(decoder, ret);
+            break;
+        }
+
+        // Wait for downstream stages to free up memory if they can, see record(). If they're stalled for too long, lose this frame.
+        if (!chargeFrame(frame, priority)) {
+            logWarning("Over memory budget, dropped a decoded frame.");
+            continue;
+        }
+
+        frames.push_back(frame);
+    }
+}
+
+DecoderPool::DecoderPool(const std::vector<AVCodecContext*>& decoders, size_t window, MemoryPriority priority)
+    : window(std::max(window, decoders.size())), priority(priority) {
+    // Each queue can take the whole window, so submitting never blocks.
+    for (auto* decoder : decoders) {
+        auto& jobs = *queues.emplace_back(std::make_unique<Channel<Job>>(this->window, "decoder pool"));
+        workers.push_back(std::thread{ &DecoderPool::worker, this, decoder, std::ref(jobs) });
+    }
+}
+
+DecoderPool::~DecoderPool() {
+    for (auto& jobs : queues) {
+        jobs->push(Job{});
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // Whatever wasn't collected is lost with the session.
+    for (auto& [sequence, frames] : done) {
+        for (auto* frame : frames) {
+            freeFrame(&frame);
+        }
+    }
+}
+
+void DecoderPool::submit(AVPacket* packet) {
+    queues[submitted % queues.size()]->push(Job{ .sequence = submitted, .packet = packet });
+    ++submitted;
+}
+
+void DecoderPool::collect(std::vector<AVFrame*>& frames, bool wait) {
+    std::unique_lock scopeLock{ lock };
+
+    if (wait && collected < submitted) {
+        ZoneScopedN("decoder_pool_wait");
+        finished.wait(scopeLock, [this]() { return done.count(collected) > 0; });
+    }
+
+    // Everything at the head of the order that's done, stopping at the first gap.
+    for (auto entry = done.find(collected); entry != done.end(); entry = done.find(collected)) {
+        frames.insert(frames.end(), entry->second.begin(), entry->second.end());
+        done.erase(entry);
+        ++collected;
+    }
+}
+
+void DecoderPool::worker(AVCodecContext* decoder, Channel<Job>& jobs) {
+    applySchedule(Stage::DECODE);
+
+    std::vector<AVFrame*> frames;
+
+    while (true) {
+        auto job = jobs.pop();
+        if (!job.packet) {
+            break;
+        }
+
+        {
+            ZoneScopedN("decode_job");
+            ZoneFrameId(job.packet);
+
+            // A packet that produced nothing still takes its place in the order, or everything after it would wait forever.
+            decodePacket(decoder, job.packet, frames, priority);
+        }
+
+        {
+            std::scoped_lock scopeLock{ lock };
+            done.emplace(job.sequence, std::move(frames));
+        }
+
+        finished.notify_one();
+        frames.clear();
+    }
+}
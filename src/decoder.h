@@ -0,0 +1,65 @@
+#pragma once
+
+#include "channel.h"
+#include "budget.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct AVPacket;
+struct AVFrame;
+struct AVCodecContext;
+
+// Decodes a packet, charging each frame against the memory budget with the given priority and recovering from errors in place. A corrupt
+// packet costs only itself, anything else flushes the decoder. Takes ownership of the packet, frames are appended in order.
+void decodePacket(AVCodecContext* decoder, AVPacket* packet, std::vector<AVFrame*>& frames, MemoryPriority priority);
+
+// Decodes on several threads at once, each with its own decoder, and hands the frames back in capture order. MJPEG frames don't depend
+// on each other, so independent decoders produce exactly what a single one would, and throughput scales with the cores until they're
+// saturated. Packets are dealt out round robin and numbered, finished frames wait in a reorder buffer until everything before them is
+// done.
+class DecoderPool {
+public:
+    // The decoders must be open and stay alive for the pool's lifetime. Window is the number of packets allowed in flight, frames are
+    // charged with the given priority.
+    DecoderPool(const std::vector<AVCodecContext*>& decoders, size_t window, MemoryPriority priority);
+    ~DecoderPool();
+
+    DecoderPool(const DecoderPool&) = delete;
+    DecoderPool& operator=(const DecoderPool&) = delete;
+
+    // Hands the packet to the next decoder in turn, taking ownership. Must only be called while there's room in the window.
+    void submit(AVPacket* packet);
+
+    // Appends the frames of the finished packets at the head of the order. With wait, blocks until the oldest packet in flight is done.
+    void collect(std::vector<AVFrame*>& frames, bool wait);
+
+    size_t getInFlight() const { return submitted - collected; }
+    size_t getWindow() const { return window; }
+
+private:
+    struct Job {
+        uint64_t sequence = 0;
+        AVPacket* packet = nullptr;  // Null stops the worker.
+    };
+
+    void worker(AVCodecContext* decoder, Channel<Job>& jobs);
+
+    size_t window;
+    MemoryPriority priority;
+    uint64_t submitted = 0;
+    uint64_t collected = 0;
+    std::vector<std::unique_ptr<Channel<Job>>> queues{};
+    std::list<std::thread> workers{};
+
+    std::mutex lock{};
+    std::condition_variable finished{};
+    std::map<uint64_t, std::vector<AVFrame*>> done{};  // Reorder buffer, by sequence.
+};
@@ -0,0 +1,558 @@
+#include "faults.h"
+
+#if FAULT_INJECTION
+
+#include "run.h"
+#include "config.h"
+#include "recovery.h"
+#include "manifest.h"
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+constexpr int captureWidth = 1920;
+constexpr int captureHeight = 1080;
+constexpr int64_t captureQueue = 4;  // Buffers the camera driver fills, the oldest is overwritten when the reader falls behind.
+constexpr std::chrono::seconds settleTime{ 3 };  // For the frames in flight to reach storage once the camera stops.
+
+int64_t faultClockUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void sleepUntilUs(int64_t time) {
+    std::this_thread::sleep_until(std::chrono::steady_clock::time_point{ std::chrono::microseconds{ time } });
+}
+
+// A fault that strikes once the warm-up is over and again every interval, lasting its duration each time.
+struct Episodes {
+    const char* name;
+    int64_t durationUs;
+    int64_t intervalUs;
+
+    // Start of the episode in progress at the given time into the scenario, or -1 if there's none.
+    int64_t activeAt(int64_t elapsedUs, int64_t warmupUs) const {
+        if (durationUs <= 0 || elapsedUs < warmupUs) {
+            return -1;
+        }
+
+        const auto start = warmupUs + (elapsedUs - warmupUs) / intervalUs * intervalUs;
+
+        return elapsedUs < start + durationUs ? start : -1;
+    }
+};
+
+// Capture and write times of a frame that reached the recording.
+struct OutputSample {
+    int64_t captureUs;
+    int64_t writtenUs;
+};
+
+class FaultInjector {
+public:
+    FaultInjector(const Config& config, int frameRate, std::vector<std::vector<uint8_t>> frames) : config(config), frameRate(frameRate),
+        frames(std::move(frames)), captureRandom(config.faultSeed), writeRandom(config.faultSeed + 1) {
+        periodUs = 1000000 / frameRate;
+        warmupUs = config.faultWarmup.count() * 1000;
+    }
+
+    int read(AVPacket* packet);
+    bool reconnect();
+    ssize_t write(int fd, const void* data, size_t size, off_t offset);
+    void observe(const AVPacket* packet);
+
+    bool started() const { return startUs.load(std::memory_order_acquire) != 0; }
+    void stop() { stopUs.store(faultClockUs(), std::memory_order_release); }
+
+    int report();
+
+private:
+    bool roll(double percent) {
+        return percent > 0.0 && std::uniform_real_distribution<double>{ 0.0, 100.0 }(captureRandom) < percent;
+    }
+
+    // Frames the camera has taken by the given time.
+    int64_t framesTaken(int64_t time) const {
+        return (time - startUs.load(std::memory_order_relaxed)) / periodUs + 1;
+    }
+
+    const Config& config;
+    int frameRate;
+    int64_t periodUs;
+    int64_t warmupUs;
+    std::vector<std::vector<uint8_t>> frames;  // Encoded, replayed in a loop.
+
+    Episodes writeStall{ "write stall", config.faultWriteStall.count() * 1000, config.faultWriteStallInterval.count() * 1000 };
+    Episodes diskFull{ "disk full", config.faultDiskFull.count() * 1000, config.faultDiskFullInterval.count() * 1000 };
+    Episodes disconnect{ "disconnect", config.faultDisconnect.count() * 1000, config.faultDisconnectInterval.count() * 1000 };
+
+    // The camera starts streaming on the first read, like the driver.
+    std::atomic<int64_t> startUs = 0;
+    std::atomic<int64_t> stopUs = 0;
+
+    // Only touched by the capture thread.
+    std::mt19937_64 captureRandom;
+    int64_t nextFrame = 0;
+    int64_t decidedFrame = -1;  // The frame the flags below were rolled for.
+    bool dropFrame = false;
+    bool delayFrame = false;
+    bool corruptFrame = false;
+    bool afterDelay = false;
+    bool connected = true;
+
+    std::atomic<uint64_t> delivered = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> delayed = 0;
+    std::atomic<uint64_t> overwrittenByDelays = 0;
+    std::atomic<uint64_t> corrupted = 0;
+    std::atomic<uint64_t> missedDisconnected = 0;
+    std::atomic<uint64_t> overrun = 0;
+
+    std::mutex writeLock{};
+    std::mt19937_64 writeRandom;
+    std::atomic<uint64_t> shortWrites = 0;
+    std::atomic<uint64_t> failedWrites = 0;
+
+    std::mutex sampleLock{};
+    std::vector<OutputSample> samples{};
+};
+
+FaultInjector* injector = nullptr;
+
+int FaultInjector::read(AVPacket* packet) {
+    ZoneScoped;
+
+    int64_t expected = 0;
+    startUs.compare_exchange_strong(expected, faultClockUs(), std::memory_order_acq_rel);
+
+    while (true) {
+        // Nothing more is delivered once the scenario is over, but the stream stays up while the pipeline settles.
+        if (stopUs.load(std::memory_order_acquire) != 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds{ periodUs });
+            return AVERROR(EAGAIN);
+        }
+
+        const auto now = faultClockUs();
+
+        if (connected && disconnect.activeAt(now - startUs.load(std::memory_order_relaxed), warmupUs) >= 0) {
+            connected = false;
+        }
+
+        // Every read fails until the device is reopened, just like an unplugged v4l2 device.
+        if (!connected) {
+            return AVERROR(EIO);
+        }
+
+        // The driver only holds the most recent frames. The ones a delay held up are the fault's, the rest are the recorder's.
+        const auto taken = framesTaken(now);
+        if (taken - nextFrame > captureQueue) {
+            const auto lost = taken - captureQueue - nextFrame;
+            (afterDelay ? overwrittenByDelays : overrun).fetch_add(lost, std::memory_order_relaxed);
+            nextFrame = taken - captureQueue;
+        }
+
+        afterDelay = false;
+
+        if (nextFrame >= taken) {
+            sleepUntilUs(startUs.load(std::memory_order_relaxed) + nextFrame * periodUs);
+            continue;
+        }
+
+        if (decidedFrame != nextFrame) {
+            decidedFrame = nextFrame;
+            dropFrame = roll(config.faultFrameDropPercent);
+            delayFrame = roll(config.faultFrameDelayPercent);
+            corruptFrame = roll(config.faultCorruptPercent);
+        }
+
+        if (dropFrame) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            ++nextFrame;
+            continue;
+        }
+
+        // A held up transfer holds up everything queued behind it.
+        if (delayFrame) {
+            delayFrame = false;
+            afterDelay = true;
+            delayed.fetch_add(1, std::memory_order_relaxed);
+            std::this_thread::sleep_for(config.faultFrameDelay);
+            continue;
+        }
+
+        const auto& frame = frames[nextFrame % frames.size()];
+        if (auto ret = av_new_packet(packet, frame.size()); ret < 0) {
+            return ret;
+        }
+
+        memcpy(packet->data, frame.data(), frame.size());
+        packet->pts = startUs.load(std::memory_order_relaxed) + nextFrame * periodUs;
+        packet->dts = packet->pts;
+        packet->stream_index = 0;
+        packet->flags |= AV_PKT_FLAG_KEY;
+
+        // The decoder conceals damage in the entropy coded data, but without its frame header a JPEG is rejected outright.
+        if (corruptFrame) {
+            for (int i = 0; i + 1 < packet->size; ++i) {
+                if (packet->data[i] == 0xFF && packet->data[i + 1] >= 0xC0 && packet->data[i + 1] <= 0xC2) {
+                    packet->data[i + 1] = 0x00;
+                    break;
+                }
+            }
+
+            corrupted.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        delivered.fetch_add(1, std::memory_order_relaxed);
+        ++nextFrame;
+
+        return 0;
+    }
+}
+
+bool FaultInjector::reconnect() {
+    const auto now = faultClockUs();
+
+    if (started() && disconnect.activeAt(now - startUs.load(std::memory_order_relaxed), warmupUs) >= 0) {
+        return false;
+    }
+
+    // Frames taken while the camera was away never arrive.
+    if (!connected) {
+        const auto taken = framesTaken(now);
+        if (taken > nextFrame) {
+            missedDisconnected.fetch_add(taken - nextFrame, std::memory_order_relaxed);
+            nextFrame = taken;
+        }
+
+        connected = true;
+    }
+
+    return true;
+}
+
+ssize_t FaultInjector::write(int fd, const void* data, size_t size, off_t offset) {
+    ZoneScoped;
+
+    const auto start = startUs.load(std::memory_order_acquire);
+    if (start == 0) {
+        return pwrite(fd, data, size, offset);
+    }
+
+    // A stalled card takes the write once it's done with whatever it was doing.
+    if (const auto stall = writeStall.activeAt(faultClockUs() - start, warmupUs); stall >= 0) {
+        sleepUntilUs(start + stall + writeStall.durationUs);
+    }
+
+    if (diskFull.activeAt(faultClockUs() - start, warmupUs) >= 0) {
+        failedWrites.fetch_add(1, std::memory_order_relaxed);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    double latencyMs = config.faultWriteLatency.count();
+    bool shortWrite = false;
+    {
+        std::scoped_lock scopeLock{ writeLock };
+
+        if (config.faultWriteJitter.count() > 0) {
+            latencyMs += std::exponential_distribution<double>{ 1.0 / config.faultWriteJitter.count() }(writeRandom);
+        }
+
+        shortWrite = config.faultShortWritePercent > 0.0 && size > 1
+            && std::uniform_real_distribution<double>{ 0.0, 100.0 }(writeRandom) < config.faultShortWritePercent;
+    }
+
+    if (latencyMs > 0.0) {
+        std::this_thread::sleep_for(std::chrono::duration<double, std::milli>{ latencyMs });
+    }
+
+    if (shortWrite) {
+        shortWrites.fetch_add(1, std::memory_order_relaxed);
+        size /= 2;
+    }
+
+    return pwrite(fd, data, size, offset);
+}
+
+void FaultInjector::observe(const AVPacket* packet) {
+    const auto now = faultClockUs();
+
+    std::scoped_lock scopeLock{ sampleLock };
+    samples.push_back({ packet->pts, now });
+}
+
+int FaultInjector::report() {
+    std::scoped_lock scopeLock{ sampleLock };
+
+    const auto start = startUs.load(std::memory_order_acquire);
+    const auto stop = stopUs.load(std::memory_order_acquire);
+    const auto taken = framesTaken(stop);
+
+    const auto withheld = dropped.load() + overwrittenByDelays.load() + missedDisconnected.load();
+    const int64_t written = samples.size();
+    const auto inPipeline = std::max<int64_t>(0, static_cast<int64_t>(delivered.load() - corrupted.load()) - written);
+    const auto lost = static_cast<int64_t>(overrun.load()) + inPipeline;
+
+    std::cout << "Fault scenario: " << (stop - start) / 1000000 << " s at " << frameRate << " fps, seed " << config.faultSeed << ".\n";
+    std::cout << "Camera: " << taken << " frames taken, " << delivered.load() << " delivered, " << corrupted.load() << " of them corrupt, "
+        << withheld << " withheld by faults (" << dropped.load() << " dropped, " << overwrittenByDelays.load() << " overwritten behind "
+        << delayed.load() << " delays, " << missedDisconnected.load() << " while disconnected).\n";
+    std::cout << "Storage: " << shortWrites.load() << " short writes, " << failedWrites.load() << " failed with ENOSPC.\n";
+    std::cout << "Recorder: " << written << " frames written, " << lost << " lost (" << overrun.load() << " overwritten in the capture queue, "
+        << inPipeline << " in the pipeline).\n";
+
+    std::vector<int64_t> latencies;
+    latencies.reserve(samples.size());
+    for (const auto& sample : samples) {
+        latencies.push_back(sample.writtenUs - sample.captureUs);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    if (!latencies.empty()) {
+        std::cout << "End-to-end latency: median " << latencies[latencies.size() / 2] / 1000 << " ms, 99th percentile "
+            << latencies[latencies.size() * 99 / 100] / 1000 << " ms, max " << latencies.back() / 1000 << " ms.\n";
+    }
+
+    // Healthy latency, from the second half of the warm-up when the encoders have settled.
+    int64_t healthyUs = -1;
+    for (const auto& sample : samples) {
+        if (sample.captureUs >= start + warmupUs / 2 && sample.captureUs < start + warmupUs) {
+            healthyUs = std::max(healthyUs, sample.writtenUs - sample.captureUs);
+        }
+    }
+
+    // An episode is recovered from once frames captured after it clear storage as fast as they did before the first one.
+    for (const auto* episodes : { &writeStall, &diskFull, &disconnect }) {
+        if (episodes->durationUs <= 0) {
+            continue;
+        }
+
+        for (auto episode = start + warmupUs; episode < stop; episode += episodes->intervalUs) {
+            const auto clearUs = episode + episodes->durationUs;
+
+            int64_t peakUs = 0;
+            int64_t recoveredUs = -1;
+            for (const auto& sample : samples) {
+                if (sample.captureUs < episode) {
+                    continue;
+                }
+
+                const auto latency = sample.writtenUs - sample.captureUs;
+                peakUs = std::max(peakUs, latency);
+
+                if (healthyUs >= 0 && sample.captureUs >= clearUs && latency <= healthyUs + periodUs) {
+                    recoveredUs = sample.writtenUs - clearUs;
+                    break;
+                }
+            }
+
+            std::cout << "  " << episodes->name << " at " << std::fixed << std::setprecision(1) << (episode - start) / 1000000.0 << " s for "
+                << episodes->durationUs / 1000 << " ms: peak latency " << peakUs / 1000 << " ms, ";
+            if (recoveredUs >= 0) {
+                std::cout << "recovered " << recoveredUs / 1000 << " ms after it cleared.\n";
+            } else {
+                std::cout << "not recovered by the end of the scenario.\n";
+            }
+        }
+    }
+
+    std::cout << "Recoveries:";
+    for (size_t i = 0; i < static_cast<size_t>(RecoveryAction::COUNT); ++i) {
+        std::cout << (i > 0 ? ", " : " ") << getRecoveryName(static_cast<RecoveryAction>(i)) << ": "
+            << getRecoveryCount(static_cast<RecoveryAction>(i));
+    }
+    std::cout << "\n";
+
+    const bool passed = lost <= config.faultAllowedLostFrames;
+    std::cout << (passed ? "PASSED: " : "FAILED: ") << lost << " frames lost, " << config.faultAllowedLostFrames << " allowed.\n";
+
+    return passed ? 0 : 1;
+}
+
+// A second of frames, replayed in a loop. A ramp moves across them so that motion detection never parks the recorder.
+bool renderFrames(int count, std::vector<std::vector<uint8_t>>& frames) {
+    ZoneScoped;
+
+    const auto* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        std::cerr << "Failed to find the MJPEG encoder for the simulated camera.\n";
+        return false;
+    }
+
+    auto* encoder = avcodec_alloc_context3(codec);
+    auto* frame = av_frame_alloc();
+    auto* packet = av_packet_alloc();
+    if (!encoder || !frame || !packet) {
+        std::cerr << "Failed to allocate the simulated camera's encoder.\n";
+        return false;
+    }
+
+    encoder->width = captureWidth;
+    encoder->height = captureHeight;
+    encoder->pix_fmt = AV_PIX_FMT_YUVJ422P;
+    encoder->time_base = AVRational{ 1, count };
+    encoder->flags |= AV_CODEC_FLAG_QSCALE;
+    encoder->global_quality = FF_QP2LAMBDA * 3;  // Close to what the camera produces.
+
+    frame->format = encoder->pix_fmt;
+    frame->width = encoder->width;
+    frame->height = encoder->height;
+
+    bool success = avcodec_open2(encoder, codec, nullptr) >= 0 && av_frame_get_buffer(frame, 0) >= 0;
+
+    for (int i = 0; success && i < count; ++i) {
+        for (int y = 0; y < captureHeight; ++y) {
+            auto* luma = frame->data[0] + y * frame->linesize[0];
+            for (int x = 0; x < captureWidth; ++x) {
+                luma[x] = static_cast<uint8_t>(x / 4 + y / 4 + i * 8);
+            }
+
+            memset(frame->data[1] + y * frame->linesize[1], 128, captureWidth / 2);
+            memset(frame->data[2] + y * frame->linesize[2], 128, captureWidth / 2);
+        }
+
+        frame->pts = i;
+        frame->quality = encoder->global_quality;
+
+        success = avcodec_send_frame(encoder, frame) >= 0 && avcodec_receive_packet(encoder, packet) >= 0;
+        if (success) {
+            frames.emplace_back(packet->data, packet->data + packet->size);
+            av_packet_unref(packet);
+        }
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&encoder);
+
+    if (!success) {
+        std::cerr << "Failed to encode the simulated camera's frames.\n";
+    }
+
+    return success;
+}
+
+int readCapture(AVFormatContext* input, AVPacket* packet) {
+    return injector ? injector->read(packet) : av_read_frame(input, packet);
+}
+
+ssize_t writeStorage(int fd, const void* data, size_t size, off_t offset) {
+    return injector ? injector->write(fd, data, size, offset) : pwrite(fd, data, size, offset);
+}
+
+void observeOutput(const AVPacket* packet) {
+    if (injector) {
+        injector->observe(packet);
+    }
+}
+
+bool simulatingCapture() {
+    return injector != nullptr;
+}
+
+bool openFakeCapture(AVFormatContext** input) {
+    ZoneScoped;
+
+    *input = nullptr;
+
+    if (!injector || !injector->reconnect()) {
+        return false;
+    }
+
+    auto* context = avformat_alloc_context();
+    auto* stream = context ? avformat_new_stream(context, nullptr) : nullptr;
+    if (!stream) {
+        avformat_free_context(context);
+        return false;
+    }
+
+    // What the v4l2 demuxer reports for the camera.
+    stream->time_base = AVRational{ 1, 1000000 };
+    stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream->codecpar->codec_id = AV_CODEC_ID_MJPEG;
+    stream->codecpar->format = AV_PIX_FMT_YUVJ422P;
+    stream->codecpar->width = captureWidth;
+    stream->codecpar->height = captureHeight;
+
+    *input = context;
+
+    return true;
+}
+
+int runFaultScenario(int frameRate, int seconds) {
+    ZoneScoped;
+
+    char directory[] = "/tmp/dashcam-faults-XXXXXX";
+    if (!mkdtemp(directory)) {
+        std::cerr << "Failed to create a scratch directory: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    std::error_code error;
+    std::filesystem::current_path(directory, error);
+    if (error) {
+        std::cerr << "Failed to enter the scratch directory: " << error.message() << "\n";
+        return 1;
+    }
+
+    mkdir("data", S_IRWXU | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+    // The scratch directory gets its own manifest, loaded before recording like in main().
+    getManifest();
+
+    std::vector<std::vector<uint8_t>> frames;
+    if (!renderFrames(frameRate, frames)) {
+        return 1;
+    }
+
+    injector = new FaultInjector{ getConfig(), frameRate, std::move(frames) };
+
+    AVFormatContext* input;
+    if (!openFakeCapture(&input)) {
+        std::cerr << "Failed to open the simulated camera.\n";
+        return 1;
+    }
+
+    std::cout << "Recording from a simulated camera for " << seconds << " s in " << directory << "\n";
+
+    // The recorder never returns, it keeps running until the process exits.
+    std::thread{ [=] { run(input, frameRate); } }.detach();
+
+    // Timed from the first capture, since setting up the codecs takes a while.
+    while (!injector->started()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds{ seconds });
+    injector->stop();
+    std::this_thread::sleep_for(settleTime);
+
+    const auto result = injector->report();
+
+    std::filesystem::remove_all(directory, error);
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <unistd.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+// Fault injection, for reproducing field failures on a desk: SD card stalls, a full disk, short writes and a misbehaving USB camera.
+// Builds made with --faults=true can run the real recording pipeline for a while against a simulated camera, with every storage write
+// and capture going through an injector configured by the fault.* settings, see runFaultScenario(). The hooks are plain pass-throughs
+// otherwise, and in other builds they compile away like the profiling helpers.
+
+#if FAULT_INJECTION
+
+// Capture and storage hooks, standing in for av_read_frame() and pwrite().
+int readCapture(AVFormatContext* input, AVPacket* packet);
+ssize_t writeStorage(int fd, const void* data, size_t size, off_t offset);
+
+// Called with every packet written to the main recording, timing it from capture.
+void observeOutput(const AVPacket* packet);
+
+// True while a scenario runs, the simulated camera then replaces the capture device.
+bool simulatingCapture();
+
+// Opens the simulated camera, which fails while it's disconnected.
+bool openFakeCapture(AVFormatContext** input);
+
+// Records from the simulated camera for the given time in a scratch directory, then reports the frames lost, the end-to-end latency and
+// the time taken to recover from each fault. Returns nonzero if more frames were lost than fault.allowed_lost_frames. The recorder is
+// left running, so the caller should leave without tearing anything down.
+int runFaultScenario(int frameRate, int seconds);
+
+#else
+
+inline int readCapture(AVFormatContext* input, AVPacket* packet) {
+    return av_read_frame(input, packet);
+}
+
+inline ssize_t writeStorage(int fd, const void* data, size_t size, off_t offset) {
+    return pwrite(fd, data, size, offset);
+}
+
+inline void observeOutput(const AVPacket*) {}
+
+#endif
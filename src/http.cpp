@@ -0,0 +1,412 @@
+#include "http.h"
+#include "throttle.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <mutex>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <tracy/Tracy.hpp>
+
+SSL_CTX* getTlsContext() {
+    static SSL_CTX* context = nullptr;
+    static std::once_flag initialized;
+
+    std::call_once(initialized, [] {
+        context = SSL_CTX_new(TLS_client_method());
+        if (!context) {
+            return;
+        }
+
+        SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+        SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+
+        if (SSL_CTX_set_default_verify_paths(context) != 1) {
+            std::cerr << "Failed to load the system certificate store.\n";
+        }
+    });
+
+    return context;
+}
+
+std::string toLower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    return text;
+}
+
+bool parseUrl(const std::string& text, Url& url, const Url* base) {
+    if (base && !text.empty() && text[0] == '/') {
+        url = *base;
+        url.target = text;
+        return true;
+    }
+
+    size_t hostStart;
+    if (text.rfind("https://", 0) == 0) {
+        url.secure = true;
+        hostStart = 8;
+    } else if (text.rfind("http://", 0) == 0) {
+        url.secure = false;
+        hostStart = 7;
+    } else {
+        return false;
+    }
+
+    const auto pathStart = text.find('/', hostStart);
+    const auto authority = text.substr(hostStart, pathStart - hostStart);
+    const auto portStart = authority.rfind(':');
+
+    if (portStart != std::string::npos && authority.find(']', portStart) == std::string::npos) {
+        url.host = authority.substr(0, portStart);
+        url.port = authority.substr(portStart + 1);
+    } else {
+        url.host = authority;
+        url.port = url.secure ? "443" : "80";
+    }
+
+    url.target = pathStart == std::string::npos ? "/" : text.substr(pathStart);
+
+    return !url.host.empty() && !url.port.empty();
+}
+
+std::string HttpResponse::header(const std::string& name) const {
+    const auto key = toLower(name);
+
+    for (const auto& [headerName, value] : headers) {
+        if (headerName == key) {
+            return value;
+        }
+    }
+
+    return {};
+}
+
+HttpConnection::HttpConnection(const Url& server, std::chrono::milliseconds timeout) : server(server), timeout(timeout) {}
+
+HttpConnection::~HttpConnection() {
+    close();
+}
+
+void HttpConnection::close() {
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ssl = nullptr;
+    }
+
+    if (socketFd >= 0) {
+        ::close(socketFd);
+        socketFd = -1;
+    }
+
+    pending.clear();
+}
+
+bool HttpConnection::connect() {
+    ZoneScoped;
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses;
+    if (auto error = getaddrinfo(server.host.c_str(), server.port.c_str(), &hints, &addresses); error != 0) {
+        std::cerr << "Failed to resolve '" << server.host << "': " << gai_strerror(error) << "\n";
+        return false;
+    }
+
+    // A stalled link should fail the request rather than hang the uploader.
+    timeval socketTimeout{};
+    socketTimeout.tv_sec = timeout.count() / 1000;
+    socketTimeout.tv_usec = (timeout.count() % 1000) * 1000;
+
+    for (auto* address = addresses; address; address = address->ai_next) {
+        socketFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (socketFd < 0) {
+            continue;
+        }
+
+        setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &socketTimeout, sizeof(socketTimeout));
+        setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &socketTimeout, sizeof(socketTimeout));
+
+        if (::connect(socketFd, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+
+        ::close(socketFd);
+        socketFd = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (socketFd < 0) {
+        std::cerr << "Failed to connect to '" << server.host << ":" << server.port << "'.\n";
+        return false;
+    }
+
+    if (!server.secure) {
+        return true;
+    }
+
+    auto* context = getTlsContext();
+    if (!context || !(ssl = SSL_new(context))) {
+        std::cerr << "Failed to create TLS session.\n";
+        close();
+        return false;
+    }
+
+    SSL_set_fd(ssl, socketFd);
+    SSL_set_tlsext_host_name(ssl, server.host.c_str());
+    SSL_set1_host(ssl, server.host.c_str());
+
+    if (SSL_connect(ssl) != 1) {
+        char buffer[256];
+        ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+        std::cerr << "TLS handshake with '" << server.host << "' failed: " << buffer << "\n";
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+bool HttpConnection::sendAll(const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+
+    while (size > 0) {
+        long sent;
+        if (ssl) {
+            sent = SSL_write(ssl, bytes, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+        } else {
+            sent = send(socketFd, bytes, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+        }
+
+        if (sent <= 0) {
+            return false;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+bool HttpConnection::sendBody(const HttpBody& body) {
+    ZoneScoped;
+
+    if (body.data) {
+        return sendAll(body.data->data(), body.data->size());
+    }
+
+    if (body.fileDescriptor < 0 || body.length == 0) {
+        return true;
+    }
+
+    // Paced in slices, so that a rate limit smooths the traffic instead of bursting whole chunks.
+    constexpr size_t sliceSize = 64 * 1024;
+
+    if (!ssl) {
+        // Straight from the page cache into the socket.
+        off_t offset = body.offset;
+        size_t remaining = body.length;
+
+        while (remaining > 0) {
+            const auto slice = std::min(remaining, sliceSize);
+            if (body.pacer) {
+                body.pacer->acquire(slice);
+            }
+
+            const auto sent = sendfile(socketFd, body.fileDescriptor, &offset, slice);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (sent <= 0) {
+                return false;
+            }
+
+            remaining -= sent;
+        }
+
+        return true;
+    }
+
+    // TLS has to encrypt in user space, but it can read straight from the page cache instead of a copy of the file.
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    const off_t mapOffset = body.offset / pageSize * pageSize;
+    const size_t mapLength = body.length + (body.offset - mapOffset);
+
+    auto* mapping = mmap(nullptr, mapLength, PROT_READ, MAP_PRIVATE, body.fileDescriptor, mapOffset);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map upload chunk: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    madvise(mapping, mapLength, MADV_SEQUENTIAL);
+
+    const auto* data = static_cast<const uint8_t*>(mapping) + (body.offset - mapOffset);
+    bool success = true;
+
+    for (size_t sent = 0; success && sent < body.length; sent += sliceSize) {
+        const auto slice = std::min(body.length - sent, sliceSize);
+        if (body.pacer) {
+            body.pacer->acquire(slice);
+        }
+
+        success = sendAll(data + sent, slice);
+    }
+
+    munmap(mapping, mapLength);
+
+    return success;
+}
+
+long HttpConnection::receive(void* data, size_t size) {
+    if (ssl) {
+        return SSL_read(ssl, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+    }
+
+    while (true) {
+        const auto received = recv(socketFd, data, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return received;
+    }
+}
+
+bool HttpConnection::readResponse(HttpResponse& response) {
+    ZoneScoped;
+
+    char buffer[16 * 1024];
+
+    size_t headerEnd;
+    while ((headerEnd = pending.find("\r\n\r\n")) == std::string::npos) {
+        const auto received = receive(buffer, sizeof(buffer));
+        if (received <= 0) {
+            return false;
+        }
+
+        pending.append(buffer, received);
+    }
+
+    const auto head = pending.substr(0, headerEnd);
+    pending.erase(0, headerEnd + 4);
+
+    // Status line, "HTTP/1.1 200 OK".
+    const auto statusStart = head.find(' ');
+    if (statusStart == std::string::npos) {
+        return false;
+    }
+
+    response.status = std::atoi(head.c_str() + statusStart + 1);
+    response.headers.clear();
+    response.body.clear();
+
+    size_t lineStart = head.find("\r\n");
+    while (lineStart != std::string::npos) {
+        lineStart += 2;
+
+        const auto lineEnd = head.find("\r\n", lineStart);
+        const auto line = head.substr(lineStart, lineEnd - lineStart);
+        const auto separator = line.find(':');
+
+        if (separator != std::string::npos) {
+            const auto valueStart = line.find_first_not_of(' ', separator + 1);
+            response.headers.emplace_back(toLower(line.substr(0, separator)), valueStart == std::string::npos ? "" : line.substr(valueStart));
+        }
+
+        lineStart = lineEnd;
+    }
+
+    const bool keepAlive = toLower(response.header("connection")) != "close";
+    const auto contentLength = response.header("content-length");
+
+    if (response.status == 204 || response.status == 304 || response.status < 200) {
+        // No body.
+    } else if (!contentLength.empty()) {
+        const auto length = std::strtoull(contentLength.c_str(), nullptr, 10);
+
+        while (pending.size() < length) {
+            const auto received = receive(buffer, sizeof(buffer));
+            if (received <= 0) {
+                return false;
+            }
+
+            pending.append(buffer, received);
+        }
+
+        response.body = pending.substr(0, length);
+        pending.erase(0, length);
+    } else if (!response.header("transfer-encoding").empty()) {
+        std::cerr << "Chunked HTTP responses are not supported.\n";
+        close();
+        return false;
+    } else {
+        // Delimited by the server closing the connection.
+        long received;
+        while ((received = receive(buffer, sizeof(buffer))) > 0) {
+            pending.append(buffer, received);
+        }
+
+        response.body = std::move(pending);
+        close();
+        return true;
+    }
+
+    if (!keepAlive) {
+        close();
+    }
+
+    return true;
+}
+
+bool HttpConnection::request(const std::string& method, const std::string& target, const HttpHeaders& headers, const HttpBody& body,
+    HttpResponse& response) {
+    ZoneScoped;
+
+    const size_t contentLength = body.data ? body.data->size() : body.length;
+
+    std::string head = method + " " + target + " HTTP/1.1\r\nHost: " + server.host + "\r\nContent-Length: " + std::to_string(contentLength) + "\r\n";
+    for (const auto& [name, value] : headers) {
+        head += name + ": " + value + "\r\n";
+    }
+    head += "\r\n";
+
+    // A kept alive connection may have been dropped by the server since the last request, so retry those once on a fresh connection.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const bool reused = socketFd >= 0;
+
+        if (!reused && !connect()) {
+            return false;
+        }
+
+        if (sendAll(head.data(), head.size()) && sendBody(body) && readResponse(response)) {
+            return true;
+        }
+
+        close();
+
+        if (!reused) {
+            break;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <sys/types.h>
+
+typedef struct ssl_st SSL;
+
+class TokenBucket;
+
+struct Url {
+    bool secure = false;  // https
+    std::string host{};
+    std::string port{};
+    std::string target{};  // Path and query.
+};
+
+// Parses http:// and https:// URLs. Relative references ("/path") resolve against the base.
+bool parseUrl(const std::string& text, Url& url, const Url* base = nullptr);
+
+using HttpHeaders = std::vector<std::pair<std::string, std::string>>;
+
+struct HttpResponse {
+    int status = 0;
+    HttpHeaders headers{};  // Names are lowercased.
+    std::string body{};
+
+    // Empty if the header is missing.
+    std::string header(const std::string& name) const;
+};
+
+// Body of a request, either in memory or a range of a file. File ranges are sent straight from the page cache, with sendfile for plain
+// connections and from a read-only mapping for TLS, so the upload never copies the footage through a user space buffer.
+struct HttpBody {
+    const std::string* data = nullptr;
+    int fileDescriptor = -1;
+    off_t offset = 0;
+    size_t length = 0;
+    TokenBucket* pacer = nullptr;  // Limits the rate file ranges are sent at.
+};
+
+// A persistent HTTP/1.1 connection to a single host, plain or TLS. Reconnects on the next request if the server closed it.
+// Chunked response bodies aren't supported, the servers we talk to always send a length.
+class HttpConnection {
+public:
+    HttpConnection(const Url& server, std::chrono::milliseconds timeout);
+    ~HttpConnection();
+
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+
+    // Returns false on connection failures, HTTP errors are reported through the response status.
+    bool request(const std::string& method, const std::string& target, const HttpHeaders& headers, const HttpBody& body, HttpResponse& response);
+
+    void close();
+
+private:
+    bool connect();
+    bool sendAll(const void* data, size_t size);
+    bool sendBody(const HttpBody& body);
+    long receive(void* data, size_t size);
+    bool readResponse(HttpResponse& response);
+
+    Url server;
+    std::chrono::milliseconds timeout;
+    int socketFd = -1;
+    SSL* ssl = nullptr;
+    std::string pending{};  // Received bytes past the end of the last response.
+};
@@ -0,0 +1,357 @@
+#include "log.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <tracy/Tracy.hpp>
+
+namespace {
+
+enum class RecordKind : uint8_t {
+    MESSAGE = 0,
+    SAMPLE = 1
+};
+
+struct LogRecord {
+    uint64_t timeUs;
+    const char* site;  // Format string or sample message, identifies the call site.
+    const char* unit;
+    double value;
+    LogLevel level;
+    RecordKind kind;
+    char text[230];
+};
+
+// Single producer, single consumer. The owning thread pushes, the drain thread pops.
+struct LogRing {
+    static constexpr size_t capacity = 256;
+
+    alignas(64) std::atomic<size_t> head{ 0 };  // Next record to drain.
+    alignas(64) std::atomic<size_t> tail{ 0 };  // Next record to fill.
+    std::atomic<uint64_t> lost{ 0 };
+    std::atomic<bool> retired{ false };  // The owning thread exited, removed once drained.
+    LogRecord records[capacity];
+};
+
+struct SiteWindow {
+    uint64_t startUs = 0;
+    int printed = 0;
+    uint64_t suppressed = 0;
+    LogLevel level = LogLevel::INFO;
+    std::string last{};  // Text of the last suppressed message.
+    uint64_t samples = 0;
+    double maximum = 0.0;
+    const char* unit = nullptr;
+};
+
+// Never freed, the drain thread may still be running while static objects are destroyed at exit.
+struct LogState {
+    std::atomic<bool> running{ false };
+    std::atomic<uint8_t> level{ static_cast<uint8_t>(LogLevel::INFO) };
+    uint64_t windowUs = 5000000;
+    int limit = 5;
+    bool journal = false;  // Prefix lines with their syslog priority, for journald.
+
+    std::mutex ringsLock{};
+    std::vector<std::shared_ptr<LogRing>> rings{};
+
+    std::mutex drainLock{};  // Held while draining, by the drain thread or a final flush.
+    std::vector<LogRecord> batch{};
+    std::map<const char*, SiteWindow> sites{};
+};
+
+LogState& state = *new LogState{};
+
+// Hands the thread's ring to the drain thread for good when the thread exits.
+struct RingOwner {
+    std::shared_ptr<LogRing> ring{};
+
+    ~RingOwner() {
+        if (ring) {
+            ring->retired.store(true, std::memory_order_release);
+        }
+    }
+};
+
+thread_local RingOwner ringOwner{};
+
+uint64_t monotonicUs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+bool enabled(LogLevel level) {
+    return static_cast<uint8_t>(level) >= state.level.load(std::memory_order_relaxed);
+}
+
+void writeLine(LogLevel level, const char* text) {
+    // Priorities as in syslog.h.
+    static const char* priorities[] = { "<7>", "<6>", "<4>", "<3>" };
+    auto* stream = level >= LogLevel::WARNING ? stderr : stdout;
+
+    fprintf(stream, "%s%s\n", state.journal ? priorities[static_cast<size_t>(level)] : "", text);
+}
+
+LogRing* getRing() {
+    if (!ringOwner.ring) {
+        ringOwner.ring = std::make_shared<LogRing>();
+
+        std::scoped_lock scopeLock{ state.ringsLock };
+        state.rings.push_back(ringOwner.ring);
+    }
+
+    return ringOwner.ring.get();
+}
+
+// Null if the ring is full, the record counts as lost.
+LogRecord* beginRecord(LogRing& ring) {
+    const auto tail = ring.tail.load(std::memory_order_relaxed);
+
+    if (tail - ring.head.load(std::memory_order_acquire) == LogRing::capacity) {
+        ring.lost.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    return &ring.records[tail % LogRing::capacity];
+}
+
+void commitRecord(LogRing& ring) {
+    ring.tail.store(ring.tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void logFormatted(LogLevel level, const char* format, va_list arguments) {
+    if (!enabled(level)) {
+        return;
+    }
+
+    if (!state.running.load(std::memory_order_acquire)) {
+        char text[sizeof(LogRecord::text)];
+        vsnprintf(text, sizeof(text), format, arguments);
+        writeLine(level, text);
+        return;
+    }
+
+    auto& ring = *getRing();
+    auto* record = beginRecord(ring);
+    if (!record) {
+        return;
+    }
+
+    record->timeUs = monotonicUs();
+    record->site = format;
+    record->level = level;
+    record->kind = RecordKind::MESSAGE;
+    vsnprintf(record->text, sizeof(record->text), format, arguments);
+
+    commitRecord(ring);
+}
+
+void flushWindow(const char* site, SiteWindow& window) {
+    char text[sizeof(LogRecord::text) + 64];
+    const double seconds = state.windowUs / 1000000.0;
+
+    if (window.samples > 0) {
+        snprintf(text, sizeof(text), "%s %llu times, max %.1f %s, in the last %g s", site, static_cast<unsigned long long>(window.samples),
+            window.maximum, window.unit, seconds);
+        writeLine(window.level, text);
+    }
+
+    if (window.suppressed > 0) {
+        snprintf(text, sizeof(text), "%s (%llu more like this in the last %g s)", window.last.c_str(),
+            static_cast<unsigned long long>(window.suppressed), seconds);
+        writeLine(window.level, text);
+    }
+}
+
+void handle(const LogRecord& record) {
+    auto& window = state.sites[record.site];
+
+    if (window.startUs == 0) {
+        window.startUs = record.timeUs;
+        window.level = record.level;
+    }
+
+    window.level = std::max(window.level, record.level);
+
+    if (record.kind == RecordKind::SAMPLE) {
+        window.maximum = window.samples == 0 ? record.value : std::max(window.maximum, record.value);
+        window.samples++;
+        window.unit = record.unit;
+    } else if (window.printed < state.limit) {
+        window.printed++;
+        writeLine(record.level, record.text);
+    } else {
+        window.suppressed++;
+        window.last = record.text;
+    }
+}
+
+// With final set, every window is flushed regardless of its age.
+void drain(bool final) {
+    ZoneScoped;
+
+    std::scoped_lock drainScopeLock{ state.drainLock };
+    auto& batch = state.batch;
+
+    uint64_t lost = 0;
+    {
+        std::scoped_lock scopeLock{ state.ringsLock };
+
+        for (auto current = state.rings.begin(); current != state.rings.end();) {
+            auto& ring = **current;
+            const bool retired = ring.retired.load(std::memory_order_acquire);
+            auto head = ring.head.load(std::memory_order_relaxed);
+            const auto tail = ring.tail.load(std::memory_order_acquire);
+
+            for (; head != tail; ++head) {
+                batch.push_back(ring.records[head % LogRing::capacity]);
+            }
+
+            ring.head.store(head, std::memory_order_release);
+            lost += ring.lost.exchange(0, std::memory_order_relaxed);
+
+            if (retired) {
+                current = state.rings.erase(current);
+            } else {
+                ++current;
+            }
+        }
+    }
+
+    // Keeps the output in order across threads, at least within one drain.
+    std::stable_sort(batch.begin(), batch.end(), [](const LogRecord& left, const LogRecord& right) {
+        return left.timeUs < right.timeUs;
+    });
+
+    for (const auto& record : batch) {
+        handle(record);
+    }
+
+    batch.clear();
+
+    if (lost > 0) {
+        char text[64];
+        snprintf(text, sizeof(text), "Log buffer full, lost %llu messages.", static_cast<unsigned long long>(lost));
+        writeLine(LogLevel::WARNING, text);
+    }
+
+    const auto now = monotonicUs();
+    for (auto current = state.sites.begin(); current != state.sites.end();) {
+        auto& [site, window] = *current;
+
+        if (final || now - window.startUs >= state.windowUs) {
+            flushWindow(site, window);
+            current = state.sites.erase(current);
+        } else {
+            ++current;
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+}
+
+void drainContinuously() {
+    while (state.running.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+
+        drain(false);
+    }
+}
+
+}  // namespace
+
+void initializeLogging(const Config& config) {
+    state.level.store(static_cast<uint8_t>(config.logLevel), std::memory_order_relaxed);
+    state.windowUs = static_cast<uint64_t>(config.logWindow.count()) * 1000;
+    state.limit = config.logLimit;
+    state.journal = getenv("JOURNAL_STREAM") != nullptr;
+
+    if (state.running.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    std::thread{ drainContinuously }.detach();
+
+    static bool registered = false;
+    if (!registered) {
+        registered = true;
+        atexit(shutdownLogging);
+    }
+}
+
+void shutdownLogging() {
+    if (!state.running.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    drain(true);
+}
+
+void logDebug(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    logFormatted(LogLevel::DEBUG, format, arguments);
+    va_end(arguments);
+}
+
+void logInfo(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    logFormatted(LogLevel::INFO, format, arguments);
+    va_end(arguments);
+}
+
+void logWarning(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    logFormatted(LogLevel::WARNING, format, arguments);
+    va_end(arguments);
+}
+
+void logError(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    logFormatted(LogLevel::ERROR, format, arguments);
+    va_end(arguments);
+}
+
+void logSample(LogLevel level, const char* message, double value, const char* unit) {
+    if (!enabled(level)) {
+        return;
+    }
+
+    if (!state.running.load(std::memory_order_acquire)) {
+        char text[sizeof(LogRecord::text)];
+        snprintf(text, sizeof(text), "%s (%.1f %s)", message, value, unit);
+        writeLine(level, text);
+        return;
+    }
+
+    auto& ring = *getRing();
+    auto* record = beginRecord(ring);
+    if (!record) {
+        return;
+    }
+
+    record->timeUs = monotonicUs();
+    record->site = message;
+    record->unit = unit;
+    record->value = value;
+    record->level = level;
+    record->kind = RecordKind::SAMPLE;
+
+    commitRecord(ring);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "config.h"
+
+// Asynchronous logging for the pipeline threads. Each thread formats its messages into its own lock-free ring, and a background thread
+// drains the rings and does the actual writes, so a slow journal never holds up capture. A full ring drops the message rather than
+// wait. Messages are rate limited per call site (the format string), anything over log.limit in a window is counted and summarized.
+// Messages don't end with a newline, one is added when written. Until initializeLogging() is called messages are written directly.
+
+void initializeLogging(const Config& config);
+
+// Writes out everything still queued and stops the background thread. Also runs at exit, so a fatal exit keeps its last words.
+void shutdownLogging();
+
+void logDebug(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void logInfo(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void logWarning(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void logError(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+// Aggregated instead of printed one by one, each window with samples prints "<message> <n> times, max <value> <unit>, in the last <s> s".
+// Cheaper than a message, nothing is formatted on the calling thread. Both strings must be literals.
+void logSample(LogLevel level, const char* message, double value, const char* unit);
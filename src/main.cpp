@@ -2,11 +2,18 @@
 #include "video.h"
 #include "upload.h"
 #include "status.h"
+#include "config.h"
+#include "budget.h"
+#include "log.h"
+#include "faults.h"
+#include "bitstream.h"
+#include "manifest.h"
 
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <chrono>
+#include <ctime>
 #include <thread>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -49,12 +56,74 @@ bool operatorConnected() {
     return hasConnection;
 }
 
+// Prints the status published by a running recorder.
+int inspectStatus() {
+    const auto* block = attachStatus();
+    if (!block) {
+        std::cerr << "No recorder status published.\n";
+        return 1;
+    }
+
+    StatusSnapshot snapshot;
+    if (!readStatus(*block, snapshot)) {
+        std::cerr << "Status is mid update and not settling, the recorder may have died while writing it.\n";
+        detachStatus(block);
+        return 1;
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const auto nowUs = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+    std::cout << "PID: " << snapshot.pid << ", state: " << static_cast<int>(snapshot.state) << ", heartbeat: " << snapshot.heartbeat
+        << ", updated " << (nowUs - snapshot.updatedUs) / 1000 << "ms ago\n";
+    std::cout << "Frames: " << snapshot.frames << ", late: " << snapshot.lateFrames << " (" << snapshot.lateUs / 1000 << "ms total), dropped: "
+        << snapshot.droppedFrames << ", blocked allocations: " << snapshot.blockedAllocations << "\n";
+    std::cout << "Memory: " << snapshot.memoryUsed / 1024 << " KB of " << snapshot.memoryBudget / 1024 << " KB\n";
+    std::cout << "Recoveries:";
+    for (size_t i = 0; i < static_cast<size_t>(RecoveryAction::COUNT); ++i) {
+        std::cout << (i > 0 ? ", " : " ") << getRecoveryName(static_cast<RecoveryAction>(i)) << ": " << snapshot.recoveries[i];
+    }
+    std::cout << "\n";
+
+    detachStatus(block);
+
+    return 0;
+}
+
+// Prints the index of a recorded segment, without decoding it.
+int inspectSegment(const std::string& path, int frameRate) {
+    if (frameRate < 1) {
+        std::cerr << "Invalid framerate specified.\n";
+        return 1;
+    }
+
+    const auto index = indexSegment(path, true);
+    if (!index) {
+        std::cerr << "Failed to read '" << path << "'.\n";
+        return 1;
+    }
+
+    std::cout << "Frames: " << index->frames << " (" << index->intraFrames << " I, " << index->predictedFrames << " P, "
+        << index->bidirectionalFrames << " B), " << index->frames * 1000 / frameRate << "ms at " << frameRate << " fps\n";
+    std::cout << "Size: " << index->validSize << " bytes in whole frames, of " << index->size << "\n";
+    std::cout << "Keyframes:";
+    for (const auto offset : index->keyframeOffsets) {
+        std::cout << " " << offset;
+    }
+    std::cout << "\n";
+
+    return 0;
+}
+
 int main(int argc, char** argv) {
     int frameRate = 30;
     bool debug = false;
+    std::string configPath = defaultConfigLocation;
+    int faultSeconds = 0;
 
     int c;
-    while ((c = getopt(argc, argv, "r:d")) != -1) {
+    while ((c = getopt(argc, argv, "r:dc:sf:i:")) != -1) {
         switch (c) {
             case 'r':
                 frameRate = std::stoi(optarg);
@@ -62,8 +131,18 @@ int main(int argc, char** argv) {
             case 'd':
                 debug = true;
                 break;
+            case 'c':
+                configPath = optarg;
+                break;
+            case 's':
+                return inspectStatus();
+            case 'f':
+                faultSeconds = std::stoi(optarg);
+                break;
+            case 'i':
+                return inspectSegment(optarg, frameRate);
             case '?':
-                if (optopt == 'r') {
+                if (optopt == 'r' || optopt == 'c' || optopt == 'f' || optopt == 'i') {
                     std::cerr << "Option '" << optopt << "' requires an argument!\n";
                     return 1;
                 } else {
@@ -81,8 +160,32 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (!loadConfig(configPath)) {
+        std::cerr << "Failed to load config.\n";
+        return 1;
+    }
+
+    initializeLogging(getConfig());
+    initializeMemoryBudget(getConfig().memoryBudget);
+
+    if (faultSeconds > 0) {
+#if FAULT_INJECTION
+        // The recorder is still running, leave without tearing down what it uses.
+        const auto result = runFaultScenario(frameRate, faultSeconds);
+        std::cout.flush();
+        _exit(result);
+#else
+        std::cerr << "Fault scenarios need a build made with --faults=true.\n";
+        return 1;
+#endif
+    }
+
+    // Loaded up front rather than by the first segment, since recovering segments from a crash can take a while and the output thread
+    // runs at real-time priority.
+    getManifest();
+
     if (!initializeStatus()) {
-        std::cerr << "Watchdog disabled!\n";
+        std::cerr << "Status reporting disabled!\n";
 
         shutdownStatus();
     } else {
@@ -90,7 +193,11 @@ int main(int argc, char** argv) {
     }
 
     // Skip upload in debug mode.
-    if (!debug) {
+    if (!debug && getConfig().uploadConcurrent) {
+        std::cout << "Uploading alongside recording whenever an operator is connected.\n";
+
+        std::thread{ uploadContinuously, operatorConnected }.detach();
+    } else if (!debug) {
         // DNS takes some time to resolve, this seems like a decent balance.
         std::cout << "Waiting 5 seconds before testing for operator...\n";
         std::this_thread::sleep_for(5s);
@@ -0,0 +1,415 @@
+#include "manifest.h"
+#include "storage.h"
+#include "bitstream.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include <charconv>
+#include <cstdio>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <tracy/Tracy.hpp>
+
+const char* stateNames[] = {
+    "recording",
+    "recorded",
+    "converted",
+    "uploaded"
+};
+
+std::string formatEntry(const ManifestEntry& entry) {
+    char checksum[16] = "-";
+    if (entry.checksum) {
+        snprintf(checksum, sizeof(checksum), "%08x", *entry.checksum);
+    }
+
+    char convertedChecksum[16];
+    snprintf(convertedChecksum, sizeof(convertedChecksum), "%08x", entry.convertedChecksum);
+
+    std::stringstream line;
+    line << entry.name << " " << stateNames[static_cast<size_t>(entry.state)] << " " << entry.size << " " << checksum << " "
+        << (entry.converted.empty() ? "-" : entry.converted) << " " << convertedChecksum;
+
+    return line.str();
+}
+
+// A checksum as formatEntry() writes it. False unless the whole field is one.
+bool parseChecksum(const std::string& field, uint32_t& checksum) {
+    const auto* end = field.data() + field.size();
+    const auto [last, error] = std::from_chars(field.data(), end, checksum, 16);
+
+    return error == std::errc{} && last == end;
+}
+
+UploadManifest::UploadManifest(const std::string& path) : path(path) {
+    load();
+
+    journalThread = std::thread{ &UploadManifest::writeJournal, this };
+}
+
+UploadManifest::~UploadManifest() {
+    {
+        std::scoped_lock scopeLock{ journalLock };
+        stopping = true;
+    }
+
+    journalQueued.notify_one();
+    journalThread.join();
+
+    if (journal) {
+        fclose(journal);
+    }
+}
+
+void UploadManifest::load() {
+    ZoneScoped;
+
+    std::ifstream file{ path };
+    std::string line;
+    std::set<std::string> interrupted;
+
+    // Later lines override earlier ones for the same file.
+    while (std::getline(file, line)) {
+        std::istringstream fields{ line };
+        std::string name;
+        std::string state;
+
+        if (!(fields >> name >> state)) {
+            continue;
+        }
+
+        if (state == "removed") {
+            entries.erase(name);
+            interrupted.erase(name);
+            continue;
+        }
+
+        const auto* stateName = std::find(std::begin(stateNames), std::end(stateNames), state);
+        if (stateName == std::end(stateNames)) {
+            continue;
+        }
+
+        ManifestEntry entry{ .name = name, .state = static_cast<SegmentState>(stateName - std::begin(stateNames)) };
+        std::string checksum;
+        std::string convertedChecksum;
+
+        // A torn last line after a power loss is simply ignored.
+        if (!(fields >> entry.size >> checksum >> entry.converted >> convertedChecksum)) {
+            continue;
+        }
+
+        // So is one damaged in a way that still splits into the right fields.
+        uint32_t value = 0;
+        if (checksum != "-") {
+            if (!parseChecksum(checksum, value)) {
+                continue;
+            }
+
+            entry.checksum = value;
+        }
+
+        if (!parseChecksum(convertedChecksum, entry.convertedChecksum)) {
+            continue;
+        }
+
+        if (entry.converted == "-") {
+            entry.converted.clear();
+        }
+
+        // Nothing is recording before the manifest is loaded, so this was interrupted by a crash or power loss. What made it to disk is
+        // still worth uploading, but the checksum no longer matches it.
+        if (entry.state == SegmentState::RECORDING) {
+            entry.state = SegmentState::RECORDED;
+            entry.checksum.reset();
+            interrupted.insert(name);
+        } else {
+            interrupted.erase(name);
+        }
+
+        entries[name] = entry;
+    }
+
+    // Video cut off that way ends in a torn frame, which is truncated so the segment converts cleanly.
+    for (const auto& name : interrupted) {
+        const auto file = std::filesystem::path{ storageLocation } / name;
+        if (file.extension() != segmentSuffix) {
+            continue;
+        }
+
+        if (const auto index = recoverSegment(file)) {
+            entries[name].size = index->size;
+        }
+    }
+
+    // Compact the journal, written to the side and renamed over so the manifest is never lost halfway.
+    const auto compacted = path + ".tmp";
+    FILE* output = fopen(compacted.c_str(), "w");
+    if (!output) {
+        std::cerr << "Failed to write upload manifest '" << compacted << "'.\n";
+        return;
+    }
+
+    for (const auto& [name, entry] : entries) {
+        fprintf(output, "%s\n", formatEntry(entry).c_str());
+    }
+
+    fflush(output);
+    fdatasync(fileno(output));
+    fclose(output);
+
+    if (rename(compacted.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to replace upload manifest '" << path << "'.\n";
+    }
+
+    journal = fopen(path.c_str(), "a");
+    if (!journal) {
+        std::cerr << "Failed to open upload manifest '" << path << "'.\n";
+    }
+}
+
+void UploadManifest::append(const std::string& line) {
+    {
+        std::scoped_lock scopeLock{ journalLock };
+        pendingLines.push_back(line);
+        ++queuedLines;
+    }
+
+    journalQueued.notify_one();
+}
+
+void UploadManifest::writeJournal() {
+    std::unique_lock scopeLock{ journalLock };
+
+    while (true) {
+        journalQueued.wait(scopeLock, [&] { return stopping || !pendingLines.empty(); });
+        if (pendingLines.empty()) {
+            break;
+        }
+
+        // Whatever piled up during the last sync goes out in one write and one sync.
+        auto lines = std::move(pendingLines);
+        pendingLines.clear();
+        const auto written = queuedLines;
+
+        scopeLock.unlock();
+
+        {
+            ZoneScopedN("manifest_sync");
+
+            if (journal) {
+                for (const auto& line : lines) {
+                    fprintf(journal, "%s\n", line.c_str());
+                }
+
+                fflush(journal);
+                fdatasync(fileno(journal));
+            }
+        }
+
+        scopeLock.lock();
+        syncedLines = written;
+        journalSynced.notify_all();
+    }
+}
+
+void UploadManifest::sync() {
+    ZoneScoped;
+
+    std::unique_lock scopeLock{ journalLock };
+
+    const auto target = queuedLines;
+    journalSynced.wait(scopeLock, [&] { return syncedLines >= target; });
+}
+
+std::optional<ManifestEntry> UploadManifest::get(const std::string& name) {
+    std::scoped_lock scopeLock{ lock };
+
+    if (auto entry = entries.find(name); entry != entries.end()) {
+        return entry->second;
+    }
+
+    return std::nullopt;
+}
+
+void UploadManifest::update(const ManifestEntry& entry) {
+    ZoneScoped;
+
+    std::scoped_lock scopeLock{ lock };
+
+    entries[entry.name] = entry;
+    append(formatEntry(entry));
+}
+
+void UploadManifest::remove(const std::string& name) {
+    std::scoped_lock scopeLock{ lock };
+
+    if (entries.erase(name) > 0) {
+        append(name + " removed");
+    }
+}
+
+void UploadManifest::reconcile() {
+    ZoneScoped;
+
+    // Uploaded, but interrupted before the local files were removed. Removed without the lock, the recorder updates the manifest from its
+    // output thread. The entries are dropped below once the files are gone.
+    std::vector<std::string> uploaded;
+    {
+        std::scoped_lock scopeLock{ lock };
+
+        for (const auto& [name, entry] : entries) {
+            if (entry.state == SegmentState::UPLOADED) {
+                uploaded.push_back(name);
+                if (!entry.converted.empty()) {
+                    uploaded.push_back(entry.converted);
+                }
+            }
+        }
+    }
+
+    std::error_code error;
+    for (const auto& name : uploaded) {
+        std::filesystem::remove(storageLocation + name, error);
+    }
+
+    std::map<std::string, uint64_t> files;
+    std::set<std::string> protectedStems;
+
+    for (const auto& file : std::filesystem::directory_iterator{ storageLocation }) {
+        const auto name = file.path().filename().string();
+        const auto extension = file.path().extension();
+
+        if (extension == protectSuffix) {
+            protectedStems.insert(getSegmentStem(file.path()));
+        } else if (extension != uploadProgressSuffix && file.is_regular_file()) {
+            files[name] = file.file_size();
+        }
+    }
+
+    std::scoped_lock scopeLock{ lock };
+
+    std::set<std::string> known;
+    std::set<std::string> recordingStems;
+    for (auto current = entries.begin(); current != entries.end();) {
+        auto& entry = current->second;
+        const bool hasSource = files.count(entry.name) > 0;
+        const bool hasConverted = !entry.converted.empty() && files.count(entry.converted) > 0;
+
+        // Uploaded, with the local files removed above.
+        if (entry.state == SegmentState::UPLOADED) {
+            append(entry.name + " removed");
+            current = entries.erase(current);
+            continue;
+        }
+
+        // Culled, or removed by hand. An entry still recording may be about to create its file, recording enters it first.
+        if (!hasSource && !hasConverted && entry.state != SegmentState::RECORDING) {
+            append(entry.name + " removed");
+            current = entries.erase(current);
+            continue;
+        }
+
+        // Converted output that didn't survive, convert again.
+        if (entry.state == SegmentState::CONVERTED && !hasConverted) {
+            entry.state = SegmentState::RECORDED;
+            entry.converted.clear();
+            append(formatEntry(entry));
+        }
+
+        entry.isProtected = protectedStems.count(getSegmentStem(entry.name)) > 0;
+
+        if (entry.state == SegmentState::RECORDING) {
+            recordingStems.insert(getSegmentStem(entry.name));
+        }
+
+        known.insert(entry.name);
+        if (!entry.converted.empty()) {
+            known.insert(entry.converted);
+        }
+
+        ++current;
+    }
+
+    // Files from before the manifest existed, or written without registering, like thumbnail sheets.
+    for (const auto& [name, size] : files) {
+        // Unregistered files of a segment still being recorded may be partially written, they're adopted once it's done.
+        if (known.count(name) > 0 || recordingStems.count(getSegmentStem(name)) > 0) {
+            continue;
+        }
+
+        ManifestEntry entry{ .name = name, .state = SegmentState::RECORDED, .size = size };
+        entry.isProtected = protectedStems.count(getSegmentStem(name)) > 0;
+
+        entries[name] = entry;
+        append(formatEntry(entry));
+    }
+}
+
+std::vector<ManifestEntry> UploadManifest::getPending(UploadOrder order) {
+    std::vector<ManifestEntry> pending;
+
+    {
+        std::scoped_lock scopeLock{ lock };
+
+        for (const auto& [name, entry] : entries) {
+            if (entry.state != SegmentState::RECORDING) {
+                pending.push_back(entry);
+            }
+        }
+    }
+
+    // Segment names start with the time they were recorded, so names order by age.
+    std::stable_sort(pending.begin(), pending.end(), [order](const ManifestEntry& left, const ManifestEntry& right) {
+        // Proxies and thumbnails are small and enough to review the footage, so they go before the full quality segments.
+        const bool leftCompanion = left.name != getSegmentStem(left.name) + segmentSuffix;
+        const bool rightCompanion = right.name != getSegmentStem(right.name) + segmentSuffix;
+
+        if (left.isProtected != right.isProtected) {
+            return left.isProtected;
+        }
+
+        if (leftCompanion != rightCompanion) {
+            return leftCompanion;
+        }
+
+        return order == UploadOrder::NEWEST ? left.name > right.name : left.name < right.name;
+    });
+
+    return pending;
+}
+
+UploadManifest& getManifest() {
+    static UploadManifest manifest{ manifestLocation };
+
+    return manifest;
+}
+
+std::optional<uint32_t> checksumFile(const std::filesystem::path& path) {
+    ZoneScoped;
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> buffer(1024 * 1024);
+    uLong checksum = crc32(0L, Z_NULL, 0);
+
+    size_t count;
+    while ((count = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+        checksum = crc32(checksum, buffer.data(), static_cast<uInt>(count));
+    }
+
+    const bool failed = ferror(file);
+    fclose(file);
+
+    if (failed) {
+        return std::nullopt;
+    }
+
+    return static_cast<uint32_t>(checksum);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+#include <filesystem>
+
+constexpr const char* manifestLocation = "./upload.manifest";
+
+// Progress of a recorded file through the upload path. Only moves forward, so no step is ever repeated.
+enum class SegmentState : uint8_t {
+    RECORDING = 0,  // Still being written, not eligible for upload.
+    RECORDED = 1,
+    CONVERTED = 2,
+    UPLOADED = 3  // Uploaded, the local files only need to be cleaned up.
+};
+
+struct ManifestEntry {
+    std::string name{};  // File name in the storage location.
+    SegmentState state = SegmentState::RECORDED;
+    uint64_t size = 0;
+    std::optional<uint32_t> checksum{};  // CRC-32 of the recorded file. Computed while writing, or on first upload for adopted files.
+    std::string converted{};  // File name of the converted file, once converted.
+    uint32_t convertedChecksum = 0;
+    bool isProtected = false;  // Follows the <stem>.protect marker, not persisted.
+};
+
+// Persistent record of every file waiting to be uploaded. Kept as an append-only journal of entry updates, compacted when loaded. Updates
+// are written and synced by a journal thread, so the recorder's output thread never waits on the card. Shared by the recorder and the
+// uploader.
+class UploadManifest {
+public:
+    explicit UploadManifest(const std::string& path);
+    ~UploadManifest();
+
+    UploadManifest(const UploadManifest&) = delete;
+    UploadManifest& operator=(const UploadManifest&) = delete;
+
+    std::optional<ManifestEntry> get(const std::string& name);
+    void update(const ManifestEntry& entry);
+    void remove(const std::string& name);
+
+    // Waits until every update made so far is on disk.
+    void sync();
+
+    // Brings the manifest in line with the storage location with a single directory listing. Files without an entry are adopted, entries
+    // without a file are dropped, and entries left RECORDING by a crash are treated as recorded, with a checksum computed on upload.
+    void reconcile();
+
+    // Entries in upload order. Protected segments first, then companion files, then segments by age.
+    std::vector<ManifestEntry> getPending(UploadOrder order);
+
+private:
+    void load();
+    void append(const std::string& line);  // Queues a line for the journal thread, cheap enough to call under the lock.
+    void writeJournal();
+
+    std::string path;
+    std::mutex lock{};
+    std::map<std::string, ManifestEntry> entries{};
+
+    FILE* journal = nullptr;
+    std::mutex journalLock{};
+    std::condition_variable journalQueued{};
+    std::condition_variable journalSynced{};
+    std::vector<std::string> pendingLines{};
+    uint64_t queuedLines = 0;
+    uint64_t syncedLines = 0;
+    bool stopping = false;
+    std::thread journalThread{};
+};
+
+// Loaded on first use, which main() makes sure happens before recording starts, since loading may truncate segments cut off by a crash.
+UploadManifest& getManifest();
+
+// CRC-32 of a whole file, empty if it can't be read.
+std::optional<uint32_t> checksumFile(const std::filesystem::path& path);
@@ -0,0 +1,93 @@
+#include "motion.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <tracy/Tracy.hpp>
+
+void downsampleLuma(const uint8_t* luma, int linesize, int width, int height, std::vector<uint8_t>& grid) {
+    ZoneScoped;
+
+    const int columns = width / motionCellSize;
+    const int rows = height / motionCellSize;
+
+    grid.resize(static_cast<size_t>(columns) * rows);
+
+    for (int row = 0; row < rows; ++row) {
+        const auto* line = luma + static_cast<size_t>(row) * motionCellSize * linesize;
+        auto* cells = grid.data() + static_cast<size_t>(row) * columns;
+
+        // Simple enough for the compiler to vectorize.
+        for (int column = 0; column < columns; ++column) {
+            const auto* pixels = line + column * motionCellSize;
+
+            unsigned sum = 0;
+            for (int i = 0; i < motionCellSize; ++i) {
+                sum += pixels[i];
+            }
+
+            cells[column] = static_cast<uint8_t>(sum / motionCellSize);
+        }
+    }
+}
+
+uint64_t sumAbsoluteDifference(const uint8_t* a, const uint8_t* b, size_t count) {
+    uint64_t sum = 0;
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    // Accumulate into 16 bit lanes, flushing to 32 bit lanes before they can overflow (255 * 2 per lane per iteration).
+    uint32x4_t total = vdupq_n_u32(0);
+    while (i + 16 <= count) {
+        uint16x8_t partial = vdupq_n_u16(0);
+
+        for (size_t block = 0; block < 128 && i + 16 <= count; ++block, i += 16) {
+            partial = vpadalq_u8(partial, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        }
+
+        total = vpadalq_u16(total, partial);
+    }
+
+    sum += vaddvq_u32(total);
+#elif defined(__SSE2__)
+    __m128i total = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        const auto left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const auto right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+
+        // Produces two 64 bit partial sums.
+        total = _mm_add_epi64(total, _mm_sad_epu8(left, right));
+    }
+
+    sum += static_cast<uint64_t>(_mm_cvtsi128_si64(total)) + static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total)));
+#endif
+
+    // Scalar fallback, and the tail of the vectorized paths.
+    for (; i < count; ++i) {
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+
+    return sum;
+}
+
+MotionDetector::MotionDetector(double threshold) : threshold(threshold) {}
+
+bool MotionDetector::detect(const uint8_t* luma, int linesize, int width, int height) {
+    ZoneScoped;
+
+    downsampleLuma(luma, linesize, width, height, current);
+
+    bool motion = true;
+    if (previous.size() == current.size() && !current.empty()) {
+        activity = static_cast<double>(sumAbsoluteDifference(previous.data(), current.data(), current.size())) / current.size();
+        motion = activity > threshold;
+    }
+
+    // Compare against the previous frame rather than a fixed reference, so that gradual lighting changes don't count as motion.
+    previous.swap(current);
+
+    return motion;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Size of a motion grid cell, in pixels on each side.
+constexpr int motionCellSize = 8;
+
+// Downsamples a luma plane into a grid by averaging horizontal runs of motionCellSize pixels on every motionCellSize-th row. Cheap,
+// and coarse enough to ignore sensor noise.
+void downsampleLuma(const uint8_t* luma, int linesize, int width, int height, std::vector<uint8_t>& grid);
+
+// Sum of absolute differences between two equally sized buffers. Vectorized with NEON or SSE2 when available.
+uint64_t sumAbsoluteDifference(const uint8_t* a, const uint8_t* b, size_t count);
+
+// Tracks scene activity between consecutive frames.
+class MotionDetector {
+public:
+    // Threshold is the mean absolute difference per grid cell, in luma levels, above which a frame counts as motion.
+    explicit MotionDetector(double threshold);
+
+    // Returns true if the frame differs from the previous one by more than the threshold. The first frame always counts as motion.
+    bool detect(const uint8_t* luma, int linesize, int width, int height);
+
+    // Mean absolute difference per cell of the last detection.
+    double getActivity() const { return activity; }
+
+private:
+    double threshold;
+    double activity = 0.0;
+    std::vector<uint8_t> previous{};
+    std::vector<uint8_t> current{};
+};
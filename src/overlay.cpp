@@ -0,0 +1,294 @@
+#include "overlay.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <tracy/Tracy.hpp>
+
+// 5x7 dots per glyph, one row per byte with the leftmost dot in bit 4.
+struct Glyph {
+    char character;
+    uint8_t rows[7];
+};
+
+constexpr Glyph font[] = {
+    { ' ', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+    { '0', { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E } },
+    { '1', { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+    { '2', { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F } },
+    { '3', { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E } },
+    { '4', { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 } },
+    { '5', { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E } },
+    { '6', { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E } },
+    { '7', { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+    { '8', { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E } },
+    { '9', { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C } },
+    { ':', { 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00 } },
+    { '-', { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 } },
+    { '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C } },
+    { '/', { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 } },
+    { 'k', { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 } },
+    { 'm', { 0x00, 0x00, 0x1A, 0x15, 0x15, 0x11, 0x11 } },
+    { 'h', { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 } }
+};
+
+constexpr int glyphCount = sizeof(font) / sizeof(*font);
+constexpr int fontWidth = 5;
+constexpr int fontHeight = 7;
+
+// Limited range white text with a translucent black outline, legible on any background.
+constexpr uint8_t fillLuma = 235;
+constexpr uint8_t fillAlpha = 255;
+constexpr uint8_t outlineLuma = 16;
+constexpr uint8_t outlineAlpha = 192;
+constexpr uint8_t neutralChroma = 128;
+
+int findGlyph(char character) {
+    for (int i = 0; i < glyphCount; ++i) {
+        if (font[i].character == character) {
+            return i;
+        }
+    }
+
+    return 0;  // Blank.
+}
+
+GlyphAtlas::GlyphAtlas(int scale) {
+    ZoneScoped;
+
+    scale = std::max(scale, 2);
+
+    // The outline fits in the dot of spacing between glyphs, so cells can be placed side by side without overlapping.
+    const int outline = scale / 2;
+    cellWidth = (fontWidth + 1) * scale;
+    cellHeight = fontHeight * scale + 2 * outline;
+
+    const size_t cellSize = static_cast<size_t>(cellWidth) * cellHeight;
+    inverse.resize(cellSize * glyphCount);
+    premultiplied.resize(cellSize * glyphCount);
+    alpha.resize(cellSize * glyphCount);
+
+    for (int glyph = 0; glyph < glyphCount; ++glyph) {
+        const auto isDot = [&](int x, int y) {
+            x -= outline;
+            y -= outline;
+            if (x < 0 || y < 0 || x >= fontWidth * scale || y >= fontHeight * scale) {
+                return false;
+            }
+
+            return ((font[glyph].rows[y / scale] >> (fontWidth - 1 - x / scale)) & 1) != 0;
+        };
+
+        for (int y = 0; y < cellHeight; ++y) {
+            for (int x = 0; x < cellWidth; ++x) {
+                uint8_t value = 0;
+                uint8_t coverage = 0;
+
+                if (isDot(x, y)) {
+                    value = fillLuma;
+                    coverage = fillAlpha;
+                } else {
+                    bool nearDot = false;
+                    for (int dy = -outline; dy <= outline && !nearDot; ++dy) {
+                        for (int dx = -outline; dx <= outline && !nearDot; ++dx) {
+                            nearDot = isDot(x + dx, y + dy);
+                        }
+                    }
+
+                    if (nearDot) {
+                        value = outlineLuma;
+                        coverage = outlineAlpha;
+                    }
+                }
+
+                const size_t offset = glyph * cellSize + static_cast<size_t>(y) * cellWidth + x;
+                inverse[offset] = 255 - coverage;
+                premultiplied[offset] = static_cast<uint16_t>(value * coverage);
+                alpha[offset] = coverage;
+            }
+        }
+    }
+}
+
+size_t GlyphAtlas::getOffset(char character, int row) const {
+    return (static_cast<size_t>(findGlyph(character)) * cellHeight + row) * cellWidth;
+}
+
+const uint8_t* GlyphAtlas::getInverse(char character, int row) const {
+    return inverse.data() + getOffset(character, row);
+}
+
+const uint16_t* GlyphAtlas::getPremultiplied(char character, int row) const {
+    return premultiplied.data() + getOffset(character, row);
+}
+
+const uint8_t* GlyphAtlas::getAlpha(char character, int row) const {
+    return alpha.data() + getOffset(character, row);
+}
+
+// Division by 255 with rounding, exact for anything up to 255 * 255. Every path below computes it the same way, in 16 bit lanes.
+inline uint8_t divide255(unsigned value) {
+    value += 128;
+
+    return static_cast<uint8_t>((value + (value >> 8)) >> 8);
+}
+
+void blendOverlayRow(uint8_t* destination, const uint8_t* inverse, const uint16_t* premultiplied, size_t count) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    const uint16x8_t half = vdupq_n_u16(128);
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16_t pixels = vld1q_u8(destination + i);
+        const uint8x16_t weights = vld1q_u8(inverse + i);
+
+        uint16x8_t low = vaddq_u16(vmlal_u8(vld1q_u16(premultiplied + i), vget_low_u8(pixels), vget_low_u8(weights)), half);
+        uint16x8_t high = vaddq_u16(vmlal_u8(vld1q_u16(premultiplied + i + 8), vget_high_u8(pixels), vget_high_u8(weights)), half);
+
+        // (value + (value >> 8)) >> 8
+        low = vsraq_n_u16(low, low, 8);
+        high = vsraq_n_u16(high, high, 8);
+
+        vst1q_u8(destination + i, vcombine_u8(vshrn_n_u16(low, 8), vshrn_n_u16(high, 8)));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 16 <= count; i += 16) {
+        const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(destination + i));
+        const auto weights = _mm_loadu_si128(reinterpret_cast<const __m128i*>(inverse + i));
+        const auto valuesLow = _mm_loadu_si128(reinterpret_cast<const __m128i*>(premultiplied + i));
+        const auto valuesHigh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(premultiplied + i + 8));
+
+        // The products fit in 16 bits, so the low half of the signed multiply is exact.
+        auto low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(weights, zero)), valuesLow);
+        auto high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(weights, zero)), valuesHigh);
+
+        low = _mm_add_epi16(low, half);
+        high = _mm_add_epi16(high, half);
+        low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    // Scalar fallback, and the tail of the vectorized paths.
+    for (; i < count; ++i) {
+        destination[i] = divide255(destination[i] * inverse[i] + premultiplied[i]);
+    }
+}
+
+TextOverlay::TextOverlay(const GlyphAtlas& atlas) : atlas(atlas) {}
+
+void TextOverlay::setText(const std::string& newText, int chromaShiftX, int chromaShiftY) {
+    if (newText == text && chromaShiftX == shiftX && chromaShiftY == shiftY) {
+        return;
+    }
+
+    ZoneScoped;
+
+    text = newText;
+    shiftX = chromaShiftX;
+    shiftY = chromaShiftY;
+
+    const int cellWidth = atlas.getCellWidth();
+    luma.width = cellWidth * static_cast<int>(text.size());
+    luma.height = atlas.getCellHeight();
+
+    const size_t size = static_cast<size_t>(luma.width) * luma.height;
+    luma.inverse.resize(size);
+    luma.premultiplied.resize(size);
+    alpha.resize(size);
+
+    // Cells don't overlap, so the text is just rows copied from the atlas.
+    for (int row = 0; row < luma.height; ++row) {
+        const size_t line = static_cast<size_t>(row) * luma.width;
+
+        for (size_t i = 0; i < text.size(); ++i) {
+            const size_t offset = line + i * cellWidth;
+
+            std::memcpy(luma.inverse.data() + offset, atlas.getInverse(text[i], row), cellWidth);
+            std::memcpy(luma.premultiplied.data() + offset, atlas.getPremultiplied(text[i], row), cellWidth * sizeof(uint16_t));
+            std::memcpy(alpha.data() + offset, atlas.getAlpha(text[i], row), cellWidth);
+        }
+    }
+
+    renderChroma();
+}
+
+// Each chroma sample covers a block of luma pixels, and takes their mean coverage.
+void TextOverlay::renderChroma() {
+    const int blockWidth = 1 << shiftX;
+    const int blockHeight = 1 << shiftY;
+
+    chroma.width = (luma.width + blockWidth - 1) >> shiftX;
+    chroma.height = (luma.height + blockHeight - 1) >> shiftY;
+
+    const size_t size = static_cast<size_t>(chroma.width) * chroma.height;
+    chroma.inverse.resize(size);
+    chroma.premultiplied.resize(size);
+
+    for (int y = 0; y < chroma.height; ++y) {
+        for (int x = 0; x < chroma.width; ++x) {
+            unsigned sum = 0;
+            unsigned samples = 0;
+
+            for (int dy = 0; dy < blockHeight && (y << shiftY) + dy < luma.height; ++dy) {
+                for (int dx = 0; dx < blockWidth && (x << shiftX) + dx < luma.width; ++dx) {
+                    sum += alpha[static_cast<size_t>((y << shiftY) + dy) * luma.width + (x << shiftX) + dx];
+                    ++samples;
+                }
+            }
+
+            const auto coverage = static_cast<uint8_t>((sum + samples / 2) / samples);
+            const size_t offset = static_cast<size_t>(y) * chroma.width + x;
+
+            chroma.inverse[offset] = 255 - coverage;
+            chroma.premultiplied[offset] = static_cast<uint16_t>(neutralChroma * coverage);
+        }
+    }
+}
+
+void TextOverlay::draw(uint8_t* const planes[3], const int linesizes[3], int width, int height, OverlayPosition position, int margin) const {
+    ZoneScoped;
+
+    if (text.empty()) {
+        return;
+    }
+
+    const bool right = position == OverlayPosition::TOP_RIGHT || position == OverlayPosition::BOTTOM_RIGHT;
+    const bool bottom = position == OverlayPosition::BOTTOM_LEFT || position == OverlayPosition::BOTTOM_RIGHT;
+
+    // Aligned to the chroma grid, so that the chroma samples line up with the luma they were rendered from.
+    int x = std::max(right ? width - luma.width - margin : margin, 0);
+    int y = std::max(bottom ? height - luma.height - margin : margin, 0);
+    x &= ~((1 << shiftX) - 1);
+    y &= ~((1 << shiftY) - 1);
+
+    const auto blendPlane = [](uint8_t* data, int linesize, int planeWidth, int planeHeight, const Plane& plane, int left, int top) {
+        const int columns = std::min(plane.width, planeWidth - left);
+        const int rows = std::min(plane.height, planeHeight - top);
+
+        for (int row = 0; row < rows; ++row) {
+            const size_t offset = static_cast<size_t>(row) * plane.width;
+
+            blendOverlayRow(data + static_cast<ptrdiff_t>(top + row) * linesize + left, plane.inverse.data() + offset,
+                plane.premultiplied.data() + offset, std::max(columns, 0));
+        }
+    };
+
+    blendPlane(planes[0], linesizes[0], width, height, luma, x, y);
+
+    const int chromaWidth = (width + (1 << shiftX) - 1) >> shiftX;
+    const int chromaHeight = (height + (1 << shiftY) - 1) >> shiftY;
+    for (int plane = 1; plane < 3; ++plane) {
+        blendPlane(planes[plane], linesizes[plane], chromaWidth, chromaHeight, chroma, x >> shiftX, y >> shiftY);
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Text burned into frames, for a timestamp on the footage itself. Glyphs come from a small bitmap font scaled up and outlined once at
+// startup, so drawing a frame is a few row copies when the text changes and a blend of the text's bounding box otherwise.
+
+// Each glyph prerendered at a scale, as the blend wants it: 255 - alpha and value * alpha per pixel, for luma.
+class GlyphAtlas {
+public:
+    // The font is 5x7 dots with a dot of spacing, scale is the size of a dot in pixels, at least 2.
+    explicit GlyphAtlas(int scale);
+
+    int getCellWidth() const { return cellWidth; }
+    int getCellHeight() const { return cellHeight; }
+
+    // Row of a glyph's cell, characters missing from the font are blank. Covers digits, space, ":-./" and the letters of "km/h".
+    const uint8_t* getInverse(char character, int row) const;
+    const uint16_t* getPremultiplied(char character, int row) const;
+    const uint8_t* getAlpha(char character, int row) const;
+
+private:
+    size_t getOffset(char character, int row) const;
+
+    int cellWidth;
+    int cellHeight;
+    std::vector<uint8_t> inverse{};
+    std::vector<uint16_t> premultiplied{};
+    std::vector<uint8_t> alpha{};
+};
+
+// Blends a row of text into a plane: dst = round((dst * inverse + premultiplied) / 255). Vectorized with NEON or SSE2 when available,
+// and exact either way, so every path produces the same pixels.
+void blendOverlayRow(uint8_t* destination, const uint8_t* inverse, const uint16_t* premultiplied, size_t count);
+
+// A line of text, rendered from the atlas into its own planes whenever it changes.
+class TextOverlay {
+public:
+    explicit TextOverlay(const GlyphAtlas& atlas);
+
+    // Renders the text if it differs from the last, or if the chroma subsampling changed.
+    void setText(const std::string& text, int chromaShiftX, int chromaShiftY);
+
+    // Blends the text into planar 8 bit YUV, clipped to the frame. The chroma shifts must match the ones the text was rendered for.
+    void draw(uint8_t* const planes[3], const int linesizes[3], int width, int height, OverlayPosition position, int margin) const;
+
+private:
+    struct Plane {
+        int width = 0;
+        int height = 0;
+        std::vector<uint8_t> inverse{};
+        std::vector<uint16_t> premultiplied{};
+    };
+
+    void renderChroma();
+
+    const GlyphAtlas& atlas;
+    std::string text{};
+    int shiftX = -1;
+    int shiftY = -1;
+    Plane luma{};
+    Plane chroma{};  // Shared by both chroma planes, the text is neutral grey.
+    std::vector<uint8_t> alpha{};  // Luma resolution, for rendering the chroma plane.
+};
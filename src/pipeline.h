@@ -0,0 +1,329 @@
+#pragma once
+
+#include "channel.h"
+#include "schedule.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <tracy/Tracy.hpp>
+
+// Compile-time pipeline composition.
+//
+// A stage is a type with an Input and Output item type, a Stage used for scheduling, and a constructor taking the pipeline context.
+// Sources have an Input of void and implement produce(emit), returning false once they're done. Every other stage implements
+// process(item, emit). Sinks have an Output of void and never emit. Items are pointers, null is reserved to drain the pipeline.
+//
+// Stages are grouped with Fused<...>, each group runs on its own thread and hands items to the next stage in the group by a direct call.
+// Groups are connected by channels. Fusing cheap adjacent stages saves a thread and a channel handoff per item, and stages left out of a
+// layout cost nothing at runtime.
+
+// Default hooks, stages override what they need.
+struct StageBase {
+    // Called once the input is exhausted, before the drain is passed on.
+    template <typename Emit>
+    void finish(Emit&&) {}
+
+    // How long the stage can wait for input before idle() needs to be called.
+    std::chrono::milliseconds timeout() const { return std::chrono::milliseconds::max(); }
+
+    // Called when no input arrived within the timeout.
+    template <typename Emit>
+    void idle(Emit&&) {}
+};
+
+template <typename... Stages>
+class Fused;
+
+template <typename Last>
+class Fused<Last> {
+public:
+    using Input = typename Last::Input;
+    using Output = typename Last::Output;
+    static constexpr Stage schedule = Last::schedule;
+
+    template <typename Context>
+    explicit Fused(Context& context) : stage{ context } {}
+
+    template <typename Emit>
+    bool produce(Emit&& emit) { return stage.produce(emit); }
+
+    template <typename Item, typename Emit>
+    void process(Item item, Emit&& emit) { stage.process(item, emit); }
+
+    template <typename Emit>
+    void finish(Emit&& emit) { stage.finish(emit); }
+
+    std::chrono::milliseconds timeout() const { return stage.timeout(); }
+
+    template <typename Emit>
+    void idle(Emit&& emit) { stage.idle(emit); }
+
+private:
+    Last stage;
+};
+
+template <typename First, typename Second, typename... Rest>
+class Fused<First, Second, Rest...> {
+    using Next = Fused<Second, Rest...>;
+
+    static_assert(std::is_same_v<typename First::Output, typename Next::Input>, "Adjacent stages must agree on the item type.");
+
+public:
+    using Input = typename First::Input;
+    using Output = typename Next::Output;
+    static constexpr Stage schedule = First::schedule;  // The group is scheduled as its first stage.
+
+    template <typename Context>
+    explicit Fused(Context& context) : first{ context }, next{ context } {}
+
+    template <typename Emit>
+    bool produce(Emit&& emit) {
+        return first.produce([&](typename First::Output item) { next.process(item, emit); });
+    }
+
+    template <typename Item, typename Emit>
+    void process(Item item, Emit&& emit) {
+        first.process(item, [&](typename First::Output result) { next.process(result, emit); });
+    }
+
+    template <typename Emit>
+    void finish(Emit&& emit) {
+        first.finish([&](typename First::Output item) { next.process(item, emit); });
+        next.finish(emit);
+    }
+
+    std::chrono::milliseconds timeout() const { return std::min(first.timeout(), next.timeout()); }
+
+    template <typename Emit>
+    void idle(Emit&& emit) {
+        first.idle([&](typename First::Output item) { next.process(item, emit); });
+        next.idle(emit);
+    }
+
+private:
+    First first;
+    Next next;
+};
+
+// Measurements of one channel and the group it feeds, since the previous sample.
+struct ChannelSample {
+    const char* name = nullptr;  // The group the channel feeds.
+    size_t depth = 0;
+    uint64_t items = 0;  // Items processed by the group.
+    double serviceUs = 0.0;  // Mean time the group took per item, not counting time spent waiting for room downstream.
+    double serviceVarianceUs = 0.0;  // Variance of the above, in us squared.
+    uint64_t blockedUs = 0;  // Time the writer spent waiting for room.
+    double occupancy = 0.0;  // Mean items left queued after each read.
+};
+
+// A chain of fused groups, one thread each, connected by channels. The threads start on construction and run until the source finishes
+// and every group has drained.
+template <typename... Groups>
+class Pipeline {
+    static constexpr size_t groupCount = sizeof...(Groups);
+
+    static_assert(groupCount > 0, "A pipeline needs at least one group.");
+
+    template <size_t Index>
+    using Group = std::tuple_element_t<Index, std::tuple<Groups...>>;
+
+    // Each channel is named after the group it feeds, for the profiler.
+    template <size_t... Index>
+    static auto makeChannels(const std::vector<size_t>& depths, std::index_sequence<Index...>) {
+        return std::make_tuple(
+            std::make_unique<Channel<typename Group<Index>::Output>>(depths.at(Index), getStageName(Group<Index + 1>::schedule))...);
+    }
+
+    using Channels = decltype(makeChannels({}, std::make_index_sequence<groupCount - 1>{}));
+
+    // Written by each worker per item, read by sample().
+    struct Timing {
+        std::atomic<uint64_t> items{ 0 };
+        std::atomic<uint64_t> serviceUs{ 0 };
+        std::atomic<uint64_t> serviceSquaredUs{ 0 };
+    };
+
+    struct Counters {
+        uint64_t items = 0;
+        uint64_t serviceUs = 0;
+        uint64_t serviceSquaredUs = 0;
+        ChannelStats channel{};
+    };
+
+public:
+    static constexpr size_t channelCount = groupCount - 1;
+
+    // Depth is the capacity of each channel between groups.
+    template <typename Context>
+    Pipeline(Context& context, size_t depth) : Pipeline(context, std::vector<size_t>(channelCount, depth)) {}
+
+    // One capacity per channel, in order.
+    template <typename Context>
+    Pipeline(Context& context, const std::vector<size_t>& depths) : channels(makeChannels(depths, std::make_index_sequence<channelCount>{})) {
+        launch(context, std::make_index_sequence<groupCount>{});
+    }
+
+    ~Pipeline() {
+        join();
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    void setDepth(size_t index, size_t depth) {
+        visitChannel(index, [&](auto& channel) { channel.setCapacity(depth); }, std::make_index_sequence<channelCount>{});
+    }
+
+    // Measurements since the previous call, one per channel. Only call from one thread.
+    std::vector<ChannelSample> sample() {
+        std::vector<ChannelSample> samples;
+        samples.reserve(channelCount);
+
+        sampleChannels(samples, std::make_index_sequence<channelCount>{});
+
+        return samples;
+    }
+
+    // Waits for every group to drain.
+    void join() {
+        ZoneScoped;
+
+        for (auto& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+private:
+    template <typename Visit, size_t... Index>
+    void visitChannel(size_t index, Visit&& visit, std::index_sequence<Index...>) {
+        ((Index == index ? visit(*std::get<Index>(channels)) : void()), ...);
+    }
+
+    template <size_t... Index>
+    void sampleChannels(std::vector<ChannelSample>& samples, std::index_sequence<Index...>) {
+        (samples.push_back(sampleChannel<Index>()), ...);
+    }
+
+    template <size_t Index>
+    ChannelSample sampleChannel() {
+        const auto& timing = timings[Index + 1];
+
+        Counters current{
+            .items = timing.items.load(std::memory_order_relaxed),
+            .serviceUs = timing.serviceUs.load(std::memory_order_relaxed),
+            .serviceSquaredUs = timing.serviceSquaredUs.load(std::memory_order_relaxed),
+            .channel = std::get<Index>(channels)->getStats()
+        };
+
+        auto& last = previous[Index];
+
+        ChannelSample sample{
+            .name = getStageName(Group<Index + 1>::schedule),
+            .depth = current.channel.capacity,
+            .items = current.items - last.items,
+            .blockedUs = current.channel.blockedUs - last.channel.blockedUs
+        };
+
+        if (sample.items > 0) {
+            const double mean = static_cast<double>(current.serviceUs - last.serviceUs) / sample.items;
+            const double meanSquare = static_cast<double>(current.serviceSquaredUs - last.serviceSquaredUs) / sample.items;
+
+            sample.serviceUs = mean;
+            sample.serviceVarianceUs = std::max(meanSquare - mean * mean, 0.0);
+        }
+
+        if (const auto pops = current.channel.pops - last.channel.pops; pops > 0) {
+            sample.occupancy = static_cast<double>(current.channel.queued - last.channel.queued) / pops;
+        }
+
+        last = current;
+
+        return sample;
+    }
+
+    template <typename Context, size_t... Index>
+    void launch(Context& context, std::index_sequence<Index...>) {
+        (workers.push_back(std::thread{ &Pipeline::worker<Index, Context>, this, std::ref(context) }), ...);
+    }
+
+    template <size_t Index, typename Context>
+    void worker(Context& context) {
+        using Current = Group<Index>;
+        constexpr bool hasOutput = Index + 1 < groupCount;
+
+        applySchedule(Current::schedule);
+
+        Current group{ context };
+
+        auto emit = [&](auto item) {
+            if constexpr (hasOutput) {
+                std::get<Index>(channels)->push(item);
+            }
+        };
+
+        if constexpr (Index == 0) {
+            static_assert(std::is_void_v<typename Current::Input>, "The first group must start with a source.");
+
+            while (group.produce(emit)) {}
+        } else {
+            auto& input = *std::get<Index - 1>(channels);
+
+            while (true) {
+                const auto timeout = group.timeout();
+                auto item = timeout == std::chrono::milliseconds::max() ? std::optional{ input.pop() } : input.popFor(timeout);
+                if (!item) {
+                    group.idle(emit);
+                    continue;
+                }
+
+                if (!*item) {
+                    break;
+                }
+
+                // Time spent waiting for room downstream is the next group's doing, not this one's.
+                const auto start = std::chrono::steady_clock::now();
+                uint64_t blockedBefore = 0;
+                if constexpr (hasOutput) {
+                    blockedBefore = std::get<Index>(channels)->getBlockedUs();
+                }
+
+                group.process(*item, emit);
+
+                auto elapsed = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+                if constexpr (hasOutput) {
+                    elapsed -= std::min(elapsed, std::get<Index>(channels)->getBlockedUs() - blockedBefore);
+                }
+
+                auto& timing = timings[Index];
+                timing.items.fetch_add(1, std::memory_order_relaxed);
+                timing.serviceUs.fetch_add(elapsed, std::memory_order_relaxed);
+                timing.serviceSquaredUs.fetch_add(elapsed * elapsed, std::memory_order_relaxed);
+            }
+        }
+
+        group.finish(emit);
+
+        // Drain the pipeline.
+        if constexpr (hasOutput) {
+            std::get<Index>(channels)->push(nullptr);
+        }
+    }
+
+    Channels channels;
+    std::array<Timing, groupCount> timings{};
+    std::array<Counters, channelCount> previous{};
+    std::list<std::thread> workers;
+};
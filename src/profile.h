@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+// Profiling helpers on top of Tracy. Without TRACY_ENABLE they're empty and compile away like the Tracy macros themselves.
+//
+// Captures are numbered, and the number rides along in the opaque field of the packet and of every frame made from it (decoders and
+// filters copy it, the encoder is covered by EncoderFrameIds). Tagging each stage's zone with it follows one capture across threads.
+
+#ifdef TRACY_ENABLE
+
+inline void setFrameId(AVPacket* packet, uint64_t id) {
+    packet->opaque = reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+}
+
+inline uint64_t getFrameId(const AVPacket* packet) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(packet->opaque));
+}
+
+inline uint64_t getFrameId(const AVFrame* frame) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(frame->opaque));
+}
+
+#define ZoneFrameId(item) ZoneValue(getFrameId(item))
+
+// Hardware encoders don't support AV_CODEC_FLAG_COPY_OPAQUE, so frame numbers are matched to packets through the timestamp.
+class EncoderFrameIds {
+public:
+    void add(const AVFrame* frame) {
+        entries[next++ % capacity] = { frame->pts, getFrameId(frame) };
+    }
+
+    void apply(AVPacket* packet) const {
+        for (const auto& entry : entries) {
+            if (entry.pts == packet->pts) {
+                setFrameId(packet, entry.id);
+                return;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t capacity = 64;  // More than any encoder holds on to.
+
+    struct Entry {
+        int64_t pts = AV_NOPTS_VALUE;
+        uint64_t id = 0;
+    };
+
+    Entry entries[capacity]{};
+    size_t next = 0;
+};
+
+// Plots a byte count as kbit/s, once per second.
+class RatePlot {
+public:
+    explicit RatePlot(const char* name) : name(name) {}
+
+    void add(size_t size) {
+        bytes += size;
+
+        const auto now = std::chrono::steady_clock::now();
+        if (const auto elapsed = now - start; elapsed >= std::chrono::seconds{ 1 }) {
+            TracyPlot(name, static_cast<int64_t>(bytes * 8 / std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()));
+            bytes = 0;
+            start = now;
+        }
+    }
+
+private:
+    const char* name;
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+#else
+
+inline void setFrameId(AVPacket*, uint64_t) {}
+
+#define ZoneFrameId(item)
+
+class EncoderFrameIds {
+public:
+    void add(const AVFrame*) {}
+    void apply(AVPacket*) const {}
+};
+
+class RatePlot {
+public:
+    explicit RatePlot(const char*) {}
+
+    void add(size_t) {}
+};
+
+#endif
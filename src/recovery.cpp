@@ -0,0 +1,73 @@
+#include "recovery.h"
+
+#include <algorithm>
+#include <thread>
+
+extern "C"
+{
+    #include <libavutil/error.h>
+}
+
+std::atomic<uint64_t> recoveryCounts[static_cast<size_t>(RecoveryAction::COUNT)]{};
+
+const char* recoveryNames[] = {
+    "skipped frames",
+    "decoder resets",
+    "filter resets",
+    "encoder resets",
+    "input reopens",
+    "write retries",
+    "new segments",
+    "session restarts"
+};
+
+static_assert(sizeof(recoveryNames) / sizeof(*recoveryNames) == static_cast<size_t>(RecoveryAction::COUNT));
+
+ErrorClass classifyError(int error) {
+    switch (error) {
+        case AVERROR(EAGAIN):
+        case AVERROR(EINTR):
+        case AVERROR(ETIMEDOUT):
+            return ErrorClass::TRANSIENT;
+        case AVERROR_INVALIDDATA:
+        case AVERROR_PATCHWELCOME:
+            return ErrorClass::CORRUPT_DATA;
+        case AVERROR_EOF:  // A capture device never ends, it was unplugged.
+        case AVERROR(EIO):
+        case AVERROR(ENODEV):
+        case AVERROR(ENXIO):
+        case AVERROR(ENOENT):
+            return ErrorClass::DEVICE;
+        default:
+            return ErrorClass::CODEC;
+    }
+}
+
+void recordRecovery(RecoveryAction action) {
+    recoveryCounts[static_cast<size_t>(action)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t getRecoveryCount(RecoveryAction action) {
+    return recoveryCounts[static_cast<size_t>(action)].load(std::memory_order_relaxed);
+}
+
+const char* getRecoveryName(RecoveryAction action) {
+    return recoveryNames[static_cast<size_t>(action)];
+}
+
+bool Backoff::wait(const std::atomic<bool>& running) {
+    // Sliced, so that a drain isn't held up by a long delay.
+    constexpr std::chrono::milliseconds slice{ 50 };
+
+    for (auto remaining = delay; remaining.count() > 0; remaining -= slice) {
+        if (!running.load(std::memory_order_relaxed)) {
+            return false;
+        }
+
+        std::this_thread::sleep_for(std::min(remaining, slice));
+    }
+
+    delay = std::min(delay * 2, maximum);
+
+    return running.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+// Fault recovery for the recording pipeline. Errors are classified by what it takes to get past them, and each stage repairs its own
+// state while the others keep running, instead of the whole process exiting and being restarted.
+
+// What a failed FFmpeg call needs.
+enum class ErrorClass : uint8_t {
+    TRANSIENT = 0,  // Nothing is wrong, try again.
+    CORRUPT_DATA = 1,  // The item is bad, skip it.
+    CODEC = 2,  // The codec or filter state is bad, reset it.
+    DEVICE = 3  // The device went away, reopen it.
+};
+
+ErrorClass classifyError(int error);
+
+// Recovery actions, counted for telemetry.
+enum class RecoveryAction : uint8_t {
+    SKIP_FRAME = 0,
+    RESET_DECODER = 1,
+    RESET_FILTER = 2,
+    RESET_ENCODER = 3,
+    REOPEN_INPUT = 4,
+    RETRY_WRITE = 5,
+    NEW_SEGMENT = 6,  // Storage failed, recording moved on to a new segment.
+    RESTART_SESSION = 7,  // A stage couldn't repair itself, the main thread rebuilt the codecs for a new session.
+    COUNT
+};
+
+void recordRecovery(RecoveryAction action);
+uint64_t getRecoveryCount(RecoveryAction action);
+const char* getRecoveryName(RecoveryAction action);
+
+// Exponential backoff between recovery attempts. Starts small, since most faults clear up right away.
+class Backoff {
+public:
+    Backoff(std::chrono::milliseconds minimum, std::chrono::milliseconds maximum) : minimum(minimum), maximum(maximum), delay(minimum) {}
+
+    // Sleeps for the current delay and doubles it. Returns early with false once running is cleared.
+    bool wait(const std::atomic<bool>& running);
+    void reset() { delay = minimum; }
+
+private:
+    std::chrono::milliseconds minimum;
+    std::chrono::milliseconds maximum;
+    std::chrono::milliseconds delay;
+};
@@ -0,0 +1,148 @@
+#include "retention.h"
+#include "storage.h"
+#include "video.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <set>
+#include <thread>
+
+#include <tracy/Tracy.hpp>
+
+constexpr double ratioSmoothing = 0.1;  // Weight of the newest interval, the output of a few minutes says little about the next hours.
+constexpr double maxStep = 0.25;  // Largest change of the bitrate per interval, as a fraction.
+constexpr double minChange = 0.02;  // Changes smaller than this aren't worth applying.
+constexpr double minMeasuredSeconds = 10.0;  // Recording time an interval needs before its output counts.
+constexpr uint64_t minMeasuredSegments = 64ULL * 1024ULL * 1024ULL;  // Segment bytes needed before the companion share is trusted.
+
+RetentionController::RetentionController(const Config& config, int frameRate) : config(config), frameRate(std::max(frameRate, 1)),
+    bitRate(std::clamp(config.encoderBitRate, config.retentionMinBitRate, config.retentionMaxBitRate)) {
+    last = getRecorderTelemetry();
+    setEncoderBitRate(bitRate);
+}
+
+RetentionController::StorageUsage RetentionController::measureStorage() {
+    ZoneScoped;
+
+    StorageUsage usage{};
+    std::error_code error;
+
+    // Same rules as culling, protected segments and their companions never make room.
+    std::set<std::string> protectedStems;
+    for (const auto& entry : std::filesystem::directory_iterator{ storageLocation, error }) {
+        if (entry.path().extension() == protectSuffix) {
+            protectedStems.insert(getSegmentStem(entry.path()));
+        }
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator{ storageLocation, error }) {
+        if (!entry.is_regular_file(error) || protectedStems.count(getSegmentStem(entry.path())) > 0) {
+            continue;
+        }
+
+        const auto size = entry.file_size(error);
+        if (error) {
+            continue;
+        }
+
+        usage.recordings += size;
+
+        if (entry.path().filename().string() == getSegmentStem(entry.path()) + segmentSuffix) {
+            usage.segments += size;
+        }
+    }
+
+    const auto space = std::filesystem::space(storageLocation, error);
+    if (!error) {
+        const uint64_t reserve = storageReserve + getSegmentSpace();
+        usage.usable = usage.recordings + space.available > reserve ? usage.recordings + space.available - reserve : 0;
+    }
+
+    return usage;
+}
+
+void RetentionController::update() {
+    ZoneScoped;
+
+    const auto telemetry = getRecorderTelemetry();
+    const double recordedSeconds = static_cast<double>(telemetry.frames - last.frames) / frameRate;
+    const auto outputBytes = telemetry.outputBytes - last.outputBytes;
+    const auto builtBitRate = getBuiltEncoderBitRate();
+
+    // How far the encoder's output is from its target. Only intervals with enough recording say anything. The new bitrate only reaches
+    // the encoder at the next segment, and an interval in which it did mixes two targets, so measuring starts over from there.
+    if (builtBitRate != lastBuiltBitRate) {
+        lastBuiltBitRate = builtBitRate;
+        last = telemetry;
+    } else if (builtBitRate > 0 && recordedSeconds >= minMeasuredSeconds) {
+        const double ratio = std::clamp(outputBytes * 8.0 / recordedSeconds / builtBitRate, 0.1, 10.0);
+
+        outputRatio = measured ? outputRatio + ratioSmoothing * (ratio - outputRatio) : ratio;
+        measured = true;
+        last = telemetry;
+    } else if (recordedSeconds <= 0.0) {
+        last = telemetry;
+    }
+
+    const auto usage = measureStorage();
+    if (usage.usable == 0) {
+        logWarning("No space left for recordings, keeping the bitrate at %lld kbps.", static_cast<long long>(bitRate / 1000));
+        return;
+    }
+
+    // Proxies and thumbnails take their share of the same space. Before there's enough on the card to tell, the proxy's rate stands in.
+    double companionShare = 1.0 + static_cast<double>(config.proxyEnabled ? config.proxyBitRate : 0) / bitRate;
+    if (usage.segments >= minMeasuredSegments) {
+        companionShare = static_cast<double>(usage.recordings) / usage.segments;
+    }
+
+    const double retentionSeconds = config.retentionHours * 3600.0;
+    const double allowedBitRate = usage.usable * 8.0 / retentionSeconds / companionShare;
+
+    auto target = static_cast<int64_t>(allowedBitRate / outputRatio);
+    target = std::clamp(target, static_cast<int64_t>(bitRate * (1.0 - maxStep)), static_cast<int64_t>(bitRate * (1.0 + maxStep)));
+    target = std::clamp(target, config.retentionMinBitRate, config.retentionMaxBitRate);
+
+    // What the card holds at the rate actually being written, the number this is all for.
+    const double heldHours = usage.usable * 8.0 / (bitRate * outputRatio * companionShare) / 3600.0;
+    logDebug("Retention: %.1f h held at %lld kbps, %.1f h targeted, %.2f GB usable, output at %.0f%% of the target.", heldHours,
+        static_cast<long long>(bitRate / 1000), static_cast<double>(config.retentionHours), usage.usable / 1e9, outputRatio * 100.0);
+
+    if (std::abs(static_cast<double>(target - bitRate)) < bitRate * minChange) {
+        return;
+    }
+
+    logInfo("Encoder bitrate from %lld to %lld kbps: %.2f GB usable for %d h is %.0f kbps, less %.0f%% for companion files, and the "
+        "encoder writes %.0f%% of its target. The card holds %.1f h at the old rate.", static_cast<long long>(bitRate / 1000),
+        static_cast<long long>(target / 1000), usage.usable / 1e9, config.retentionHours, usage.usable * 8.0 / retentionSeconds / 1000.0,
+        (1.0 - 1.0 / companionShare) * 100.0, outputRatio * 100.0, heldHours);
+
+    if (target == config.retentionMinBitRate && allowedBitRate / outputRatio < target) {
+        logWarning("The bitrate floor of %lld kbps leaves less than %d h on the card.", static_cast<long long>(target / 1000),
+            config.retentionHours);
+    }
+
+    bitRate = target;
+    setEncoderBitRate(bitRate);
+}
+
+void startRetentionControl(int frameRate) {
+    const auto& config = getConfig();
+    if (config.retentionHours <= 0) {
+        return;
+    }
+
+    // The first update runs right away, so that the first encoder is built at the sized rate.
+    auto controller = std::make_shared<RetentionController>(config, frameRate);
+    controller->update();
+
+    std::thread{ [controller, &config] {
+        while (true) {
+            std::this_thread::sleep_for(config.retentionInterval);
+            controller->update();
+        }
+    } }.detach();
+}
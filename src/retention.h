@@ -0,0 +1,41 @@
+#pragma once
+
+#include "config.h"
+#include "telemetry.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+// Sizes the encoder's bitrate so that the card holds the configured hours of recordings. The space recordings may use is the free space
+// plus every unprotected recording, less the reserve getStorage() keeps. Dividing it by the target gives the bytes a second of recording
+// may take, which is split between the segment and its companion files in the proportion measured on the card. The encoder rarely hits
+// its target exactly, and parked time records less than the full rate, so the bitrate is corrected by the measured output over the
+// rate the encoder was built with, smoothed over many intervals. Steps are limited so that a bad measurement can't swing the quality.
+class RetentionController {
+public:
+    RetentionController(const Config& config, int frameRate);
+
+    // Called every retention interval.
+    void update();
+
+private:
+    struct StorageUsage {
+        uint64_t usable = 0;  // Space recordings may use, free or taken by unprotected recordings.
+        uint64_t segments = 0;  // Taken by unprotected segments.
+        uint64_t recordings = 0;  // Taken by unprotected segments and their companion files.
+    };
+
+    static StorageUsage measureStorage();
+
+    const Config& config;
+    int frameRate;
+    int64_t bitRate;
+    double outputRatio = 1.0;  // Measured output over the target, smoothed.
+    bool measured = false;
+    RecorderTelemetry last{};
+    int64_t lastBuiltBitRate = 0;  // Encoder bitrate at the start of the interval being measured.
+};
+
+// Runs the controller on its own thread for as long as the process lives. Does nothing when retention.hours is 0.
+void startRetentionControl(int frameRate);
@@ -3,17 +3,40 @@
 #include "video.h"
 #include "status.h"
 #include "channel.h"
+#include "budget.h"
+#include "schedule.h"
+#include "writer.h"
+#include "config.h"
+#include "pipeline.h"
+#include "motion.h"
+#include "thumbnail.h"
+#include "manifest.h"
+#include "telemetry.h"
+#include "log.h"
+#include "profile.h"
+#include "recovery.h"
+#include "tuning.h"
+#include "overlay.h"
+#include "retention.h"
+#include "decoder.h"
+#include "segment.h"
+#include "faults.h"
 
-#include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <chrono>
 #include <list>
 #include <atomic>
 #include <thread>
+#include <optional>
+#include <mutex>
+#include <limits>
 #include <cassert>
+#include <cmath>
+#include <ctime>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
 extern "C"
 {
@@ -41,13 +64,48 @@ uint32_t zoneColors[] = {
     0x70369D
 };
 
-void inputWorker(const VideoContext& context, std::atomic<bool>& flag, Channel<AVPacket*>& output) {
-    size_t job = 0;  // Debug variable for tracking pipelining.
+// Parking mode state, kept across recording sessions.
+struct ParkingState {
+    bool parked = false;
+    size_t stillFrames = 0;  // Consecutive frames without motion.
+};
+
+// State shared by every stage for one recording session.
+struct PipelineContext {
+    VideoContext& video;
+    std::atomic<bool>& running;  // Cleared to stop capturing and drain the pipeline.
+    Channel<bool>& reset;  // Pushed by a stage to have the main thread start a new session.
+    ParkingState& parking;
+    ProxyContext& proxy;
+    Channel<AVFrame*>* proxyFrames;  // Frames handed from the main pipeline to the proxy pipeline.
+    Channel<AVFrame*>* thumbnailFrames;  // Frames handed from the main pipeline to the thumbnail pipeline.
+    Segmenter& segmenter;  // Plans the segments, carries over between sessions.
+    MemoryPriority framePriority = MemoryPriority::BLOCKING;  // For decoded and filtered frames, set by record() for the layout.
+};
 
-    const auto targetUs = 1.0 * 1000.0 * 1000.0 / (double)context.frameRate;
-    auto lastFrame = std::chrono::high_resolution_clock::now();
+class InputStage : public StageBase {
+public:
+    using Input = void;
+    using Output = AVPacket*;
+    static constexpr Stage schedule = Stage::INPUT;
+
+    explicit InputStage(PipelineContext& context) : context(context.video), running(context.running) {
+        targetUs = 1.0 * 1000.0 * 1000.0 / (double)this->context.frameRate;
+        lastFrame = std::chrono::high_resolution_clock::now();
+    }
+
+    template <typename Emit>
+    bool produce(Emit&& emit) {
+        if (!running.load(std::memory_order_relaxed)) {
+            return false;
+        }
+
+        // Left closed by a reopen that was cut short when the previous session ended.
+        if (!context.inputCtx) {
+            reopen();
+            return true;
+        }
 
-    while (flag.load(std::memory_order_relaxed)) {
         ZoneScopedN("input_job");
         ZoneColor(zoneColors[job++ % (sizeof(zoneColors) / sizeof(*zoneColors))]);
 
@@ -56,110 +114,487 @@ void inputWorker(const VideoContext& context, std::atomic<bool>& flag, Channel<A
         {
             ZoneScopedN("input_drain");
 
-            if (auto ret = av_read_frame(context.inputCtx, packet); ret < 0) {
-                std::cerr << "Failed to read packet from input source.\n";
-                exit(1);  // #TODO: proper error handling and cleanup.
+            if (auto ret = readCapture(context.inputCtx, packet); ret < 0) {
+                av_packet_free(&packet);
+
+                if (classifyError(ret) != ErrorClass::TRANSIENT) {
+                    char buffer[256];
+                    logWarning("Failed to read packet from input source: %s, reopening it.", av_make_error_string(buffer, sizeof(buffer), ret));
+                    reopen();
+                }
+
+                return true;
             }
         }
 
-        output.push(packet);
+        setFrameId(packet, captures++);
+        ZoneFrameId(packet);
+
+        // Fresh captures are the cheapest thing to lose, so drop them rather than stall the device when over budget.
+        if (chargePacket(packet, MemoryPriority::DROPPABLE)) {
+            emit(packet);
+        } else {
+            logWarning("Over memory budget, dropped a captured frame.");
+        }
 
         const auto now = std::chrono::high_resolution_clock::now();
         const auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(now - lastFrame).count();
 
         const int waitUs = targetUs - elapsedUs;
+        recordCapture(waitUs > 0 ? 0 : -waitUs);
+        publishStatus();
+
         if (waitUs > 0) {
             std::this_thread::sleep_for(std::chrono::microseconds{ waitUs });
         } else {
-            // Send to stdout since we don't want to spam logs with this.
-            std::cout << "Falling behind! (" << waitUs * -1.0 / 1000.0 << "ms late)\n";
+            // Summarized per window, one line per late frame would flood the journal.
+            logSample(LogLevel::WARNING, "Falling behind", waitUs * -1.0 / 1000.0, "ms late");
         }
         lastFrame = now;
+
+        // One profiler frame per capture period.
+        FrameMark;
+
+        return true;
     }
 
-    // Drain the pipeline.
-    output.push(nullptr);
-}
+private:
+    // Only the device is reset, the stages downstream keep running and the MJPEG decoder has no state to lose. Retried with a growing
+    // delay while the device stays away.
+    void reopen() {
+        ZoneScoped;
+
+        while (!reopenInput(&context.inputCtx)) {
+            if (!backoff.wait(running)) {
+                return;
+            }
+        }
 
-void decodeWorker(const VideoContext& context, Channel<AVPacket*>& input, Channel<AVFrame*>& output) {
+        backoff.reset();
+        recordRecovery(RecoveryAction::REOPEN_INPUT);
+        logInfo("Reopened the input device.");
+
+        // Don't count the outage against the next frame's timing.
+        lastFrame = std::chrono::high_resolution_clock::now();
+    }
+
+    VideoContext& context;
+    std::atomic<bool>& running;
+    Backoff backoff{ std::chrono::milliseconds{ 10 }, std::chrono::milliseconds{ 2000 } };
     size_t job = 0;  // Debug variable for tracking pipelining.
+    uint64_t captures = 0;
+    double targetUs;
+    std::chrono::high_resolution_clock::time_point lastFrame;
+};
 
-    while (true) {
+// Decodes on the stage's own thread with a single decoder, or through a pool of decoders when there are several, see decoder.h. The
+// pool hands frames back in capture order, so the stages after this one can't tell the difference.
+class DecodeStage : public StageBase {
+public:
+    using Input = AVPacket*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::DECODE;
+
+    explicit DecodeStage(PipelineContext& context) : context(context.video), framePriority(context.framePriority) {
+        if (this->context.decoders.size() > 1) {
+            // Enough in flight to keep every decoder busy, with one more each queued behind it.
+            pool.emplace(this->context.decoders, this->context.decoders.size() * 2, framePriority);
+        }
+    }
+
+    template <typename Emit>
+    void process(AVPacket* packet, Emit&& emit) {
         ZoneScopedN("decode_job");
         ZoneColor(zoneColors[job++ % (sizeof(zoneColors) / sizeof(*zoneColors))]);
+        ZoneFrameId(packet);
 
-        auto* packet = input.pop();
-        if (!packet) {
-            break;
+        if (!pool) {
+            decodePacket(context.decodeCtx, packet, frames, framePriority);
+            emitFrames(emit);
+            return;
         }
 
-        int ret;
-        {
-            ZoneScopedN("decoder_fill");
+        // Pass on what's ready, and make room in the window by waiting on the oldest packet if there isn't any.
+        pool->collect(frames, false);
+        while (pool->getInFlight() >= pool->getWindow()) {
+            pool->collect(frames, true);
+        }
 
-            if (ret = avcodec_send_packet(context.decodeCtx, packet); ret < 0) {
-                std::cerr << "Failed to send packet to context.\n";
-                exit(1);  // Maybe not an error? #TODO: proper error handling and cleanup.
-            }
+        pool->submit(packet);
+        emitFrames(emit);
+    }
+
+    template <typename Emit>
+    void finish(Emit&& emit) {
+        while (pool && pool->getInFlight() > 0) {
+            pool->collect(frames, true);
         }
 
-        // Cleanup
-        // #TEMP TESTING
-        //av_packet_free(&packet);
+        emitFrames(emit);
+    }
 
-        while (ret >= 0) {
-            auto* frame = av_frame_alloc();
+    // Frames finished between packets are passed on without waiting for the next packet.
+    std::chrono::milliseconds timeout() const {
+        return pool && pool->getInFlight() > 0 ? std::chrono::milliseconds{ 2 } : std::chrono::milliseconds::max();
+    }
 
-            {
-                ZoneScopedN("decoder_drain");
-                ret = avcodec_receive_frame(context.decodeCtx, frame);
+    template <typename Emit>
+    void idle(Emit&& emit) {
+        if (pool) {
+            pool->collect(frames, false);
+            emitFrames(emit);
+        }
+    }
+
+private:
+    template <typename Emit>
+    void emitFrames(Emit&& emit) {
+        for (auto* frame : frames) {
+            emit(frame);
+        }
+
+        frames.clear();
+    }
+
+    const VideoContext& context;
+    MemoryPriority framePriority;
+    std::optional<DecoderPool> pool{};
+    std::vector<AVFrame*> frames{};
+    size_t job = 0;  // Debug variable for tracking pipelining.
+};
+
+// Plans where segments end, on every decoded frame in capture order. Comes straight after decoding, so that every stage and side
+// pipeline sees a cut before any frame past it.
+class SegmentStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::DECODE;
+
+    explicit SegmentStage(PipelineContext& context) : segmenter(context.segmenter) {}
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        segmenter.update(frame->pts);
+
+        // MJPEG frames all come out as intra pictures, which encoders take as a request for a keyframe. Keyframes are placed by the
+        // segment plan and the encoder's GOP instead.
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        emit(frame);
+    }
+
+private:
+    Segmenter& segmenter;
+};
+
+// Watches the decoded luma plane for motion. Once the scene has been still for long enough, only a fraction of the frames continue
+// through the pipeline, which saves the conversion, encoding and storage for a parked car. The first frame with motion goes straight
+// back to full rate.
+class MotionStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::DECODE;
+
+    explicit MotionStage(PipelineContext& context) : config(getConfig()), state(context.parking), detector(config.parkingThreshold) {
+        parkAfterFrames = static_cast<size_t>(config.parkingIdleSeconds) * context.video.frameRate;
+        keepInterval = std::max<size_t>(1, config.parkingInterval.count() * context.video.frameRate / 1000);
+    }
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        if (!config.parkingEnabled) {
+            emit(frame);
+            return;
+        }
+
+        ZoneScopedN("motion_job");
+        ZoneFrameId(frame);
+
+        if (detector.detect(frame->data[0], frame->linesize[0], frame->width, frame->height)) {
+            state.stillFrames = 0;
+
+            if (state.parked) {
+                state.parked = false;
+                setState(DashcamState::RECORDING);
+                logInfo("Motion detected (activity %.2f), leaving parking mode.", detector.getActivity());
             }
 
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                // Finished the job, return to the parent loop.
-                break;
-            } else if (ret < 0) {
-                std::cerr << "Decoding error.\n";
-                exit(1);  // Not recoverable. #TODO: proper error handling and cleanup.
+            emit(frame);
+            return;
+        }
+
+        state.stillFrames++;
+
+        if (!state.parked) {
+            if (state.stillFrames < parkAfterFrames) {
+                emit(frame);
+                return;
             }
 
-            output.push(frame);
+            state.parked = true;
+            setState(DashcamState::PARKED);
+            logInfo("No motion for %d seconds, entering parking mode.", config.parkingIdleSeconds);
+        }
+
+        // Low activity, only keep one frame per interval, if any.
+        if (config.parkingMode == ParkingMode::PAUSE || state.stillFrames % keepInterval != 0) {
+            freeFrame(&frame);
+            return;
+        }
+
+        if (config.parkingMode == ParkingMode::KEYFRAMES) {
+            // Each kept frame can be decoded on its own, nothing in between is worth predicting from.
+            frame->pict_type = AV_PICTURE_TYPE_I;
         }
+
+        emit(frame);
     }
 
-    // Drain the pipeline.
-    output.push(nullptr);
+private:
+    const Config& config;
+    ParkingState& state;
+    MotionDetector detector;
+    size_t parkAfterFrames;
+    size_t keepInterval;
+};
+
+// Built with the first session and shared by every session after.
+const GlyphAtlas& getGlyphAtlas() {
+    static const GlyphAtlas atlas{ getConfig().overlayScale };
+
+    return atlas;
 }
 
-void filterWorker(const VideoContext& context, Channel<AVFrame*>& input, Channel<AVFrame*>& output) {
-    size_t job = 0;  // Debug variable for tracking pipelining.
+// Latest speed in the speed file, NaN while there's none. The file is read once a second on a thread of its own, started by the first
+// call, so that a slow or stuck file never holds up the decode thread.
+double getOverlaySpeed() {
+    static std::atomic<double> speed = std::numeric_limits<double>::quiet_NaN();
+    static std::once_flag started;
 
-    while (true) {
+    std::call_once(started, [] {
+        std::thread{ [] {
+            const auto& config = getConfig();
+
+            while (true) {
+                std::ifstream file{ config.overlaySpeedFile };
+
+                // Left out while there's no file, or nothing readable in it.
+                double value;
+                speed.store(file >> value ? value : std::numeric_limits<double>::quiet_NaN(), std::memory_order_relaxed);
+
+                std::this_thread::sleep_for(std::chrono::seconds{ 1 });
+            }
+        } }.detach();
+    });
+
+    return speed.load(std::memory_order_relaxed);
+}
+
+// Burns the time, and the speed when there's a source for it, into the decoded frame. Runs before the proxy tap, so that the proxy carries
+// it too. The text only changes once a second, it's rendered then and just blended into the frames in between.
+class OverlayStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::DECODE;
+
+    explicit OverlayStage(PipelineContext&) : config(getConfig()), overlay(getGlyphAtlas()) {}
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        if (!config.overlayEnabled) {
+            emit(frame);
+            return;
+        }
+
+        ZoneScopedN("overlay_job");
+        ZoneFrameId(frame);
+
+        const auto* descriptor = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+        if (!descriptor || descriptor->nb_components != 3 || !(descriptor->flags & AV_PIX_FMT_FLAG_PLANAR)
+            || (descriptor->flags & AV_PIX_FMT_FLAG_RGB) || descriptor->comp[0].depth != 8) {
+            logWarning("Can't draw the overlay on %s frames.", descriptor ? descriptor->name : "unknown");
+            emit(frame);
+            return;
+        }
+
+        // The thumbnail tap may still hold a reference to this frame.
+        if (!makeFrameWritable(frame)) {
+            logWarning("Failed to make a frame writable, skipped its overlay.");
+            emit(frame);
+            return;
+        }
+
+        updateText();
+        overlay.setText(text, descriptor->log2_chroma_w, descriptor->log2_chroma_h);
+        overlay.draw(frame->data, frame->linesize, frame->width, frame->height, config.overlayPosition, config.overlayMargin);
+
+        emit(frame);
+    }
+
+private:
+    void updateText() {
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        if (now == lastSecond) {
+            return;
+        }
+
+        lastSecond = now;
+
+        std::tm local{};
+        localtime_r(&now, &local);
+
+        char buffer[128];
+        text.assign(buffer, std::strftime(buffer, sizeof(buffer), config.overlayTimeFormat.c_str(), &local));
+
+        if (!config.overlaySpeedFile.empty()) {
+            if (const auto speed = getOverlaySpeed(); !std::isnan(speed)) {
+                snprintf(buffer, sizeof(buffer), "  %.0f km/h", speed);
+                text += buffer;
+            }
+        }
+    }
+
+    const Config& config;
+    TextOverlay overlay;
+    std::string text{};
+    std::time_t lastSecond = 0;
+};
+
+// Hands a reference to a decoded frame to a side pipeline, if it has room for it. Shares the frame's buffers, nothing is copied. Charged
+// separately since the buffers can outlive the main frame.
+bool tapFrame(const AVFrame* frame, Channel<AVFrame*>& target) {
+    auto* reference = av_frame_clone(frame);
+    if (!reference || !chargeFrame(reference, MemoryPriority::DROPPABLE)) {
+        return false;
+    }
+
+    if (!target.tryPush(reference)) {
+        freeFrame(&reference);
+        return false;
+    }
+
+    return true;
+}
+
+// Hands decoded frames to the proxy pipeline at the proxy frame rate. A slow proxy costs proxy frames rather than holding up the recording.
+class ProxyTapStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::FILTER;
+
+    explicit ProxyTapStage(PipelineContext& context) : enabled(context.proxy.enabled), proxyFrames(*context.proxyFrames) {
+        interval = std::chrono::microseconds{ 1000000 / getConfig().proxyFrameRate };
+        nextFrame = std::chrono::steady_clock::now();
+    }
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        const auto now = std::chrono::steady_clock::now();
+
+        if (enabled && now >= nextFrame) {
+            ZoneScopedN("proxy_tap");
+
+            if (tapFrame(frame, proxyFrames)) {
+                nextFrame = std::max(nextFrame + interval, now);
+            }
+        }
+
+        emit(frame);
+    }
+
+    template <typename Emit>
+    void finish(Emit&&) {
+        // Drain the proxy pipeline along with this one.
+        if (enabled) {
+            proxyFrames.push(nullptr);
+        }
+    }
+
+private:
+    bool enabled;
+    Channel<AVFrame*>& proxyFrames;
+    std::chrono::microseconds interval;
+    std::chrono::steady_clock::time_point nextFrame;
+};
+
+// Hands a decoded frame to the thumbnail pipeline every thumbnail interval. Taken before motion detection, so that parked periods still
+// show up on the timeline.
+class ThumbnailTapStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::DECODE;
+
+    explicit ThumbnailTapStage(PipelineContext& context) : enabled(getConfig().thumbnailEnabled), thumbnailFrames(*context.thumbnailFrames) {
+        interval = getConfig().thumbnailInterval;
+        nextFrame = std::chrono::steady_clock::now();
+    }
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        const auto now = std::chrono::steady_clock::now();
+
+        // Under load the thumbnail pipeline is still busy with the last one, try again on the next frame.
+        if (enabled && now >= nextFrame) {
+            ZoneScopedN("thumbnail_tap");
+
+            if (tapFrame(frame, thumbnailFrames)) {
+                nextFrame = std::max(nextFrame + interval, now);
+            }
+        }
+
+        emit(frame);
+    }
+
+    template <typename Emit>
+    void finish(Emit&&) {
+        if (enabled) {
+            thumbnailFrames.push(nullptr);
+        }
+    }
+
+private:
+    bool enabled;
+    Channel<AVFrame*>& thumbnailFrames;
+    std::chrono::milliseconds interval;
+    std::chrono::steady_clock::time_point nextFrame;
+};
+
+#if !DEFERRED_FILTERING
+class FilterStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::FILTER;
+
+    explicit FilterStage(PipelineContext& context) : context(context.video), reset(context.reset), framePriority(context.framePriority) {}
+
+    template <typename Emit>
+    void process(AVFrame* preFilter, Emit&& emit) {
         ZoneScopedN("filter_job");
         ZoneColor(zoneColors[job++ % (sizeof(zoneColors) / sizeof(*zoneColors))]);
+        ZoneFrameId(preFilter);
 
-        auto* preFilter = input.pop();
-        if (!preFilter) {
-            break;
+        // Left without a graph by a failed rebuild, until the new session builds one.
+        if (!context.filterGraph) {
+            freeFrame(&preFilter);
+            return;
         }
 
-#if DEFERRED_FILTERING
-        // Do no work, just pass the frame through.
-        output.push(preFilter);
-#else
         int ret;
         {
             ZoneScopedN("filter_graph_fill");
 
             if (ret = av_buffersrc_add_frame_flags(context.filterSourceCtx, preFilter, AV_BUFFERSRC_FLAG_KEEP_REF); ret < 0) {
-                std::cerr << "Failed to feed frame into filter graph.\n";
-                exit(1);  // #TODO: proper error handling and cleanup.
+                logWarning("Failed to feed frame into filter graph.");
+                resetGraph();
             }
         }
 
-        // Cleanup
-        av_frame_unref(preFilter);
-
         // Retrieve the frame from the filter graph output and push it through the encoder.
         while (ret >= 0) {
             auto* postFilter = av_frame_alloc();
@@ -170,31 +605,98 @@ void filterWorker(const VideoContext& context, Channel<AVFrame*>& input, Channel
             }
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                 // Finished the job, return to the parent loop.
+                av_frame_free(&postFilter);
                 break;
             } else if (ret < 0) {
-                std::cerr << "Buffer sink error.\n";
-                exit(1);  // Not recoverable. #TODO: proper error handling and cleanup.
+                logWarning("Buffer sink error.");
+                av_frame_free(&postFilter);
+                resetGraph();
+                break;
             }
 
-            output.push(postFilter);
+            if (!chargeFrame(postFilter, framePriority)) {
+                logWarning("Over memory budget, dropped a filtered frame.");
+                continue;
+            }
+
+            emit(postFilter);
         }
-#endif
+
+        // Cleanup. Released after draining since the graph holds onto the source frame until the conversion is done.
+        freeFrame(&preFilter);
     }
 
-    // Drain the pipeline.
-    output.push(nullptr);
-}
+private:
+    // Rebuilds the graph from scratch, losing the frame in flight. If that fails, the main thread gets to try with a new session.
+    void resetGraph() {
+        ZoneScoped;
+
+        std::scoped_lock scopeLock{ context.resetLock };
+
+        avfilter_graph_free(&context.filterGraph);
+        if (!setupFilterGraph(&context.filterGraph, &context.filterSourceCtx, &context.filterSinkCtx, context.decodeCtx, context.encodeCtx)) {
+            logError("Failed to rebuild the filter graph, starting a new session.");
+            recordRecovery(RecoveryAction::RESTART_SESSION);
+            reset.tryPush(true);
+            return;
+        }
 
-void encodeWorker(const VideoContext& context, Channel<AVFrame*>& input, Channel<AVPacket*>& output) {
+        recordRecovery(RecoveryAction::RESET_FILTER);
+    }
+
+    VideoContext& context;
+    Channel<bool>& reset;
+    MemoryPriority framePriority;
     size_t job = 0;  // Debug variable for tracking pipelining.
+};
+#endif
 
-    while (true) {
+class EncodeStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVPacket*;
+    static constexpr Stage schedule = Stage::ENCODE;
+
+    // The session's encoder was just built with the current settings.
+    explicit EncodeStage(PipelineContext& context) : context(context.video), reset(context.reset), segment(context.segmenter),
+        builtBitRate(getEncoderBitRate()), builtCaptureBuffers(getEncoderCaptureBuffers()) {}
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
         ZoneScopedN("encode_job");
         ZoneColor(zoneColors[job++ % (sizeof(zoneColors) / sizeof(*zoneColors))]);
+        ZoneFrameId(frame);
 
-        auto* frame = input.pop();
-        if (!frame) {
-            break;
+        // Left without an encoder by a failed rebuild, until the new session builds one.
+        if (!context.encodeCtx) {
+            freeFrame(&frame);
+            return;
+        }
+
+        // Each segment starts on a keyframe. The hardware encoder only picks up a new bitrate or capture buffer count when it's built, so
+        // it's rebuilt for the new segment if either changed. The frames still inside it are drained into the segment being closed first.
+        if (segment.check(frame->pts, true)) {
+            if (builtBitRate != getEncoderBitRate() || builtCaptureBuffers != getEncoderCaptureBuffers()) {
+                if (drainEncoder(emit)) {
+                    rebuildEncoder();
+                }
+            }
+
+            frame->pict_type = AV_PICTURE_TYPE_I;
+        }
+
+        // Or by a rebuild for the new segment.
+        if (!context.encodeCtx) {
+            freeFrame(&frame);
+            return;
+        }
+
+        frameIds.add(frame);
+
+        // Encoders that reconfigure on the fly pick this up with the frame, the hardware encoder only reads it when it's rebuilt for the
+        // next segment.
+        if (const auto bitRate = getEncoderBitRate(); bitRate != context.encodeCtx->bit_rate) {
+            context.encodeCtx->bit_rate = bitRate;
         }
 
         int ret;
@@ -204,109 +706,729 @@ void encodeWorker(const VideoContext& context, Channel<AVFrame*>& input, Channel
         }
         if (ret == AVERROR(EAGAIN)) {
             // Encoder is not ready to accept new frames, this is not an ideal situation. Consider reducing the pipelining.
-            // We need to try and process this frame again
+            logWarning("Encoder full, draining it before retrying the frame.");
+        }
+
+        // Taking out the packets it has finished makes room. A hardware encoder with nothing finished yet gets a moment to catch up.
+        while (ret == AVERROR(EAGAIN)) {
+            const auto received = receivePackets(emit);
+            if (received < 0) {
+                // The encoder was rebuilt, the frame goes with the ones lost inside it.
+                freeFrame(&frame);
+                return;
+            }
 
-            while (avcodec_send_frame(context.encodeCtx, frame) == AVERROR(EAGAIN)) {
-                std::cerr << "Retried encoder fill, this could be dangerous.\n";
+            if (received == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds{ 500 });
             }
-        } else if ( ret < 0) {
+
+            ZoneScopedN("encoder_fill");
+            ret = avcodec_send_frame(context.encodeCtx, frame);
+        }
+
+        if (ret < 0) {
             char buffer[256];
-            std::cerr << "Failed to encode frame: error: " << av_make_error_string(buffer, sizeof(buffer), ret) << "\n";
-            continue;  // Recoverable, will just skip this frame. #TODO: look at this again
+            logWarning("Failed to encode frame: error: %s", av_make_error_string(buffer, sizeof(buffer), ret));
+            freeFrame(&frame);
+
+            // The frame is skipped either way, the encoder is only rebuilt if it's the encoder that's broken.
+            if (classifyError(ret) == ErrorClass::CODEC) {
+                resetEncoder();
+            } else {
+                recordRecovery(RecoveryAction::SKIP_FRAME);
+            }
+
+            return;
         }
 
         // Cleanup
-        av_frame_unref(frame);
+        freeFrame(&frame);
 
-        while (ret >= 0) {
+        receivePackets(emit);
+    }
+
+private:
+    // Ends the stream and emits everything still inside the encoder, which then has to be rebuilt. Returns false if it failed while
+    // draining and was rebuilt already.
+    template <typename Emit>
+    bool drainEncoder(Emit&& emit) {
+        ZoneScoped;
+
+        if (avcodec_send_frame(context.encodeCtx, nullptr) < 0) {
+            return true;
+        }
+
+        // No more input is coming, so this runs until the end of the stream rather than stopping for more.
+        return receivePackets(emit) >= 0;
+    }
+
+    // Emits every packet the encoder has ready. Returns how many, or -1 if it failed and was rebuilt.
+    template <typename Emit>
+    int receivePackets(Emit&& emit) {
+        int received = 0;
+
+        while (true) {
             auto* packet = av_packet_alloc();
 
+            int ret;
             {
                 ZoneScopedN("encoder_drain");
                 ret = avcodec_receive_packet(context.encodeCtx, packet);
             }
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                 // Finished the job, return to the parent loop.
-                break;
+                av_packet_free(&packet);
+                return received;
             } else if (ret < 0) {
-                std::cerr << "Encoding error.\n";
-                exit(1);  // Potentially recoverable? #TODO: proper error handling and cleanup.
+                logWarning("Encoding error.");
+                av_packet_free(&packet);
+                resetEncoder();
+                return -1;
             }
 
-            output.push(packet);
+            // Dropping encoded packets would corrupt the stream until the next keyframe, so these are never refused.
+            chargePacket(packet, MemoryPriority::CRITICAL);
+            frameIds.apply(packet);
+
+            emit(packet);
+            ++received;
         }
     }
 
-    // Drain the pipeline.
-    output.push(nullptr);
-}
+    // Rebuilt rather than flushed, since flushing the hardware encoder doesn't work. The new encoder starts on a keyframe, so the stream
+    // picks up cleanly from the next frame.
+    void resetEncoder() {
+        if (rebuildEncoder()) {
+            recordRecovery(RecoveryAction::RESET_ENCODER);
+        }
+    }
 
-void outputWorker(const VideoContext& context, Channel<AVPacket*>& input, Channel<Storage>& reset) {
-    size_t job = 0;  // Debug variable for tracking pipelining.
+    // Returns false if the encoder couldn't be built, which leaves the main thread to try again with a new session.
+    bool rebuildEncoder() {
+        ZoneScoped;
 
-    Storage storage;
-    size_t spaceRemaining = 0;
-    bool firstJob = false;
-    bool draining = false;
+        std::scoped_lock scopeLock{ context.resetLock };
+
+        builtBitRate = getEncoderBitRate();
+        builtCaptureBuffers = getEncoderCaptureBuffers();
 
-    // Try and retrieve old storage from a reset. If there's nothing here, then this must be the first job.
-    auto lastStorage = reset.tryPop();
-    if (lastStorage) {
-        storage = *lastStorage;
-        spaceRemaining = storage.space;  // We know that the old storage was not used yet, so the full space is usable.
-    } else {
-        firstJob = true;
+        freeEncoder(&context.encodeCtx);
+        frameIds = {};
+
+        if (!setupEncoder(&context.encodeCtx, context.frameRate)) {
+            logError("Failed to rebuild the encoder, starting a new session.");
+            recordRecovery(RecoveryAction::RESTART_SESSION);
+            reset.tryPush(true);
+            return false;
+        }
+
+        return true;
     }
 
-    while (true) {
+    VideoContext& context;
+    Channel<bool>& reset;
+    SegmentFollower segment;
+    int64_t builtBitRate;
+    int builtCaptureBuffers;
+    size_t job = 0;  // Debug variable for tracking pipelining.
+    EncoderFrameIds frameIds{};
+};
+
+class OutputStage : public StageBase {
+public:
+    using Input = AVPacket*;
+    using Output = void;
+    static constexpr Stage schedule = Stage::OUTPUT;
+
+    // Packets are only a few KB, batch them up into large sequential writes. The first segment is opened by the session's first packet.
+    explicit OutputStage(PipelineContext& context) : reset(context.reset), running(context.running), config(getConfig()),
+        segmenter(context.segmenter), segment(context.segmenter), writer(config.outputBlockSize, config.outputFlushDeadline) {}
+
+    template <typename Emit>
+    void process(AVPacket* packet, Emit&&) {
         ZoneScopedN("output_job");
         ZoneColor(zoneColors[job++ % (sizeof(zoneColors) / sizeof(*zoneColors))]);
-
-        auto* packet = input.pop();
-        if (!packet) {
-            break;
-        }
+        ZoneFrameId(packet);
 
         // When draining the pipeline, just free the memory and continue. Consider saving these packets in the future?
         if (draining) {
-            av_packet_free(&packet);
-            continue;
+            freePacket(&packet);
+            return;
         }
 
-        // Check if the current storage medium has enough space for this packet.
-        if (packet->size > spaceRemaining) {
-            if (storage = getStorage(storage); !storage.file) {
-                exit(1);  // #TODO: proper error handling and cleanup.
+        // Everything pending belongs to the old segment, which is closed before the keyframe goes to the new one.
+        if (auto cut = segment.check(packet->pts, packet->flags & AV_PKT_FLAG_KEY)) {
+            if (storage.file) {
+                closeSegment(!writer.flush());
             }
 
-            spaceRemaining = storage.space;
+            openSegment(cut->stem);
+        }
 
-            // If this is the first output packet, then we don't have to reset state.
-            if (firstJob) {
-                firstJob = false;
-            } else {
-                // The storage medium is changing, so notify the main thread we need to reboot.
-                reset.push(storage);
-                draining = true;
-                av_packet_free(&packet);
+        // Only a keyframe can start a segment, anything before the first one has nowhere to go.
+        if (!storage.file) {
+            freePacket(&packet);
+            return;
+        }
 
-                continue;
-            }
+        // The size bound asks for a cut well before the segment is full. Running out means the cut never came, start over with a new session.
+        if (packet->size > spaceRemaining) {
+            rollover(!writer.flush());
+            freePacket(&packet);
+
+            return;
         }
 
         // Sanity check to ensure the packet can now fit on the storage.
         assert(spaceRemaining >= packet->size);
 
-        {
-            ZoneScopedN("write_to_disk");
-            fwrite(packet->data, 1, packet->size, storage.file);
+        // Make everything before the keyframe durable, so a power loss never costs more than the GOP in progress.
+        if (config.outputFlushOnKeyframe && (packet->flags & AV_PKT_FLAG_KEY)) {
+            if (!writer.flush()) {
+                rollover(true);
+                freePacket(&packet);
+                return;
+            }
+        }
+
+        bitrate.add(packet->size);
+        recordOutput(packet->size);
+
+        if (!writer.write(packet->data, packet->size)) {
+            rollover(true);
+            freePacket(&packet);
+            return;
         }
 
+        observeOutput(packet);
+
+        // Computed on the way out while the packet is hot in cache, so the uploader never has to read the segment back to verify it.
+        checksum = crc32(checksum, packet->data, packet->size);
         spaceRemaining -= packet->size;
 
+        if (!cutRequested && storage.space - spaceRemaining >= config.segmentMaxSize) {
+            segmenter.requestCut(getSegmentStem(storage.path));
+            cutRequested = true;
+        }
+
         // Cleanup
-        av_packet_free(&packet);
+        freePacket(&packet);
+    }
+
+    template <typename Emit>
+    void finish(Emit&&) {
+        if (!draining && storage.file) {
+            closeSegment(!writer.flush());
+        }
+
+        writer.report();
+    }
+
+    // Wake up in time to flush pending data before its deadline, even if no packets arrive.
+    std::chrono::milliseconds timeout() const {
+        return draining ? std::chrono::milliseconds::max() : writer.timeUntilDue();
+    }
+
+    template <typename Emit>
+    void idle(Emit&&) {
+        if (storage.file && !writer.flush()) {
+            rollover(true);
+        }
+    }
+
+private:
+    // Opens the next segment. The card may be briefly busy culling or failing, so this is retried before giving up on the session.
+    void openSegment(const std::string& stem) {
+        ZoneScoped;
+
+        Backoff backoff{ std::chrono::milliseconds{ 100 }, std::chrono::milliseconds{ 5000 } };
+        for (int attempt = 1; storage = getStorage(storage, stem), !storage.file; ++attempt) {
+            if (attempt == maxStorageAttempts) {
+                logError("Failed to acquire storage, starting a new session.");
+                recordRecovery(RecoveryAction::RESTART_SESSION);
+                reset.tryPush(true);
+                draining = true;
+                return;
+            }
+
+            // The session is ending anyway.
+            if (!backoff.wait(running)) {
+                return;
+            }
+        }
+
+        spaceRemaining = storage.space;
+        checksum = crc32(0L, Z_NULL, 0);
+        cutRequested = false;
+
+        writer.open(fileno(storage.file));
+    }
+
+    // Hands the segment over to the uploader. What reached the disk of a failed segment doesn't match the checksum, the uploader computes
+    // it from the file instead.
+    void closeSegment(bool failed) {
+        getManifest().update({
+            .name = std::filesystem::path{ storage.path }.filename().string(),
+            .state = SegmentState::RECORDED,
+            .size = storage.space - spaceRemaining,
+            .checksum = failed ? std::optional<uint32_t>{} : checksum
+        });
+
+        fclose(storage.file);
+        storage.file = nullptr;
+    }
+
+    // Closes out the segment and has the main thread start a new session, which starts a new segment. Used to get away from a segment
+    // that can't be written anymore, which costs a session restart instead of the process.
+    void rollover(bool failed) {
+        ZoneScoped;
+
+        closeSegment(failed);
+
+        if (failed) {
+            recordRecovery(RecoveryAction::NEW_SEGMENT);
+        }
+
+        reset.tryPush(true);
+        draining = true;
+    }
+
+    static constexpr int maxStorageAttempts = 5;
+
+    Channel<bool>& reset;
+    std::atomic<bool>& running;
+    const Config& config;
+    Segmenter& segmenter;
+    SegmentFollower segment;
+    BlockWriter writer;
+    Storage storage{};
+    size_t spaceRemaining = 0;
+    uint32_t checksum = crc32(0L, Z_NULL, 0);
+    bool cutRequested = false;
+    bool draining = false;
+    size_t job = 0;  // Debug variable for tracking pipelining.
+    RatePlot bitrate{ "Encoder bitrate (kbps)" };
+};
+
+// Pulls frames handed over by a tap stage, until the tap drains.
+template <Channel<AVFrame*>* PipelineContext::*Frames, Stage Schedule>
+class TapSourceStage : public StageBase {
+public:
+    using Input = void;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Schedule;
+
+    explicit TapSourceStage(PipelineContext& context) : frames(*(context.*Frames)) {}
+
+    template <typename Emit>
+    bool produce(Emit&& emit) {
+        auto* frame = frames.pop();
+        if (!frame) {
+            return false;
+        }
+
+        emit(frame);
+
+        return true;
+    }
+
+private:
+    Channel<AVFrame*>& frames;
+};
+
+using ProxySourceStage = TapSourceStage<&PipelineContext::proxyFrames, Stage::PROXY>;
+
+class ProxyFilterStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVFrame*;
+    static constexpr Stage schedule = Stage::PROXY;
+
+    explicit ProxyFilterStage(PipelineContext& context) : context(context.proxy) {}
+
+    template <typename Emit>
+    void process(AVFrame* preFilter, Emit&& emit) {
+        ZoneScopedN("proxy_filter_job");
+        ZoneFrameId(preFilter);
+
+        int ret;
+        if (ret = av_buffersrc_add_frame_flags(context.filterSourceCtx, preFilter, AV_BUFFERSRC_FLAG_KEEP_REF); ret < 0) {
+            logError("Failed to feed frame into proxy filter graph.");
+        }
+
+        while (ret >= 0) {
+            auto* postFilter = av_frame_alloc();
+
+            ret = av_buffersink_get_frame(context.filterSinkCtx, postFilter);
+            if (ret < 0) {
+                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+                    logError("Proxy buffer sink error.");
+                }
+
+                av_frame_free(&postFilter);
+                break;
+            }
+
+            if (chargeFrame(postFilter, MemoryPriority::DROPPABLE)) {
+                emit(postFilter);
+            }
+        }
+
+        freeFrame(&preFilter);
+    }
+
+private:
+    const ProxyContext& context;
+};
+
+class ProxyEncodeStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = AVPacket*;
+    static constexpr Stage schedule = Stage::PROXY;
+
+    explicit ProxyEncodeStage(PipelineContext& context) : context(context.proxy), segment(context.segmenter) {}
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&& emit) {
+        ZoneScopedN("proxy_encode_job");
+        ZoneFrameId(frame);
+
+        // Proxy segments start on a keyframe too, on the first proxy frame of the segment.
+        if (segment.check(frame->pts, true)) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+        }
+
+        // Proxy frames are decimated, so number them in the proxy's own time base. The capture pts is put back on the packet, which is
+        // what the proxy output follows the segment plan by.
+        capturePts[frameIndex % capturePtsCapacity] = frame->pts;
+        frame->pts = frameIndex++;
+        frameIds.add(frame);
+
+        if (auto ret = avcodec_send_frame(context.encodeCtx, frame); ret < 0) {
+            logError("Failed to encode proxy frame.");
+        }
+
+        freeFrame(&frame);
+
+        drain(emit);
+    }
+
+    template <typename Emit>
+    void finish(Emit&& emit) {
+        // Unlike the main encoder, the proxy is flushed properly so that the tail of every proxy segment is kept.
+        avcodec_send_frame(context.encodeCtx, nullptr);
+        drain(emit);
+    }
+
+private:
+    template <typename Emit>
+    void drain(Emit&& emit) {
+        while (true) {
+            auto* packet = av_packet_alloc();
+
+            if (avcodec_receive_packet(context.encodeCtx, packet) < 0) {
+                av_packet_free(&packet);
+                break;
+            }
+
+            chargePacket(packet, MemoryPriority::CRITICAL);
+            frameIds.apply(packet);
+
+            // The proxy has no B-frames, so a packet is never older than the frames the encoder holds on to.
+            if (packet->pts >= 0 && packet->pts < frameIndex) {
+                packet->pts = capturePts[packet->pts % capturePtsCapacity];
+            }
+
+            emit(packet);
+        }
+    }
+
+    static constexpr int64_t capturePtsCapacity = 64;  // More than any encoder holds on to.
+
+    const ProxyContext& context;
+    SegmentFollower segment;
+    int64_t frameIndex = 0;
+    int64_t capturePts[capturePtsCapacity]{};
+    EncoderFrameIds frameIds{};
+};
+
+class ProxyOutputStage : public StageBase {
+public:
+    using Input = AVPacket*;
+    using Output = void;
+    static constexpr Stage schedule = Stage::PROXY;
+
+    // Proxy segments are small, so a smaller block keeps the flush deadline meaningful.
+    explicit ProxyOutputStage(PipelineContext& context) : segment(context.segmenter), writer(proxyBlockSize, getConfig().outputFlushDeadline) {}
+
+    ~ProxyOutputStage() {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    template <typename Emit>
+    void process(AVPacket* packet, Emit&&) {
+        ZoneScopedN("proxy_output_job");
+        ZoneFrameId(packet);
+
+        if (auto cut = segment.check(packet->pts, packet->flags & AV_PKT_FLAG_KEY)) {
+            close();
+            open(cut->stem);
+        }
+
+        if (file) {
+            if (writer.write(packet->data, packet->size)) {
+                checksum = crc32(checksum, packet->data, packet->size);
+                size += packet->size;
+            } else {
+                logError("Failed to write proxy packet.");
+            }
+        }
+
+        freePacket(&packet);
+    }
+
+    template <typename Emit>
+    void finish(Emit&&) {
+        close();
+    }
+
+    std::chrono::milliseconds timeout() const {
+        return writer.timeUntilDue();
+    }
+
+    template <typename Emit>
+    void idle(Emit&&) {
+        writer.flush();
     }
+
+private:
+    static constexpr size_t proxyBlockSize = 256ULL * 1024ULL;
+
+    // Named after the segment it belongs to. Recording carries on without the proxy if it can't be created.
+    void open(const std::string& stem) {
+        const auto path = std::filesystem::path{ storageLocation } / (stem + proxySuffix);
+
+        // Entered before the file exists, so that the uploader never adopts it half written.
+        name = path.filename().string();
+        getManifest().update({ .name = name, .state = SegmentState::RECORDING });
+
+        file = fopen(path.c_str(), "w+");
+        if (!file) {
+            logError("Failed to create proxy file '%s'.", path.c_str());
+            getManifest().remove(name);
+            return;
+        }
+
+        writer.open(fileno(file));
+        size = 0;
+        checksum = crc32(0L, Z_NULL, 0);
+    }
+
+    void close() {
+        if (!file) {
+            return;
+        }
+
+        if (writer.flush()) {
+            getManifest().update({ .name = name, .state = SegmentState::RECORDED, .size = size, .checksum = checksum });
+        }
+
+        fclose(file);
+        file = nullptr;
+    }
+
+    SegmentFollower segment;
+    FILE* file = nullptr;
+    std::string name{};
+    BlockWriter writer;
+    uint64_t size = 0;
+    uint32_t checksum = crc32(0L, Z_NULL, 0);
+};
+
+// The proxy is cheap and low priority, so the whole thing runs on a single thread.
+using ProxyLayout = Pipeline<Fused<ProxySourceStage, ProxyFilterStage, ProxyEncodeStage, ProxyOutputStage>>;
+
+using ThumbnailSourceStage = TapSourceStage<&PipelineContext::thumbnailFrames, Stage::THUMBNAIL>;
+
+class ThumbnailStage : public StageBase {
+public:
+    using Input = AVFrame*;
+    using Output = void;
+    static constexpr Stage schedule = Stage::THUMBNAIL;
+
+    explicit ThumbnailStage(PipelineContext& context) : config(getConfig()), segmenter(context.segmenter), segment(context.segmenter) {}
+
+    template <typename Emit>
+    void process(AVFrame* frame, Emit&&) {
+        ZoneScopedN("thumbnail_job");
+        ZoneFrameId(frame);
+
+        // Each segment has its own sheets and index, with offsets from the segment's first frame.
+        if (auto cut = segment.check(frame->pts, true)) {
+            if (sheet) {
+                sheet->finish();
+            }
+
+            sheet.emplace(getThumbnailPrefix(cut->stem), config.thumbnailWidth, config.thumbnailHeight, config.thumbnailColumns,
+                config.thumbnailRows, config.thumbnailQuality);
+            start = cut->pts;
+        }
+
+        if (sheet) {
+            sheet->add(frame, segmenter.toMilliseconds(frame->pts - start));
+        }
+
+        freeFrame(&frame);
+    }
+
+    template <typename Emit>
+    void finish(Emit&&) {
+        if (sheet) {
+            sheet->finish();
+        }
+    }
+
+private:
+    static std::string getThumbnailPrefix(const std::string& stem) {
+        return (std::filesystem::path{ storageLocation } / (stem + thumbnailSuffix)).string();
+    }
+
+    const Config& config;
+    Segmenter& segmenter;
+    SegmentFollower segment;
+    std::optional<ThumbnailSheet> sheet{};
+    int64_t start = 0;  // Capture pts of the segment's first frame.
+};
+
+using ThumbnailLayout = Pipeline<Fused<ThumbnailSourceStage, ThumbnailStage>>;
+
+// Thread layouts for the recording pipeline, selected at startup. Capture always runs alone so that its cadence isn't disturbed. Motion
+// detection, the overlay and the thumbnail tap are cheap and work on the decoded frame, so they're always fused with decoding.
+#if DEFERRED_FILTERING
+// Filtering happens during conversion, so there's no filter stage at all.
+using ThreadedLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage, ProxyTapStage>, Fused<EncodeStage>, Fused<OutputStage>>;
+using FusedLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage, ProxyTapStage>, Fused<EncodeStage, OutputStage>>;
+using CompactLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage, ProxyTapStage, EncodeStage, OutputStage>>;
+#else
+// The filter stage fans out to the proxy before converting the frame for the main encoder.
+using ThreadedLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage>, Fused<ProxyTapStage, FilterStage>, Fused<EncodeStage>, Fused<OutputStage>>;
+using FusedLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage, ProxyTapStage, FilterStage>, Fused<EncodeStage, OutputStage>>;
+using CompactLayout = Pipeline<Fused<InputStage>, Fused<DecodeStage, SegmentStage, ThumbnailTapStage, MotionStage, OverlayStage, ProxyTapStage, FilterStage, EncodeStage, OutputStage>>;
+#endif
+
+// Records until a stage requests a reset, then drains the pipeline.
+template <typename Layout>
+void record(PipelineContext& context, DepthTuner& tuner) {
+    ZoneScoped;
+
+    // A reset asked for while the last session was already ending belongs to that session.
+    while (context.reset.tryPop()) {}
+
+    // The side pipelines never hold up the main one, so they keep the configured depth.
+    const size_t depth = getConfig().pipelineDepth;
+
+    // Started first so that it's ready for the tap. Drained by the tap when the main pipeline drains.
+    Channel<AVFrame*> proxyFrames{ depth, "proxy tap" };
+    context.proxyFrames = &proxyFrames;
+
+    std::optional<ProxyLayout> proxy;
+    if (context.proxy.enabled) {
+        proxy.emplace(context, depth);
+    }
+
+    // A single slot, so that thumbnails are skipped rather than queued when the thumbnail thread isn't keeping up.
+    Channel<AVFrame*> thumbnailFrames{ 1, "thumbnail tap" };
+    context.thumbnailFrames = &thumbnailFrames;
+
+    std::optional<ThumbnailLayout> thumbnails;
+    if (getConfig().thumbnailEnabled) {
+        thumbnails.emplace(context, depth);
+    }
+
+    // Frames only wait for memory if a group on another thread can release some in the meantime. When everything past the decoder is
+    // fused onto its thread, the wait could never end, so over budget frames are dropped right away instead.
+    context.framePriority = Layout::channelCount > 1 ? MemoryPriority::BLOCKING : MemoryPriority::DROPPABLE;
+
+    Layout pipeline{ context, tuner.getDepths(Layout::channelCount) };
+
+    // Wait for the output worker to request a reset, tuning the pipeline in the meantime. Capture buffers are picked up by the encoder
+    // of the next segment, which is rebuilt for them, so they're only passed on once the tuner has settled on a count.
+    constexpr std::chrono::seconds tuningInterval{ 1 };
+
+    while (!context.reset.popFor(tuningInterval)) {
+        if (!getConfig().pipelineAutoDepth) {
+            continue;
+        }
+
+        const auto samples = pipeline.sample();
+        const auto& depths = tuner.update(samples);
+
+        for (size_t i = 0; i < samples.size(); ++i) {
+            if (depths[i] != samples[i].depth) {
+                pipeline.setDepth(i, depths[i]);
+            }
+        }
+
+        if (const auto buffers = tuner.getSettledCaptureBuffers(); buffers && *buffers != getEncoderCaptureBuffers()) {
+            setEncoderCaptureBuffers(*buffers);
+        }
+    }
+
+    // Notify the input worker to start draining the pipeline. Only a failed segment gets here, and what's in flight is lost along with it,
+    // which adds a short time jump in the media.
+    context.running.store(false);
+
+    pipeline.join();
+
+    if (proxy) {
+        proxy->join();
+    }
+
+    if (thumbnails) {
+        thumbnails->join();
+    }
+}
+
+// Builds the codecs for the next session. Returns false if the main stream can't be recorded.
+bool prepareSession(VideoContext& video, ProxyContext& proxy) {
+    ZoneScoped;
+
+    // Draining and flushing doesn't seem to work, just build a new encoder.
+    //avcodec_send_frame(encContext, nullptr);
+    //avcodec_flush_buffers(encContext);
+
+    // Already gone if the encode stage failed to rebuild it.
+    if (video.encodeCtx) {
+        avcodec_send_frame(video.encodeCtx, nullptr);  // Flush the encoder.
+        freeEncoder(&video.encodeCtx);
+    }
+
+    if (!setupEncoder(&video.encodeCtx, video.frameRate)) {
+        logError("Failed to re-setup encoder.");
+        return false;
+    }
+
+    // Likewise, if the filter stage failed to rebuild it.
+    if (!video.filterGraph
+        && !setupFilterGraph(&video.filterGraph, &video.filterSourceCtx, &video.filterSinkCtx, video.decodeCtx, video.encodeCtx)) {
+        logError("Failed to re-setup filter graph.");
+        return false;
+    }
+
+    // Each session starts with a fresh proxy encoder too, so that its first segment begins on a keyframe.
+    if (proxy.enabled) {
+        freeEncoder(&proxy.encodeCtx);
+
+        if (!setupProxyEncoder(&proxy.encodeCtx)) {
+            logError("Failed to re-setup proxy encoder, recording without it.");
+            proxy.enabled = false;
+        }
+    }
+
+    return true;
 }
 
 int run(AVFormatContext* inputContext, int frameRate) {
@@ -314,24 +1436,60 @@ int run(AVFormatContext* inputContext, int frameRate) {
 
     setState(DashcamState::RECORDING);
 
+    // Sizes the bitrate before the first encoder is built, then keeps adjusting it.
+    startRetentionControl(frameRate);
+
     AVCodecContext* decContext;
     AVCodecContext* encContext;
     AVFilterGraph* filterGraph;
     AVFilterContext* bufferSourceContext;
     AVFilterContext* bufferSinkContext;
 
-    if (!setupDecoder(&decContext, inputContext)) {
-        std::cerr << "Failed to setup decoder.\n";
+    // Independent decoders for MJPEG's independent frames. With several, each is single threaded, the parallelism comes from running
+    // them side by side.
+    const auto& config = getConfig();
+    const auto& decodeCpus = config.schedules[static_cast<size_t>(Stage::DECODE)].cpus;
+    size_t decoderCount = config.decoderContexts > 0 ? config.decoderContexts
+        : (decodeCpus.empty() ? std::max(1U, std::thread::hardware_concurrency()) : decodeCpus.size());
+
+    // Other codecs may predict from earlier frames, they get a single decoder with its own threads. Known before it's opened, from the
+    // video stream setupDecoder() picks.
+    for (unsigned int i = 0; i < inputContext->nb_streams; ++i) {
+        if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (inputContext->streams[i]->codecpar->codec_id != AV_CODEC_ID_MJPEG) {
+                decoderCount = 1;
+            }
+
+            break;
+        }
+    }
+
+    if (!setupDecoder(&decContext, inputContext, decoderCount > 1 ? 1 : config.decoderThreads)) {
+        logError("Failed to setup decoder.");
         return 1;
     }
 
+    std::vector<AVCodecContext*> decoders{ decContext };
+
+    while (decoders.size() < decoderCount) {
+        AVCodecContext* decoder;
+        if (!setupDecoder(&decoder, inputContext, 1)) {
+            logWarning("Failed to setup another decoder, decoding with %zu.", decoders.size());
+            break;
+        }
+
+        decoders.push_back(decoder);
+    }
+
+    logInfo("Decoding with %zu decoder%s.", decoders.size(), decoders.size() > 1 ? "s" : "");
+
     if (!setupEncoder(&encContext, frameRate)) {
-        std::cerr << "Failed to setup encoder.\n";
+        logError("Failed to setup encoder.");
         return 1;
     }
 
     if (!setupFilterGraph(&filterGraph, &bufferSourceContext, &bufferSinkContext, decContext, encContext)) {
-        std::cerr << "Failed to setup filter graph.\n";
+        logError("Failed to setup filter graph.");
         return 1;
     }
 
@@ -339,60 +1497,100 @@ int run(AVFormatContext* inputContext, int frameRate) {
         .frameRate = frameRate,
         .inputCtx = inputContext,
         .decodeCtx = decContext,
+        .decoders = decoders,
+        .filterGraph = filterGraph,
         .filterSourceCtx = bufferSourceContext,
         .filterSinkCtx = bufferSinkContext,
         .encodeCtx = encContext
     };
 
-    while (true) {
-        std::atomic<bool> flag = true;
-        std::list<std::thread> workers;
+    // The proxy is optional, recording carries on without it if it can't be set up.
+    ProxyContext proxyContext{ .enabled = getConfig().proxyEnabled };
+    if (proxyContext.enabled) {
+        if (!setupProxyEncoder(&proxyContext.encodeCtx)
+            || !setupProxyFilterGraph(&proxyContext.filterGraph, &proxyContext.filterSourceCtx, &proxyContext.filterSinkCtx, decContext,
+                proxyContext.encodeCtx)) {
+            logError("Failed to setup proxy stream, recording without it.");
+            proxyContext.enabled = false;
+        }
+    }
 
-        // Determines how pipelined a single frame can become. A low number can restrict parallelism, but a high number introduces latency.
-        constexpr size_t maxPipelining = 2;
+    const auto layout = getConfig().pipelineLayout;
 
-        Channel<AVPacket*> inputChannel{ maxPipelining };
-        Channel<AVFrame*> decodeChannel{ maxPipelining };
-        Channel<AVFrame*> filterChannel{ maxPipelining };
-        Channel<AVPacket*> encodeChannel{ maxPipelining };
-        Channel<Storage> resetCommunicationChannel{ 1 };  // Channel used to communicate storage resets back to the main thread.
+    // Channel used by the stages to have the main thread start a new session, after a storage reset or a fault they couldn't repair.
+    Channel<bool> resetCommunicationChannel{ 1 };
+    ParkingState parking{};
 
-        workers.push_back(std::thread{ inputWorker, std::ref(videoContext), std::ref(flag), std::ref(inputChannel) });
-        workers.push_back(std::thread{ decodeWorker, std::ref(videoContext), std::ref(inputChannel), std::ref(decodeChannel) });
-        workers.push_back(std::thread{ filterWorker, std::ref(videoContext), std::ref(decodeChannel), std::ref(filterChannel) });
-        workers.push_back(std::thread{ encodeWorker, std::ref(videoContext), std::ref(filterChannel), std::ref(encodeChannel) });
-        workers.push_back(std::thread{ outputWorker, std::ref(videoContext), std::ref(encodeChannel), std::ref(resetCommunicationChannel) });
+    // Segments are timed by the capture timestamps, in the time base of the stream being decoded.
+    AVRational timeBase{ 1, AV_TIME_BASE };
+    for (unsigned int i = 0; i < inputContext->nb_streams; ++i) {
+        if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            timeBase = inputContext->streams[i]->time_base;
+            break;
+        }
+    }
 
-        // Wait for the output worker to request a reset. The newly allocated storage is pulled from the channel.
-        auto newStorage = resetCommunicationChannel.pop();
+    Segmenter segmenter{ getConfig(), timeBase };
 
-        // Notify the input worker to start draining the pipeline. We already lost our storage space, so consider rethinking this solution
-        // in the future, as this method will add a short time jump in the media for the lost video.
-        flag.store(false);
+    // Determines how pipelined a single frame can become, found while recording. Carries over between sessions.
+    DepthTuner tuner{ getConfig(), frameRate };
 
-        // Sync all workers.
-        for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
-            iter->join();
+    // Sessions in a row that recorded nothing, and the delay before the next attempt.
+    constexpr int maxFailedSessions = 5;
+    int failedSessions = 0;
+    Backoff sessionBackoff{ std::chrono::milliseconds{ 100 }, std::chrono::milliseconds{ 5000 } };
+    const std::atomic<bool> waiting = true;
+    int error = 0;
+
+    while (true) {
+        std::atomic<bool> running = true;
+        const auto outputBefore = getRecorderTelemetry().outputBytes;
+
+        PipelineContext pipelineContext{ videoContext, running, resetCommunicationChannel, parking, proxyContext, nullptr, nullptr, segmenter };
+        segmenter.startSession();
+
+        switch (layout) {
+            case PipelineLayout::FUSED:
+                record<FusedLayout>(pipelineContext, tuner);
+                break;
+            case PipelineLayout::COMPACT:
+                record<CompactLayout>(pipelineContext, tuner);
+                break;
+            default:
+                record<ThreadedLayout>(pipelineContext, tuner);
+                break;
         }
 
-        // Push the new storage back on the reset channel so that the output worker can retrieve it when it starts up again.
-        resetCommunicationChannel.push(newStorage);
+        reportMemory();
 
-        // Draining and flushing doesn't seem to work, just build a new encoder.
-        //avcodec_send_frame(encContext, nullptr);
-        //avcodec_flush_buffers(encContext);
+        // A session that recorded nothing, or codecs that can't be rebuilt for the next one, are retried after a growing delay. If that
+        // keeps failing, the recorder stops with an error status for the watchdog to show, and the service restarts it from scratch.
+        bool progressed = getRecorderTelemetry().outputBytes > outputBefore;
+        bool prepared = false;
 
-        avcodec_send_frame(videoContext.encodeCtx, nullptr);  // Flush the encoder.
-        avcodec_free_context(&videoContext.encodeCtx);
+        while (!prepared) {
+            if (progressed) {
+                failedSessions = 0;
+                sessionBackoff.reset();
+            } else if (++failedSessions == maxFailedSessions) {
+                break;
+            } else {
+                sessionBackoff.wait(waiting);
+            }
 
-        if (!setupEncoder(&videoContext.encodeCtx, videoContext.frameRate)) {
-            std::cerr << "Failed to re-setup encoder.\n";
-            exit(1);  // #TODO: proper error handling and cleanup.
+            prepared = prepareSession(videoContext, proxyContext);
+            progressed = false;
+        }
+
+        if (!prepared) {
+            logError("%d sessions in a row failed, giving up.", maxFailedSessions);
+            setState(DashcamState::ERROR);
+            error = 1;
+            break;
         }
     }
 
     //processFrame(videoContext, frame, nullptr, outFile);  // Flush the decoder.
-    avcodec_send_frame(encContext, nullptr);  // Flush the encoder.
 
     /*
     if (encCodec->id == AV_CODEC_ID_MPEG1VIDEO || encCodec->id == AV_CODEC_ID_MPEG2VIDEO) {
@@ -401,10 +1599,14 @@ int run(AVFormatContext* inputContext, int frameRate) {
     }
     */
 
-    avformat_close_input(&inputContext);
-    avfilter_graph_free(&filterGraph);
-    avcodec_free_context(&encContext);
-    avcodec_free_context(&decContext);
+    avformat_close_input(&videoContext.inputCtx);
+    avfilter_graph_free(&videoContext.filterGraph);
+    freeEncoder(&videoContext.encodeCtx);
+    avfilter_graph_free(&proxyContext.filterGraph);
+    freeEncoder(&proxyContext.encodeCtx);
+    for (auto* decoder : videoContext.decoders) {
+        avcodec_free_context(&decoder);
+    }
 
-    return 0;
+    return error;
 }
@@ -1,17 +1,35 @@
 #pragma once
 
+#include <mutex>
+#include <vector>
+
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVFilterContext;
+struct AVFilterGraph;
 
 struct VideoContext
 {
     int frameRate;
     AVFormatContext* inputCtx;
     AVCodecContext* decodeCtx;
+    std::vector<AVCodecContext*> decoders;  // Decoded side by side when there's more than one, the first is decodeCtx.
+    AVFilterGraph* filterGraph;
+    AVFilterContext* filterSourceCtx;
+    AVFilterContext* filterSinkCtx;
+    AVCodecContext* encodeCtx;
+    std::mutex resetLock{};  // Held by stages rebuilding their codec or filter graph, the filter graph is built from the encoder's format.
+};
+
+// Everything needed to encode the proxy stream. Disabled if the proxy encoder can't be set up.
+struct ProxyContext
+{
+    bool enabled;
+    AVFilterGraph* filterGraph;
     AVFilterContext* filterSourceCtx;
     AVFilterContext* filterSinkCtx;
     AVCodecContext* encodeCtx;
 };
 
+// Records for as long as it can. Only returns once faults have kept every new session from recording, with the status set to ERROR.
 int run(AVFormatContext* inputContext, int frameRate);
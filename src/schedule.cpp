@@ -0,0 +1,161 @@
+#include "schedule.h"
+#include "config.h"
+
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <tracy/Tracy.hpp>
+
+// Taken from linux/ioprio.h, glibc doesn't wrap ioprio_set.
+constexpr int ioprioClassShift = 13;
+constexpr int ioprioWhoProcess = 1;
+
+const char* stageNames[] = {
+    "input",
+    "decode",
+    "filter",
+    "encode",
+    "output",
+    "proxy",
+    "thumbnail",
+    "upload"
+};
+
+static_assert(sizeof(stageNames) / sizeof(*stageNames) == static_cast<size_t>(Stage::COUNT));
+
+std::atomic<bool> stageReported[static_cast<size_t>(Stage::COUNT)]{};
+
+const char* getStageName(Stage stage) {
+    return stageNames[static_cast<size_t>(stage)];
+}
+
+int toNativePolicy(SchedulePolicy policy) {
+    switch (policy) {
+        case SchedulePolicy::BATCH:
+            return SCHED_BATCH;
+        case SchedulePolicy::IDLE:
+            return SCHED_IDLE;
+        case SchedulePolicy::FIFO:
+            return SCHED_FIFO;
+        case SchedulePolicy::RR:
+            return SCHED_RR;
+        default:
+            return SCHED_OTHER;
+    }
+}
+
+const char* getNativePolicyName(int policy) {
+    switch (policy) {
+        case SCHED_BATCH:
+            return "SCHED_BATCH";
+        case SCHED_IDLE:
+            return "SCHED_IDLE";
+        case SCHED_FIFO:
+            return "SCHED_FIFO";
+        case SCHED_RR:
+            return "SCHED_RR";
+        default:
+            return "SCHED_OTHER";
+    }
+}
+
+void reportSchedule(Stage stage) {
+    const pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+    std::stringstream report;
+
+    report << "Stage " << getStageName(stage) << ": cpus {";
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+        bool first = true;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                report << (first ? "" : ",") << cpu;
+                first = false;
+            }
+        }
+    }
+
+    int policy;
+    sched_param param{};
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    report << "}, " << getNativePolicyName(policy);
+
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        report << " priority " << param.sched_priority;
+    } else {
+        report << " nice " << getpriority(PRIO_PROCESS, threadId);
+    }
+
+    const auto ioPriority = syscall(SYS_ioprio_get, ioprioWhoProcess, threadId);
+    if (ioPriority >= 0) {
+        const char* ioClassNames[] = { "none", "rt", "be", "idle" };
+        const auto ioClass = ioPriority >> ioprioClassShift;
+
+        report << ", io " << (ioClass < 4 ? ioClassNames[ioClass] : "unknown") << "/" << (ioPriority & ((1 << ioprioClassShift) - 1));
+    }
+
+    std::cout << report.str() << "\n";
+}
+
+void applySchedule(Stage stage) {
+    ZoneScoped;
+
+    const auto& schedule = getConfig().schedules[static_cast<size_t>(stage)];
+    const pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+
+    // Makes the stages identifiable in top, perf and the Tracy thread list. Limited to 15 characters.
+    const auto threadName = std::string{ "dashcam-" } + getStageName(stage);
+    pthread_setname_np(pthread_self(), threadName.substr(0, 15).c_str());
+
+    if (!schedule.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (auto cpu : schedule.cpus) {
+            CPU_SET(cpu, &cpus);
+        }
+
+        if (auto error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); error != 0) {
+            std::cerr << "Failed to set the CPU affinity of stage " << getStageName(stage) << ": " << strerror(error) << "\n";
+        }
+    }
+
+    const auto policy = toNativePolicy(schedule.policy);
+    sched_param param{};
+
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        param.sched_priority = schedule.priority;
+    }
+
+    if (auto error = pthread_setschedparam(pthread_self(), policy, &param); error != 0) {
+        std::cerr << "Failed to set the scheduling policy of stage " << getStageName(stage) << ": " << strerror(error) << "\n";
+    }
+
+    // Niceness is per-thread on Linux, despite what the interface suggests.
+    if (policy != SCHED_FIFO && policy != SCHED_RR && schedule.priority != 0) {
+        if (setpriority(PRIO_PROCESS, threadId, schedule.priority) != 0) {
+            std::cerr << "Failed to set the niceness of stage " << getStageName(stage) << ": " << strerror(errno) << "\n";
+        }
+    }
+
+    if (schedule.ioClass != IoClass::NONE) {
+        const int ioPriority = (static_cast<int>(schedule.ioClass) << ioprioClassShift) | (schedule.ioClass == IoClass::IDLE ? 0 : schedule.ioLevel);
+
+        if (syscall(SYS_ioprio_set, ioprioWhoProcess, threadId, ioPriority) != 0) {
+            std::cerr << "Failed to set the I/O priority of stage " << getStageName(stage) << ": " << strerror(errno) << "\n";
+        }
+    }
+
+    // Workers are recreated on every storage reset, only report the first time around.
+    if (!stageReported[static_cast<size_t>(stage)].exchange(true)) {
+        reportSchedule(stage);
+    }
+}
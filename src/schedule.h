@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Threads of the recording pipeline that can be scheduled independently.
+enum class Stage : uint8_t {
+    INPUT = 0,
+    DECODE = 1,
+    FILTER = 2,
+    ENCODE = 3,
+    OUTPUT = 4,
+    PROXY = 5,
+    THUMBNAIL = 6,
+    UPLOAD = 7,
+    COUNT
+};
+
+enum class SchedulePolicy : uint8_t {
+    OTHER = 0,  // Default time sharing, niceness applies.
+    BATCH = 1,
+    IDLE = 2,
+    FIFO = 3,  // Real-time, priority applies.
+    RR = 4  // Real-time round robin, priority applies.
+};
+
+enum class IoClass : uint8_t {
+    NONE = 0,  // Inherit the default I/O priority.
+    REALTIME = 1,
+    BEST_EFFORT = 2,
+    IDLE = 3
+};
+
+struct StageSchedule {
+    std::vector<int> cpus{};  // Allowed CPUs, empty allows all of them.
+    SchedulePolicy policy = SchedulePolicy::OTHER;
+    int priority = 0;  // Real-time priority for FIFO and RR, niceness otherwise.
+    IoClass ioClass = IoClass::NONE;
+    int ioLevel = 4;  // 0 (highest) to 7 (lowest), unused for the idle class.
+};
+
+const char* getStageName(Stage stage);
+
+// Applies the configured schedule to the calling thread. Failures are reported, but not fatal, since most of these need elevated privileges.
+// The effective settings are reported the first time each stage is scheduled.
+void applySchedule(Stage stage);
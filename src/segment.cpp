@@ -0,0 +1,98 @@
+#include "segment.h"
+#include "storage.h"
+#include "log.h"
+
+#include <algorithm>
+
+extern "C"
+{
+    #include <libavutil/mathematics.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+Segmenter::Segmenter(const Config& config, AVRational timeBase) : timeBase(timeBase) {
+    maxDuration = av_rescale_q(config.segmentMaxDuration.count(), AVRational{ 1, 1000 }, timeBase);
+}
+
+void Segmenter::startSession() {
+    sessionStart.store(nextCut.load(std::memory_order_relaxed), std::memory_order_release);
+}
+
+bool Segmenter::update(int64_t pts) {
+    std::scoped_lock scopeLock{ lock };
+
+    // Timestamps only go backwards if the capture clock jumped, the segment's duration is unknown from there.
+    if (nextCut.load(std::memory_order_relaxed) != sessionStart.load(std::memory_order_relaxed)) {
+        const auto elapsed = pts - cuts.back().pts;
+        const bool durationReached = maxDuration > 0 && elapsed >= maxDuration;
+
+        if (!durationReached && !sizeReached.load(std::memory_order_relaxed) && elapsed >= 0) {
+            return false;
+        }
+    }
+
+    ZoneScoped;
+
+    cuts.push_back({ .pts = pts, .stem = makeSegmentStem(pts) });
+    if (cuts.size() > keptCuts) {
+        cuts.pop_front();
+    }
+
+    sizeReached.store(false, std::memory_order_relaxed);
+    nextCut.fetch_add(1, std::memory_order_release);
+
+    logDebug("Planned segment '%s' at pts %lld.", cuts.back().stem.c_str(), static_cast<long long>(pts));
+
+    return true;
+}
+
+void Segmenter::requestCut(const std::string& stem) {
+    std::scoped_lock scopeLock{ lock };
+
+    if (!cuts.empty() && cuts.back().stem == stem) {
+        sizeReached.store(true, std::memory_order_relaxed);
+    }
+}
+
+std::optional<SegmentCut> Segmenter::follow(uint64_t& cursor, int64_t pts) {
+    // Nothing new in the common case, which doesn't need the lock.
+    if (cursor >= nextCut.load(std::memory_order_acquire)) {
+        return {};
+    }
+
+    std::scoped_lock scopeLock{ lock };
+
+    const auto planned = nextCut.load(std::memory_order_relaxed);
+
+    // Cuts the output fell too far behind to see are passed over, it picks up with the oldest one kept.
+    const auto first = planned - cuts.size();
+    cursor = std::max(cursor, first);
+
+    std::optional<SegmentCut> latest;
+    while (cursor < planned && cuts[cursor - first].pts <= pts) {
+        latest = cuts[cursor - first];
+        ++cursor;
+    }
+
+    return latest;
+}
+
+int64_t Segmenter::toMilliseconds(int64_t duration) const {
+    return av_rescale_q(duration, timeBase, AVRational{ 1, 1000 });
+}
+
+int alignGopSize(int gopSize, int frameRate, const Config& config) {
+    const auto segmentFrames = config.segmentMaxDuration.count() * frameRate / 1000;
+    if (segmentFrames <= 0) {
+        return gopSize;
+    }
+
+    for (int size = std::min<int64_t>(gopSize, segmentFrames); size > 1; --size) {
+        if (segmentFrames % size == 0) {
+            return size;
+        }
+    }
+
+    return gopSize;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+extern "C"
+{
+    #include <libavutil/rational.h>
+}
+
+// Where one segment ends and the next begins.
+struct SegmentCut {
+    int64_t pts = 0;  // Capture pts of the first frame of the new segment.
+    std::string stem{};  // Shared by the new segment and its companion files.
+};
+
+// Splits the recording into segments bounded by duration and size, whichever is reached first. Cuts are planned on the decoded frames,
+// in capture order, and every output of the session follows the plan at its own pace: the encoders start the first frame at or past a
+// cut on a keyframe, and the writers move on to the next file when that keyframe reaches them. The main stream, the proxy and the
+// thumbnails all split at the same frame, and the pipeline never stops for it.
+class Segmenter {
+public:
+    Segmenter(const Config& config, AVRational timeBase);
+
+    // Called by the main thread before each session. The first frame of a session always starts a new segment, since its encoders start
+    // from scratch.
+    void startSession();
+
+    // Called with every decoded frame, in capture order. Plans a cut at the frame if the segment it belongs to has reached a bound, or if
+    // it's the first of a session. Returns true if it did.
+    bool update(int64_t pts);
+
+    // Asks for a cut on the next frame, because the segment with the given stem has reached the size bound. Ignored if a cut was
+    // planned since.
+    void requestCut(const std::string& stem);
+
+    // Number of the cut the current session starts with. Stages are set up on their own threads, possibly after the first frame, so this
+    // is where the outputs of the session start following the plan.
+    uint64_t getSessionStart() const { return sessionStart.load(std::memory_order_acquire); }
+
+    // The latest cut at or before pts past the cursor, advancing the cursor beyond it.
+    std::optional<SegmentCut> follow(uint64_t& cursor, int64_t pts);
+
+    int64_t toMilliseconds(int64_t duration) const;
+
+private:
+    // Cuts the slowest output may not have reached yet. Outputs lag by a few frames, cuts are seconds apart.
+    static constexpr size_t keptCuts = 16;
+
+    int64_t maxDuration;  // In the capture time base, 0 for none.
+    AVRational timeBase;
+
+    std::mutex lock{};
+    std::deque<SegmentCut> cuts{};  // The most recent ones, the last is the segment being planned.
+    std::atomic<uint64_t> nextCut = 0;
+    std::atomic<uint64_t> sessionStart = 0;
+    std::atomic<bool> sizeReached = false;
+};
+
+// Follows the plan for one output of a session.
+class SegmentFollower {
+public:
+    explicit SegmentFollower(Segmenter& segmenter) : segmenter(segmenter), cursor(segmenter.getSessionStart()) {}
+
+    // The cut that starts at the item with the given pts, if any. Only a keyframe can start a segment, a cut that reaches a delta frame
+    // waits for the next keyframe.
+    std::optional<SegmentCut> check(int64_t pts, bool keyframe) {
+        if (auto cut = segmenter.follow(cursor, pts)) {
+            pending = std::move(cut);
+        }
+
+        if (!pending || !keyframe) {
+            return {};
+        }
+
+        return std::exchange(pending, std::nullopt);
+    }
+
+private:
+    Segmenter& segmenter;
+    uint64_t cursor;
+    std::optional<SegmentCut> pending{};
+};
+
+// Keyframe interval no longer than the given one that divides a segment of the configured duration into whole GOPs, so that the last GOP
+// of a segment isn't cut short by the keyframe the next one starts with.
+int alignGopSize(int gopSize, int frameRate, const Config& config);
@@ -1,62 +1,201 @@
 #include "status.h"
+#include "telemetry.h"
 
 #include <iostream>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <errno.h>
+#include <new>
+#include <thread>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <tracy/Tracy.hpp>
 
-int socketHandle = -1;
+StatusBlock* statusBlock = nullptr;
+
+uint64_t monotonicUs() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+// Writers serialize on the sequence itself, taking it from even to odd. Updates are a few stores, so contention is only ever brief.
+uint32_t beginUpdate(StatusBlock& block) {
+    auto sequence = block.sequence.load(std::memory_order_relaxed);
+
+    while (true) {
+        if (sequence % 2 == 0 && block.sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+            break;
+        }
+
+        if (sequence % 2 != 0) {
+            std::this_thread::yield();
+            sequence = block.sequence.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Keeps the field stores below from becoming visible before the odd sequence.
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return sequence + 1;
+}
+
+void endUpdate(StatusBlock& block, uint32_t sequence) {
+    block.updatedUs.store(monotonicUs(), std::memory_order_relaxed);
+    block.sequence.store(sequence + 1, std::memory_order_release);
+}
 
 bool initializeStatus() {
     ZoneScoped;
 
-    socketHandle = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (socketHandle < 0) {
-        std::cerr << "Failed to open status socket!\n";
+    // Readers still holding the old segment see its heartbeat stop, and attach to the new one.
+    shm_unlink(statusSharedMemoryName);
+
+    int fd = shm_open(statusSharedMemoryName, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        std::cerr << "Failed to create status shared memory!\n";
         return false;
     }
 
-    sockaddr_in watchdogConnection;
-    watchdogConnection.sin_family = AF_INET;
-    watchdogConnection.sin_port = htons(watchdogPort);
-    inet_aton("127.0.0.1", &watchdogConnection.sin_addr);
+    if (ftruncate(fd, sizeof(StatusBlock)) != 0) {
+        std::cerr << "Failed to size status shared memory!\n";
+        close(fd);
+        return false;
+    }
 
-    int error = connect(socketHandle, (sockaddr*)&watchdogConnection, sizeof(watchdogConnection));
-    if (error != 0) {
-        std::cerr << "Failed to connect to watchdog service!\n";
+    void* memory = mmap(nullptr, sizeof(StatusBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        std::cerr << "Failed to map status shared memory!\n";
         return false;
     }
 
+    auto* block = new (memory) StatusBlock{};
+    block->version = statusVersion;
+    block->pid = static_cast<uint32_t>(getpid());
+    block->updatedUs.store(monotonicUs(), std::memory_order_relaxed);
+
+    // Published last, a reader that sees the magic sees a complete header.
+    std::atomic_thread_fence(std::memory_order_release);
+    block->magic = statusMagic;
+
+    statusBlock = block;
+
     return true;
 }
 
 void shutdownStatus() {
     ZoneScoped;
 
-    if (socketHandle >= 0) {
-        close(socketHandle);
-        socketHandle = -1;
+    // The segment itself stays, so readers see the last state and a stopped heartbeat.
+    if (statusBlock) {
+        munmap(statusBlock, sizeof(StatusBlock));
+        statusBlock = nullptr;
     }
 }
 
 void setState(const DashcamState state) {
     ZoneScoped;
 
-    if (socketHandle >= 0) {
-        char buffer[2];
-        buffer[0] = static_cast<char>(state);
-        buffer[1] = '\n';
-
-        int error = send(socketHandle, buffer, 2, MSG_DONTWAIT);
-        if (error < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                std::cerr << "Failed to set status state!\n";
-                return;
-            }
+    if (statusBlock) {
+        const auto sequence = beginUpdate(*statusBlock);
+        statusBlock->state.store(static_cast<uint32_t>(state), std::memory_order_relaxed);
+        endUpdate(*statusBlock, sequence);
+    }
+}
+
+void publishStatus() {
+    if (!statusBlock) {
+        return;
+    }
+
+    const auto telemetry = getRecorderTelemetry();
+
+    const auto sequence = beginUpdate(*statusBlock);
+    statusBlock->frames.store(telemetry.frames, std::memory_order_relaxed);
+    statusBlock->lateFrames.store(telemetry.lateFrames, std::memory_order_relaxed);
+    statusBlock->lateUs.store(telemetry.lateUs, std::memory_order_relaxed);
+    statusBlock->droppedFrames.store(telemetry.droppedFrames, std::memory_order_relaxed);
+    statusBlock->blockedAllocations.store(telemetry.blockedAllocations, std::memory_order_relaxed);
+    statusBlock->memoryUsed.store(telemetry.memoryUsed, std::memory_order_relaxed);
+    statusBlock->memoryBudget.store(telemetry.memoryBudget, std::memory_order_relaxed);
+    for (size_t i = 0; i < static_cast<size_t>(RecoveryAction::COUNT); ++i) {
+        statusBlock->recoveries[i].store(telemetry.recoveries[i], std::memory_order_relaxed);
+    }
+    endUpdate(*statusBlock, sequence);
+
+    statusBlock->heartbeat.fetch_add(1, std::memory_order_relaxed);
+}
+
+const StatusBlock* attachStatus() {
+    int fd = shm_open(statusSharedMemoryName, O_RDONLY, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(StatusBlock)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* memory = mmap(nullptr, sizeof(StatusBlock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    const auto* block = static_cast<const StatusBlock*>(memory);
+    if (block->magic != statusMagic || block->version != statusVersion) {
+        munmap(memory, sizeof(StatusBlock));
+        return nullptr;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return block;
+}
+
+void detachStatus(const StatusBlock* block) {
+    if (block) {
+        munmap(const_cast<StatusBlock*>(block), sizeof(StatusBlock));
+    }
+}
+
+bool readStatus(const StatusBlock& block, StatusSnapshot& snapshot) {
+    // A writer that died mid update leaves the sequence odd for good, so give up eventually.
+    for (int attempt = 0; attempt < 1000; ++attempt) {
+        const auto before = block.sequence.load(std::memory_order_acquire);
+        if (before % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        snapshot.updatedUs = block.updatedUs.load(std::memory_order_relaxed);
+        snapshot.state = static_cast<DashcamState>(block.state.load(std::memory_order_relaxed));
+        snapshot.frames = block.frames.load(std::memory_order_relaxed);
+        snapshot.lateFrames = block.lateFrames.load(std::memory_order_relaxed);
+        snapshot.lateUs = block.lateUs.load(std::memory_order_relaxed);
+        snapshot.droppedFrames = block.droppedFrames.load(std::memory_order_relaxed);
+        snapshot.blockedAllocations = block.blockedAllocations.load(std::memory_order_relaxed);
+        snapshot.memoryUsed = block.memoryUsed.load(std::memory_order_relaxed);
+        snapshot.memoryBudget = block.memoryBudget.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < statusRecoverySlots; ++i) {
+            snapshot.recoveries[i] = block.recoveries[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (block.sequence.load(std::memory_order_relaxed) == before) {
+            snapshot.pid = block.pid;
+            snapshot.heartbeat = block.heartbeat.load(std::memory_order_relaxed);
+            return true;
         }
     }
+
+    return false;
 }
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <atomic>
 
-// Taken from watchdog/watchdog.py
-constexpr static int watchdogPort = 5505;
+#include "recovery.h"
+
+// Name of the POSIX shared memory segment, /dev/shm/dashcam-status. Read by watchdog/watchdog.py.
+constexpr const char* statusSharedMemoryName = "/dashcam-status";
+constexpr uint32_t statusMagic = 0x44534853;  // "SHSD"
+constexpr uint32_t statusVersion = 2;
+constexpr size_t statusRecoverySlots = 8;  // Room for every RecoveryAction.
 
 // Taken from watchdog/watchdog.py
 enum class DashcamState : uint8_t {
@@ -13,9 +20,64 @@ enum class DashcamState : uint8_t {
     RECORDING = 3,
     FALLING_BEHIND = 4,
     CONVERTING = 5,
-    UPLOADING = 6
+    UPLOADING = 6,
+    PARKED = 7
+};
+
+// Layout of the shared segment, native endian. Fields past the heartbeat are guarded by a seqlock: the sequence is odd while an update is
+// in progress, and a reader retries if it changed across its read. Writers never wait on readers, so readers can come and go at will.
+// The heartbeat advances with every published frame, a reader that sees it stand still knows the recorder has stalled.
+struct StatusBlock {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> sequence;
+    uint32_t pid;
+    std::atomic<uint64_t> heartbeat;
+
+    std::atomic<uint64_t> updatedUs;  // CLOCK_MONOTONIC time of the last update.
+    std::atomic<uint32_t> state;  // DashcamState
+    uint32_t reserved;
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> lateFrames;
+    std::atomic<uint64_t> lateUs;
+    std::atomic<uint64_t> droppedFrames;
+    std::atomic<uint64_t> blockedAllocations;
+    std::atomic<uint64_t> memoryUsed;
+    std::atomic<uint64_t> memoryBudget;
+    std::atomic<uint64_t> recoveries[statusRecoverySlots];  // Indexed by RecoveryAction.
 };
 
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Status fields are shared with other processes and must be lock free.");
+static_assert(static_cast<size_t>(RecoveryAction::COUNT) <= statusRecoverySlots);
+static_assert(sizeof(StatusBlock) == 160 && offsetof(StatusBlock, heartbeat) == 16 && offsetof(StatusBlock, frames) == 40,
+    "The status layout is shared with watchdog/watchdog.py.");
+
+// A consistent copy of the guarded fields.
+struct StatusSnapshot {
+    uint32_t pid = 0;
+    uint64_t heartbeat = 0;
+    uint64_t updatedUs = 0;
+    DashcamState state = DashcamState::DEAD;
+    uint64_t frames = 0;
+    uint64_t lateFrames = 0;
+    uint64_t lateUs = 0;
+    uint64_t droppedFrames = 0;
+    uint64_t blockedAllocations = 0;
+    uint64_t memoryUsed = 0;
+    uint64_t memoryBudget = 0;
+    uint64_t recoveries[statusRecoverySlots]{};
+};
+
+// Creates the segment afresh, replacing any left by an earlier run.
 bool initializeStatus();
 void shutdownStatus();
+
+// Safe to call per frame and from any thread. setState() is a handful of stores, publishStatus() also copies the memory budget's counters
+// under its lock, once.
 void setState(const DashcamState state);
+void publishStatus();  // Publishes the recorder telemetry and advances the heartbeat.
+
+// Reader side, for inspecting a running recorder.
+const StatusBlock* attachStatus();
+void detachStatus(const StatusBlock* block);
+bool readStatus(const StatusBlock& block, StatusSnapshot& snapshot);
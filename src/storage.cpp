@@ -1,72 +1,113 @@
 #include "storage.h"
+#include "manifest.h"
+#include "config.h"
+#include "log.h"
 
 #include <cstring>
 #include <time.h>
+#include <map>
 #include <set>
+#include <vector>
 #include <filesystem>
-#include <iostream>
 
 #include <tracy/Tracy.hpp>
 
 std::string getDateTime() {
     time_t now = time(0);
-    auto t = *localtime(&now);
+
+    // Called from the pipeline and the uploader alike, so not with localtime()'s shared buffer.
+    std::tm t{};
+    localtime_r(&now, &t);
     char buffer[64];
     strftime(buffer, sizeof(buffer), "%Y-%m-%d_%H:%M:%S", &t);
 
     return buffer;
 }
 
-Storage getStorage(Storage& oldStorage) {
+Storage getStorage(Storage& oldStorage, const std::string& stem) {
     ZoneScoped;
 
-    constexpr size_t bufferSpace = 512ULL * 1024ULL * 1024ULL;  // 512 MB
-    constexpr size_t maxFileSize = 512ULL * 1024ULL * 1024ULL;  // 512 MB
-
     if (oldStorage.file) {
         fclose(oldStorage.file);
+        oldStorage.file = nullptr;  // Safe to call again with the same storage if this one fails.
     }
 
     // Determine max storage space.
-    auto freeSpace = std::filesystem::space(storageLocation).available - bufferSpace;
+    const auto segmentSpace = getSegmentSpace();
+    auto freeSpace = std::filesystem::space(storageLocation).available - storageReserve;
 
-    while (freeSpace < maxFileSize) {
+    while (freeSpace < segmentSpace) {
         ZoneScopedN("storage_cull");
 
-        // Delete the oldest recording, by file name.
-        std::set<std::filesystem::path> entries;
+        // Delete the oldest recording that isn't protected, by file name, along with its companion files.
+        std::map<std::string, std::vector<std::filesystem::path>> segments;
+        std::set<std::string> protectedStems;
         for (const auto& entry : std::filesystem::directory_iterator{ storageLocation }) {
-            entries.insert(entry.path());
+            segments[getSegmentStem(entry.path())].push_back(entry.path());
+
+            if (entry.path().extension() == protectSuffix) {
+                protectedStems.insert(getSegmentStem(entry.path()));
+            }
         }
 
-        if (entries.size() == 0) {
-            std::cerr << "Could not find any files to remove from the storage location '" << storageLocation << "'. Not enough "
-                << "space to accommodate a full video. Free space: " << freeSpace << ", requested: "
-                << maxFileSize << "\n";
-            return {};
+        for (const auto& stem : protectedStems) {
+            segments.erase(stem);
         }
 
-        auto target = *entries.begin();
-        if (!std::filesystem::remove(target)) {
-            std::cerr << "Failed to remove file: '" << target << "'\n";
+        if (segments.size() == 0) {
+            logError("Could not find any files to remove from the storage location '%s'. Not enough space to accommodate a full video. "
+                "Free space: %llu, requested: %zu", storageLocation, static_cast<unsigned long long>(freeSpace), segmentSpace);
             return {};
         }
 
-        freeSpace = std::filesystem::space(storageLocation).available - bufferSpace;
+        ZoneText(segments.begin()->first.c_str(), segments.begin()->first.size());
+
+        for (const auto& target : segments.begin()->second) {
+            ZoneScopedN("storage_cull_remove");
+
+            if (!std::filesystem::remove(target)) {
+                logError("Failed to remove file: '%s'", target.c_str());
+                return {};
+            }
+        }
+
+        freeSpace = std::filesystem::space(storageLocation).available - storageReserve;
     }
 
-    auto fileName = storageLocation + getDateTime() + ".h264";
+    auto fileName = storageLocation + stem + segmentSuffix;
+    const auto name = std::filesystem::path{ fileName }.filename().string();
+
+    // Keeps the uploader away from it until it's complete. Recorded before the file exists, or reconcile() could adopt it in between.
+    getManifest().update({ .name = name, .state = SegmentState::RECORDING });
 
     FILE* outFile = fopen(fileName.c_str(), "w+");
     if (!outFile) {
-        std::cerr << "Failed to create output video.\n";
+        logError("Failed to create output video.");
+        getManifest().remove(name);
         return {};
     }
 
-    std::cout << "Created new file: '" << fileName.c_str() << "', max size of " << maxFileSize << " bytes\n";
+    logInfo("Created new file: '%s', max size of %zu bytes", fileName.c_str(), segmentSpace);
 
     return Storage{
-        .space = maxFileSize,
-        .file = outFile
+        .space = segmentSpace,
+        .file = outFile,
+        .path = fileName
     };
 }
+
+size_t getSegmentSpace() {
+    const auto maxSize = getConfig().segmentMaxSize;
+
+    return maxSize + maxSize / 4;
+}
+
+std::string makeSegmentStem(int64_t pts) {
+    return getDateTime() + "_" + std::to_string(pts);
+}
+
+std::string getSegmentStem(const std::filesystem::path& path) {
+    const auto name = path.filename().string();
+
+    return name.substr(0, name.find('.'));
+}
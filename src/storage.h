@@ -1,12 +1,41 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <stdio.h>
+#include <string>
+#include <filesystem>
 
 constexpr const char* storageLocation = "./data/";
 
+constexpr const char* segmentSuffix = ".h264";
+
+constexpr size_t storageReserve = 512ULL * 1024ULL * 1024ULL;  // Space always left free on the card.
+
+// Companion files written next to each segment, named <segment stem><suffix>.
+constexpr const char* proxySuffix = ".proxy.h264";
+constexpr const char* thumbnailSuffix = ".sprite";  // Followed by -<sheet>.jpg for the sheets, and .idx for the index.
+
+// Marks a segment as protected, it's uploaded first and never culled. Created by hand or by tooling, named <segment stem><suffix>.
+constexpr const char* protectSuffix = ".protect";
+
+// Resumable upload progress, kept next to the file being uploaded as <file name><suffix>.
+constexpr const char* uploadProgressSuffix = ".upload";
+
 struct Storage {
     size_t space = 0;
     FILE* file = nullptr;
+    std::string path{};
 };
 
-Storage getStorage(Storage& oldStorage);
+// Closes the old storage and opens a segment named <stem><segmentSuffix>, culling the oldest recordings until there's room for it.
+Storage getStorage(Storage& oldStorage, const std::string& stem);
+
+// Room set aside for a segment. Past segment.max_size_mb the next cut is requested, the rest leaves time for it to land on a keyframe.
+size_t getSegmentSpace();
+
+// Stem of a segment starting now, with the frame at the given capture pts. Local time first, so that stems sort by age.
+std::string makeSegmentStem(int64_t pts);
+
+// The segment a file belongs to, its name up to the first '.'. Segments and their companion files share a stem.
+std::string getSegmentStem(const std::filesystem::path& path);
@@ -0,0 +1,44 @@
+#include "telemetry.h"
+#include "budget.h"
+
+#include <atomic>
+
+std::atomic<uint64_t> captureCount{ 0 };
+std::atomic<uint64_t> lateCaptureCount{ 0 };
+std::atomic<uint64_t> totalLateUs{ 0 };
+std::atomic<uint64_t> outputByteCount{ 0 };
+
+void recordCapture(int64_t lateUs) {
+    captureCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (lateUs > 0) {
+        lateCaptureCount.fetch_add(1, std::memory_order_relaxed);
+        totalLateUs.fetch_add(static_cast<uint64_t>(lateUs), std::memory_order_relaxed);
+    }
+}
+
+void recordOutput(size_t bytes) {
+    outputByteCount.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+RecorderTelemetry getRecorderTelemetry() {
+    const auto memory = getMemoryStats();
+
+    RecorderTelemetry telemetry{
+        .frames = captureCount.load(std::memory_order_relaxed),
+        .lateFrames = lateCaptureCount.load(std::memory_order_relaxed),
+        .lateUs = totalLateUs.load(std::memory_order_relaxed),
+        .droppedFrames = memory.dropped,
+        .blockedAllocations = memory.blocked,
+        .memoryPressure = memory.budget > 0 ? static_cast<double>(memory.used) / memory.budget : 0.0,
+        .memoryUsed = memory.used,
+        .memoryBudget = memory.budget,
+        .outputBytes = outputByteCount.load(std::memory_order_relaxed)
+    };
+
+    for (size_t i = 0; i < static_cast<size_t>(RecoveryAction::COUNT); ++i) {
+        telemetry.recoveries[i] = getRecoveryCount(static_cast<RecoveryAction>(i));
+    }
+
+    return telemetry;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "recovery.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Health of the recording pipeline, as seen by the things that compete with it. Counters only ever increase, consumers diff snapshots.
+struct RecorderTelemetry {
+    uint64_t frames = 0;  // Captures attempted.
+    uint64_t lateFrames = 0;  // Captures that came in after their slot.
+    uint64_t lateUs = 0;  // Total lateness of the late captures.
+    uint64_t droppedFrames = 0;  // Captures or decoded frames thrown away, from the memory budget.
+    uint64_t blockedAllocations = 0;  // Allocations that had to wait for memory.
+    double memoryPressure = 0.0;  // Fraction of the memory budget in use.
+    uint64_t memoryUsed = 0;  // Bytes of the memory budget in use.
+    uint64_t memoryBudget = 0;
+    uint64_t outputBytes = 0;  // Encoded bytes written to segments.
+    uint64_t recoveries[static_cast<size_t>(RecoveryAction::COUNT)]{};  // Faults recovered from, by action taken.
+};
+
+// Called once per capture with how late it was, zero if it was on time.
+void recordCapture(int64_t lateUs);
+
+// Called by the output stage for every packet written.
+void recordOutput(size_t bytes);
+
+RecorderTelemetry getRecorderTelemetry();
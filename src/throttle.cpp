@@ -0,0 +1,198 @@
+#include "throttle.h"
+#include "config.h"
+
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <tracy/Tracy.hpp>
+
+void TokenBucket::setRate(double bytesPerSecond) {
+    std::scoped_lock scopeLock{ lock };
+
+    rate = bytesPerSecond;
+}
+
+void TokenBucket::acquire(size_t bytes) {
+    ZoneScoped;
+
+    std::unique_lock scopeLock{ lock };
+
+    if (rate <= 0.0) {
+        return;
+    }
+
+    // Refill, allowing a burst of a quarter second at most.
+    const auto now = std::chrono::steady_clock::now();
+    tokens = std::min(tokens + std::chrono::duration<double>(now - last).count() * rate, rate * 0.25);
+    last = now;
+
+    // Taken up front, going negative. Later callers wait their turn behind the debt.
+    tokens -= bytes;
+    if (tokens >= 0.0) {
+        return;
+    }
+
+    const auto wait = std::chrono::duration<double>(-tokens / rate);
+    scopeLock.unlock();
+
+    std::this_thread::sleep_for(wait);
+}
+
+UploadThrottle::UploadThrottle() {
+    const auto& config = getConfig();
+
+    // Start low and earn the rest, the recorder's state is unknown until the first update.
+    cpuShare = config.uploadMinCpuShare;
+    bandwidthCap = config.uploadMinBitRate / 8.0;
+    bandwidth.setRate(bandwidthCap);
+
+    last = getRecorderTelemetry();
+}
+
+void UploadThrottle::setEnabled(bool enabled) {
+    this->enabled = enabled;
+    bandwidth.setRate(enabled ? bandwidthCap : 0.0);
+}
+
+void UploadThrottle::update() {
+    ZoneScoped;
+
+    if (!enabled) {
+        return;
+    }
+
+    const auto& config = getConfig();
+    const auto current = getRecorderTelemetry();
+    const double minBandwidth = config.uploadMinBitRate / 8.0;
+    const double maxBandwidth = config.uploadMaxBitRate / 8.0;
+
+    const bool strained = current.lateFrames > last.lateFrames || current.droppedFrames > last.droppedFrames
+        || current.blockedAllocations > last.blockedAllocations;
+    const bool pressured = current.memoryPressure > 0.75;
+
+    auto share = getCpuShare();
+
+    if (strained) {
+        share = std::max(share * 0.5, config.uploadMinCpuShare);
+        bandwidthCap = std::max(bandwidthCap * 0.5, minBandwidth);
+
+        std::cout << "Recorder under strain (" << current.lateFrames - last.lateFrames << " late, " << current.droppedFrames - last.droppedFrames
+            << " dropped), upload throttled to " << share * 100.0 << "% CPU and " << bandwidthCap * 8.0 / 1000.0 << " kbps.\n";
+    } else if (!pressured) {
+        share = std::min(share + config.uploadMaxCpuShare * 0.1, config.uploadMaxCpuShare);
+        bandwidthCap = std::min(bandwidthCap + maxBandwidth * 0.1, maxBandwidth);
+    }
+
+    cpuShare = share;
+    bandwidth.setRate(bandwidthCap);
+
+    last = current;
+
+    TracyPlot("upload_cpu_share", share);
+    TracyPlot("upload_bandwidth", bandwidthCap);
+}
+
+UploadThrottle& getUploadThrottle() {
+    static UploadThrottle throttle;
+
+    return throttle;
+}
+
+int runThrottled(const std::string& command, std::string* output) {
+    ZoneScoped;
+
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    const pid_t child = fork();
+    if (child < 0) {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return -1;
+    }
+
+    if (child == 0) {
+        // Its own group, so that everything it starts is stopped along with it.
+        setpgid(0, 0);
+        dup2(pipeFds[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+        _exit(127);
+    }
+
+    close(pipeFds[1]);
+    setpgid(child, child);  // Also done here, whichever runs first wins.
+
+    constexpr auto period = std::chrono::milliseconds{ 100 };
+    bool outputOpen = true;
+    char buffer[4096];
+
+    // Reads output until the deadline, or just waits once the output is closed.
+    auto readUntil = [&](std::chrono::steady_clock::time_point deadline) {
+        for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now()) {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+
+            if (!outputOpen) {
+                std::this_thread::sleep_for(remaining);
+                return;
+            }
+
+            pollfd descriptor{ pipeFds[0], POLLIN, 0 };
+            if (poll(&descriptor, 1, static_cast<int>(std::max<int64_t>(remaining.count(), 1))) <= 0) {
+                continue;
+            }
+
+            const auto count = read(pipeFds[0], buffer, sizeof(buffer));
+            if (count > 0) {
+                if (output) {
+                    output->append(buffer, count);
+                }
+            } else if (count == 0 || errno != EINTR) {
+                outputOpen = false;
+            }
+        }
+    };
+
+    int status = 0;
+    while (true) {
+        const auto share = getUploadThrottle().getCpuShare();
+        const auto start = std::chrono::steady_clock::now();
+        const auto running = std::chrono::duration_cast<std::chrono::milliseconds>(period * share);
+
+        readUntil(start + std::max(running, std::chrono::milliseconds{ 1 }));
+
+        if (waitpid(child, &status, WNOHANG) == child) {
+            break;
+        }
+
+        if (share < 1.0) {
+            kill(-child, SIGSTOP);
+            readUntil(start + period);
+            kill(-child, SIGCONT);
+        }
+    }
+
+    // Anything still buffered after the exit.
+    while (outputOpen) {
+        const auto count = read(pipeFds[0], buffer, sizeof(buffer));
+        if (count <= 0) {
+            break;
+        }
+
+        if (output) {
+            output->append(buffer, count);
+        }
+    }
+
+    close(pipeFds[0]);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "telemetry.h"
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+// Limits a byte rate, shared by every connection of the uploader.
+class TokenBucket {
+public:
+    // Zero disables the limit.
+    void setRate(double bytesPerSecond);
+
+    // Waits until the bytes may be sent.
+    void acquire(size_t bytes);
+
+private:
+    std::mutex lock{};
+    double rate = 0.0;
+    double tokens = 0.0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+};
+
+// Resource caps for the upload path while the recorder is running. Adjusted from the recorder's telemetry: additive increase while it
+// keeps up, multiplicative decrease as soon as it shows strain (late captures, dropped frames or allocations waiting on the budget).
+class UploadThrottle {
+public:
+    UploadThrottle();
+
+    // Called periodically by the uploader. Only ramps while enabled.
+    void update();
+
+    // Disabled when nothing is recording, everything runs unthrottled. Set by uploadMedia().
+    void setEnabled(bool enabled);
+
+    TokenBucket& getBandwidth() { return bandwidth; }
+
+    // Fraction of wall time the converter is allowed to run, 0 to 1.
+    double getCpuShare() const { return enabled ? cpuShare.load(std::memory_order_relaxed) : 1.0; }
+
+private:
+    TokenBucket bandwidth{};
+    std::atomic<bool> enabled = true;
+    std::atomic<double> cpuShare;
+    double bandwidthCap;  // Bytes per second.
+    RecorderTelemetry last{};
+};
+
+UploadThrottle& getUploadThrottle();
+
+// Runs a shell command in its own process group, capturing stdout, and duty cycles it with SIGSTOP and SIGCONT to hold it to the
+// throttle's CPU share. Returns the exit code, or -1 if it couldn't be run.
+int runThrottled(const std::string& command, std::string* output = nullptr);
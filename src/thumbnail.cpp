@@ -0,0 +1,254 @@
+#include "thumbnail.h"
+#include "budget.h"
+#include "manifest.h"
+#include "log.h"
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+    #include <libavutil/pixdesc.h>
+}
+
+#include <tracy/Tracy.hpp>
+
+void boxDownscale(const uint8_t* source, int sourceLinesize, int sourceWidth, int sourceHeight, uint8_t* destination, int destinationLinesize,
+    int width, int height) {
+    ZoneScoped;
+
+    // Column sums of the source rows under the current destination row.
+    thread_local std::vector<uint32_t> sums;
+    sums.resize(sourceWidth);
+
+    for (int y = 0; y < height; ++y) {
+        const int top = y * sourceHeight / height;
+        const int bottom = std::max(top + 1, (y + 1) * sourceHeight / height);
+
+        std::fill(sums.begin(), sums.end(), 0);
+
+        // Simple enough for the compiler to vectorize.
+        for (int row = top; row < bottom; ++row) {
+            const auto* line = source + static_cast<size_t>(row) * sourceLinesize;
+
+            for (int x = 0; x < sourceWidth; ++x) {
+                sums[x] += line[x];
+            }
+        }
+
+        auto* output = destination + static_cast<size_t>(y) * destinationLinesize;
+
+        for (int x = 0; x < width; ++x) {
+            const int left = x * sourceWidth / width;
+            const int right = std::max(left + 1, (x + 1) * sourceWidth / width);
+
+            uint32_t total = 0;
+            for (int column = left; column < right; ++column) {
+                total += sums[column];
+            }
+
+            const uint32_t area = static_cast<uint32_t>(right - left) * (bottom - top);
+            output[x] = static_cast<uint8_t>((total + area / 2) / area);
+        }
+    }
+}
+
+ThumbnailSheet::ThumbnailSheet(const std::string& prefix, int tileWidth, int tileHeight, int columns, int rows, int quality)
+    : prefix(prefix), tileWidth(tileWidth & ~1), tileHeight(tileHeight & ~1), columns(columns), rows(rows), quality(quality) {}  // Even tiles keep chroma aligned.
+
+ThumbnailSheet::~ThumbnailSheet() {
+    if (sheet) {
+        freeFrame(&sheet);
+    }
+
+    avcodec_free_context(&encoder);
+
+    if (index) {
+        fclose(index);
+    }
+}
+
+bool ThumbnailSheet::add(const AVFrame* frame, int64_t offsetMs) {
+    ZoneScoped;
+
+    if (failed || (!sheet && !open(frame))) {
+        failed = true;
+        return false;
+    }
+
+    if (frame->format != encoder->pix_fmt) {
+        logWarning("Thumbnail frame format changed, skipped it.");
+        return false;
+    }
+
+    if (av_frame_make_writable(sheet) < 0) {
+        logError("Failed to make thumbnail sheet writable.");
+        return false;
+    }
+
+    const int x = tile % columns * tileWidth;
+    const int y = tile / columns * tileHeight;
+
+    for (int plane = 0; plane < planes; ++plane) {
+        const int shiftX = plane == 0 ? 0 : chromaShiftX;
+        const int shiftY = plane == 0 ? 0 : chromaShiftY;
+
+        auto* destination = sheet->data[plane] + static_cast<size_t>(y >> shiftY) * sheet->linesize[plane] + (x >> shiftX);
+
+        boxDownscale(frame->data[plane], frame->linesize[plane], AV_CEIL_RSHIFT(frame->width, shiftX), AV_CEIL_RSHIFT(frame->height, shiftY),
+            destination, sheet->linesize[plane], tileWidth >> shiftX, tileHeight >> shiftY);
+    }
+
+    fprintf(index, "%lld %s-%03d.jpg %d %d %d %d\n", static_cast<long long>(offsetMs), prefix.substr(prefix.rfind('/') + 1).c_str(), sheetNumber,
+        x, y, tileWidth, tileHeight);
+
+    if (++tile == columns * rows) {
+        return write();
+    }
+
+    return true;
+}
+
+bool ThumbnailSheet::finish() {
+    if (index) {
+        fflush(index);
+
+        // Complete now, the uploader can take it.
+        getManifest().update({ .name = std::filesystem::path{ prefix + ".idx" }.filename().string(), .state = SegmentState::RECORDED });
+    }
+
+    return tile == 0 || write();
+}
+
+bool ThumbnailSheet::open(const AVFrame* frame) {
+    ZoneScoped;
+
+    const auto format = static_cast<AVPixelFormat>(frame->format);
+    const auto* descriptor = av_pix_fmt_desc_get(format);
+
+    // The MJPEG encoder takes planar 4:2:0, 4:2:2 and 4:4:4, which covers what the capture decoder produces.
+    const bool fullRange = format == AV_PIX_FMT_YUVJ420P || format == AV_PIX_FMT_YUVJ422P || format == AV_PIX_FMT_YUVJ444P;
+    const bool limitedRange = format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_YUV422P || format == AV_PIX_FMT_YUV444P;
+    if (!descriptor || (!fullRange && !limitedRange)) {
+        logError("Unsupported thumbnail pixel format '%s', thumbnails are disabled.", av_get_pix_fmt_name(format));
+        return false;
+    }
+
+    planes = 3;
+    chromaShiftX = descriptor->log2_chroma_w;
+    chromaShiftY = descriptor->log2_chroma_h;
+    black = fullRange ? 0 : 16;
+
+    const auto* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        logError("Failed to find the MJPEG encoder, thumbnails are disabled.");
+        return false;
+    }
+
+    encoder = avcodec_alloc_context3(codec);
+    encoder->width = tileWidth * columns;
+    encoder->height = tileHeight * rows;
+    encoder->pix_fmt = format;
+    encoder->color_range = fullRange ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    encoder->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;  // Limited range YUV in a JPEG.
+    encoder->time_base = AVRational{ 1, 1 };
+    encoder->flags |= AV_CODEC_FLAG_QSCALE;
+    encoder->global_quality = quality * FF_QP2LAMBDA;
+    encoder->thread_count = 1;  // Runs on an idle thread anyway, extra threads would only compete with the recording.
+
+    if (auto ret = avcodec_open2(encoder, codec, nullptr); ret < 0) {
+        char buffer[256];
+        logError("Failed to open the thumbnail encoder: %s", av_make_error_string(buffer, sizeof(buffer), ret));
+        return false;
+    }
+
+    sheet = av_frame_alloc();
+    sheet->format = format;
+    sheet->width = encoder->width;
+    sheet->height = encoder->height;
+
+    if (av_frame_get_buffer(sheet, 0) < 0) {
+        logError("Failed to allocate thumbnail sheet.");
+        av_frame_free(&sheet);
+        return false;
+    }
+
+    // Held for the whole segment, so it's not worth holding up the pipeline for.
+    if (!chargeFrame(sheet, MemoryPriority::DROPPABLE)) {
+        logWarning("Over memory budget, thumbnails are disabled for this segment.");
+        return false;
+    }
+
+    // Holds back the sheets of this segment from the uploader too, until the index is complete. Entered before the index exists, so that
+    // the uploader never adopts it half written.
+    const auto indexPath = prefix + ".idx";
+    const auto indexName = std::filesystem::path{ indexPath }.filename().string();
+    getManifest().update({ .name = indexName, .state = SegmentState::RECORDING });
+
+    index = fopen(indexPath.c_str(), "w");
+    if (!index) {
+        logError("Failed to create thumbnail index '%s'.", indexPath.c_str());
+        getManifest().remove(indexName);
+        return false;
+    }
+
+    fprintf(index, "# offset_ms sheet x y width height\n");
+
+    clear();
+
+    return true;
+}
+
+void ThumbnailSheet::clear() {
+    for (int plane = 0; plane < planes; ++plane) {
+        const int height = plane == 0 ? sheet->height : AV_CEIL_RSHIFT(sheet->height, chromaShiftY);
+
+        memset(sheet->data[plane], plane == 0 ? black : 128, static_cast<size_t>(sheet->linesize[plane]) * height);
+    }
+}
+
+bool ThumbnailSheet::write() {
+    ZoneScoped;
+
+    char path[32];
+    snprintf(path, sizeof(path), "-%03d.jpg", sheetNumber);
+    const auto sheetPath = prefix + path;
+
+    tile = 0;
+    sheetNumber++;
+
+    sheet->quality = encoder->global_quality;
+    sheet->pts = sheetNumber;
+
+    auto* packet = av_packet_alloc();
+    bool success = avcodec_send_frame(encoder, sheet) >= 0 && avcodec_receive_packet(encoder, packet) >= 0;
+
+    if (success) {
+        FILE* file = fopen(sheetPath.c_str(), "wb");
+        success = file && fwrite(packet->data, 1, packet->size, file) == static_cast<size_t>(packet->size);
+
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    if (success) {
+        getManifest().update({ .name = std::filesystem::path{ sheetPath }.filename().string(), .state = SegmentState::RECORDED,
+            .size = static_cast<uint64_t>(packet->size) });
+    }
+
+    if (!success) {
+        logError("Failed to write thumbnail sheet '%s'.", sheetPath.c_str());
+    }
+
+    av_packet_free(&packet);
+
+    if (av_frame_make_writable(sheet) >= 0) {
+        clear();
+    }
+
+    return success;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+struct AVFrame;
+struct AVCodecContext;
+
+// Downscales a plane by averaging the block of source pixels under each destination pixel. Cheap, and free of the aliasing a point
+// sample would have at these ratios.
+void boxDownscale(const uint8_t* source, int sourceLinesize, int sourceWidth, int sourceHeight, uint8_t* destination, int destinationLinesize,
+    int width, int height);
+
+// Collects thumbnails into a grid and writes each full grid out as a JPEG sprite sheet, <prefix>-<sheet>.jpg. Every tile gets a line in
+// <prefix>.idx with its time offset into the segment, the sheet it's on and its position, so footage can be browsed without decoding it.
+class ThumbnailSheet {
+public:
+    ThumbnailSheet(const std::string& prefix, int tileWidth, int tileHeight, int columns, int rows, int quality);
+    ~ThumbnailSheet();
+
+    ThumbnailSheet(const ThumbnailSheet&) = delete;
+    ThumbnailSheet& operator=(const ThumbnailSheet&) = delete;
+
+    // Downscales the frame into the next tile, writing out the sheet once it's full. Frames must be planar 8 bit YUV.
+    bool add(const AVFrame* frame, int64_t offsetMs);
+
+    // Writes out the sheet in progress, if it has any tiles.
+    bool finish();
+
+private:
+    bool open(const AVFrame* frame);
+    void clear();
+    bool write();
+
+    std::string prefix;
+    int tileWidth;
+    int tileHeight;
+    int columns;
+    int rows;
+    int quality;
+
+    bool failed = false;  // Set if the sheet can't be set up, every later frame is ignored.
+    AVCodecContext* encoder = nullptr;
+    AVFrame* sheet = nullptr;
+    FILE* index = nullptr;
+    int planes = 0;
+    int chromaShiftX = 0;
+    int chromaShiftY = 0;
+    uint8_t black = 0;
+    int tile = 0;  // Tiles used on the current sheet.
+    int sheetNumber = 0;
+};
@@ -0,0 +1,151 @@
+#include "tuning.h"
+#include "budget.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <tracy/Tracy.hpp>
+
+constexpr double smoothing = 0.25;  // Weight of the newest sample.
+constexpr double jitterDeviations = 3.0;  // Service time tail that a queue should absorb, in standard deviations above the mean.
+constexpr double growBlockedShare = 0.02;  // Writer blocked for this share of the time.
+constexpr double growMemoryPressure = 0.75;  // No growing past this share of the memory budget.
+constexpr double shrinkMemoryPressure = 0.9;
+constexpr int shrinkCalmSamples = 30;  // Samples without blocking before an oversized queue is trimmed.
+constexpr int settleCaptureSamples = 60;  // Samples a capture buffer count has to hold before the encoder is rebuilt with it.
+constexpr int minCaptureBuffers = 4;
+constexpr int captureMargin = 4;  // Capture buffers on top of the frames that arrive during an output stall.
+
+DepthTuner::DepthTuner(const Config& config, int frameRate) : config(config), frameIntervalUs(1000000.0 / std::max(frameRate, 1)),
+    captureBuffers(config.encoderCaptureBuffers) {}
+
+std::vector<size_t> DepthTuner::getDepths(size_t channelCount) {
+    if (channels.size() != channelCount) {
+        const auto depth = static_cast<size_t>(std::min(config.pipelineDepth, config.pipelineMaxDepth));
+
+        channels.assign(channelCount, ChannelState{ .depth = depth });
+        depths.assign(channelCount, depth);
+    }
+
+    // The first sample of a session covers the session only.
+    lastUpdate = std::chrono::steady_clock::now();
+
+    return depths;
+}
+
+const std::vector<size_t>& DepthTuner::update(const std::vector<ChannelSample>& samples) {
+    ZoneScoped;
+
+    const auto now = std::chrono::steady_clock::now();
+    const double intervalUs = std::max<double>(std::chrono::duration_cast<std::chrono::microseconds>(now - lastUpdate).count(), 1.0);
+    lastUpdate = now;
+
+    const auto memory = getMemoryStats();
+    const double memoryPressure = memory.budget > 0 ? static_cast<double>(memory.used) / memory.budget : 0.0;
+    const auto maxDepth = static_cast<size_t>(config.pipelineMaxDepth);
+    const double maxLatencyUs = std::chrono::duration_cast<std::chrono::microseconds>(config.pipelineMaxLatency).count();
+
+    for (size_t i = 0; i < std::min(samples.size(), channels.size()); ++i) {
+        const auto& sample = samples[i];
+        auto& state = channels[i];
+
+        if (sample.items > 0) {
+            if (state.measured) {
+                state.serviceUs += smoothing * (sample.serviceUs - state.serviceUs);
+                state.varianceUs += smoothing * (sample.serviceVarianceUs - state.varianceUs);
+            } else {
+                state.serviceUs = sample.serviceUs;
+                state.varianceUs = sample.serviceVarianceUs;
+                state.measured = true;
+            }
+        }
+
+        if (!state.measured) {
+            continue;
+        }
+
+        // Frames arriving while the stage works through one slow item all have to fit in the queue.
+        const double deviationUs = std::sqrt(state.varianceUs);
+        const double tailUs = state.serviceUs + jitterDeviations * deviationUs;
+        const auto needed = std::clamp<size_t>(static_cast<size_t>(std::ceil(tailUs / frameIntervalUs)), 1, maxDepth);
+
+        const double blockedShare = sample.blockedUs / intervalUs;
+        const double latencyUs = sample.occupancy * std::max(state.serviceUs, frameIntervalUs);
+        const auto depth = state.depth;
+
+        state.calmSamples = sample.blockedUs == 0 ? state.calmSamples + 1 : 0;
+
+        if (memoryPressure > shrinkMemoryPressure && depth > 1) {
+            state.depth = depth - 1;
+            logInfo("Channel to %s shrunk from %zu to %zu: memory is at %.0f%% of the budget.", sample.name, depth, state.depth,
+                memoryPressure * 100.0);
+        } else if (latencyUs > maxLatencyUs && depth > 1) {
+            state.depth = depth - 1;
+            logInfo("Channel to %s shrunk from %zu to %zu: items wait %.0f ms in it, more than the %.0f ms allowed.", sample.name, depth,
+                state.depth, latencyUs / 1000.0, maxLatencyUs / 1000.0);
+        } else if (blockedShare > growBlockedShare && depth < maxDepth && memoryPressure < growMemoryPressure) {
+            if (state.serviceUs < frameIntervalUs) {
+                state.depth = depth + 1;
+                logInfo("Channel to %s grown from %zu to %zu: its writer blocked %.0f%% of the time, %s takes %.1f +- %.1f ms per item "
+                    "against a %.1f ms frame interval.", sample.name, depth, state.depth, blockedShare * 100.0, sample.name,
+                    state.serviceUs / 1000.0, deviationUs / 1000.0, frameIntervalUs / 1000.0);
+            } else {
+                logWarning("%s takes %.1f ms per item, more than the %.1f ms frame interval. A deeper queue won't help, it's overloaded.",
+                    sample.name, state.serviceUs / 1000.0, frameIntervalUs / 1000.0);
+            }
+        } else if (state.calmSamples >= shrinkCalmSamples && depth > needed) {
+            state.depth = depth - 1;
+            logInfo("Channel to %s shrunk from %zu to %zu: its writer hasn't blocked in %d samples, and %s at %.1f +- %.1f ms per item "
+                "needs %zu.", sample.name, depth, state.depth, state.calmSamples, sample.name, state.serviceUs / 1000.0,
+                deviationUs / 1000.0, needed);
+        }
+
+        if (state.depth != depth) {
+            state.calmSamples = 0;
+            depths[i] = state.depth;
+        }
+    }
+
+    // The output is always last, and the encoder's capture buffers hold what it hasn't taken yet.
+    if (!channels.empty()) {
+        updateCaptureBuffers(channels.back(), memoryPressure);
+    }
+
+    return depths;
+}
+
+std::optional<int> DepthTuner::getSettledCaptureBuffers() const {
+    if (captureStableSamples < settleCaptureSamples) {
+        return std::nullopt;
+    }
+
+    return captureBuffers;
+}
+
+void DepthTuner::updateCaptureBuffers(const ChannelState& output, double memoryPressure) {
+    if (!output.measured) {
+        return;
+    }
+
+    ++captureStableSamples;
+
+    const double tailUs = output.serviceUs + jitterDeviations * std::sqrt(output.varianceUs);
+    const int maxBuffers = std::max(config.encoderCaptureBuffers, minCaptureBuffers);
+
+    int target = std::clamp(static_cast<int>(std::ceil(tailUs / frameIntervalUs)) + captureMargin, minCaptureBuffers, maxBuffers);
+    if (memoryPressure > shrinkMemoryPressure) {
+        target = minCaptureBuffers;
+    }
+
+    // Grown right away, shrunk only once the lower count has held for a while, so a brief stall doesn't thrash the value.
+    captureCalmSamples = target < captureBuffers ? captureCalmSamples + 1 : 0;
+    if (target > captureBuffers || (target < captureBuffers && (captureCalmSamples >= shrinkCalmSamples || memoryPressure > shrinkMemoryPressure))) {
+        logInfo("Encoder capture buffers from %d to %d once the count settles: output takes %.1f ms per item at the tail, memory is at %.0f%% "
+            "of the budget.", captureBuffers, target, tailUs / 1000.0, memoryPressure * 100.0);
+
+        captureBuffers = target;
+        captureCalmSamples = 0;
+        captureStableSamples = 0;
+    }
+}
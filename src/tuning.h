@@ -0,0 +1,49 @@
+#pragma once
+
+#include "config.h"
+#include "pipeline.h"
+
+#include <cstddef>
+#include <chrono>
+#include <optional>
+#include <vector>
+
+// Tunes the channel capacities between pipeline stages and the encoder's capture buffers from measured service times. The right values
+// differ between a cool CM4, a throttled one and a desktop, and drift as the board heats up, so they're found while recording.
+// A channel grows when its writer blocks while the stage it feeds keeps up on average, which means the queue is too shallow to absorb
+// that stage's jitter. It shrinks when memory runs short, when items sit in it too long, or when it has been deeper than the jitter
+// needs for a while. Every change is logged with its reason.
+class DepthTuner {
+public:
+    DepthTuner(const Config& config, int frameRate);
+
+    // Capacities for a new session, one per channel. Later sessions carry on from the values found so far.
+    std::vector<size_t> getDepths(size_t channelCount);
+
+    // Takes one sample per channel, about once a second. Returns the capacity each channel should have now.
+    const std::vector<size_t>& update(const std::vector<ChannelSample>& samples);
+
+    // Capture buffers for the encoder, once the count has held for a while. Changing it means rebuilding the encoder at the next segment,
+    // so it's only worth doing for a value that has settled.
+    std::optional<int> getSettledCaptureBuffers() const;
+
+private:
+    struct ChannelState {
+        size_t depth = 0;
+        bool measured = false;
+        double serviceUs = 0.0;  // Smoothed over samples.
+        double varianceUs = 0.0;
+        int calmSamples = 0;  // Consecutive samples in which the writer never blocked.
+    };
+
+    void updateCaptureBuffers(const ChannelState& output, double memoryPressure);
+
+    const Config& config;
+    double frameIntervalUs;
+    std::vector<ChannelState> channels{};
+    std::vector<size_t> depths{};
+    int captureBuffers;
+    int captureCalmSamples = 0;
+    int captureStableSamples = 0;  // Samples since the count last changed.
+    std::chrono::steady_clock::time_point lastUpdate = std::chrono::steady_clock::now();
+};
@@ -1,70 +1,499 @@
 #include "upload.h"
 #include "storage.h"
 #include "status.h"
+#include "config.h"
+#include "http.h"
+#include "manifest.h"
+#include "throttle.h"
+#include "schedule.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <set>
+#include <map>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
 #include <cstdio>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <tracy/Tracy.hpp>
 
-int uploadMedia() {
+// Resumable upload protocol, see python/upload_server.py for a local stand-in:
+//   POST <upload.url> with Upload-Length, Upload-Name and Upload-Checksum creates a session, returned in the Location header.
+//   PUT <session> with Content-Range stores a chunk. Chunks are independent, so they can be sent in any order and in parallel.
+//   POST <session> with Upload-Complete: 1 finishes the upload, once every chunk has been stored and the CRC-32 matches.
+// A session the server no longer knows (404 or 410) is started over.
+
+// Progress of a single file. Persisted as an append-only text file, one acknowledged chunk per line, so a torn write after a power loss
+// costs at most the last chunk.
+struct UploadProgress {
+    std::string session{};
+    size_t length = 0;
+    size_t chunkSize = 0;
+    std::vector<bool> done{};
+};
+
+std::filesystem::path getProgressPath(const std::filesystem::path& path) {
+    return path.string() + uploadProgressSuffix;
+}
+
+// Returns false if there's no usable progress for the file as it is now.
+bool loadProgress(const std::filesystem::path& path, size_t length, size_t chunkSize, UploadProgress& progress) {
+    std::ifstream file{ getProgressPath(path) };
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields{ line };
+        std::string key;
+        fields >> key;
+
+        if (key == "session") {
+            fields >> progress.session;
+        } else if (key == "length") {
+            fields >> progress.length >> progress.chunkSize;
+
+            if (progress.length != length || progress.chunkSize != chunkSize) {
+                return false;
+            }
+
+            progress.done.assign((length + chunkSize - 1) / chunkSize, false);
+        } else if (key == "chunk") {
+            size_t chunk;
+            if (fields >> chunk && chunk < progress.done.size()) {
+                progress.done[chunk] = true;
+            }
+        }
+    }
+
+    return !progress.session.empty() && progress.chunkSize > 0;
+}
+
+std::string formatChecksum(uint32_t checksum) {
+    char text[16];
+    snprintf(text, sizeof(text), "crc32=%08x", checksum);
+
+    return text;
+}
+
+std::string getContentType(const std::filesystem::path& path) {
+    static const std::map<std::string, std::string> types{
+        { ".mp4", "video/mp4" },
+        { ".h264", "video/h264" },
+        { ".jpg", "image/jpeg" },
+        { ".idx", "text/plain" }
+    };
+
+    if (auto type = types.find(path.extension().string()); type != types.end()) {
+        return type->second;
+    }
+
+    return "application/octet-stream";
+}
+
+// Value of the Authorization header, empty for none. Refresh discards the cached value after the server rejected it.
+std::string getAuthorization(bool refresh) {
+    static std::mutex lock;
+    static std::string cached;
+    static bool loaded = false;
+
+    const auto& config = getConfig();
+    std::scoped_lock scopeLock{ lock };
+
+    if (loaded && !refresh) {
+        return cached;
+    }
+
+    loaded = true;
+    cached.clear();
+
+    switch (config.uploadAuth) {
+        case UploadAuth::BEARER: {
+            std::ifstream file{ config.uploadTokenFile };
+            std::string token;
+
+            if (!(file >> token)) {
+                std::cerr << "Failed to read upload token from '" << config.uploadTokenFile << "'.\n";
+                break;
+            }
+
+            cached = "Bearer " + token;
+            break;
+        }
+        case UploadAuth::COMMAND: {
+            std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(config.uploadAuthCommand.c_str(), "r"), pclose);
+            if (!pipe) {
+                std::cerr << "Failed to launch upload auth command.\n";
+                break;
+            }
+
+            std::array<char, 4096> buffer;
+            if (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
+                cached = buffer.data();
+                cached.erase(cached.find_last_not_of("\r\n") + 1);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    return cached;
+}
+
+HttpHeaders withAuthorization(HttpHeaders headers, bool refresh = false) {
+    if (auto authorization = getAuthorization(refresh); !authorization.empty()) {
+        headers.emplace_back("Authorization", authorization);
+    }
+
+    return headers;
+}
+
+bool createSession(HttpConnection& connection, const Url& server, const std::filesystem::path& path, size_t length, uint32_t checksum,
+    std::string& session) {
+    ZoneScoped;
+
+    HttpResponse response;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const auto headers = withAuthorization({
+            { "Upload-Length", std::to_string(length) },
+            { "Upload-Name", path.filename().string() },
+            { "Upload-Checksum", formatChecksum(checksum) },
+            { "Content-Type", getContentType(path) }
+        }, attempt > 0);
+
+        if (!connection.request("POST", server.target, headers, {}, response)) {
+            return false;
+        }
+
+        if (response.status != 401) {
+            break;
+        }
+    }
+
+    if (response.status < 200 || response.status >= 300 || response.header("location").empty()) {
+        std::cerr << "Failed to create upload session: HTTP " << response.status << "\n";
+        return false;
+    }
+
+    session = response.header("location");
+
+    return true;
+}
+
+// Uploads a file with the resumable protocol. On failure the progress is kept, and the next attempt only sends what's missing.
+bool uploadResumable(const std::filesystem::path& path, uint32_t checksum) {
+    ZoneScoped;
+
+    const auto& config = getConfig();
+
+    Url server;
+    if (!parseUrl(config.uploadUrl, server)) {
+        std::cerr << "Invalid upload URL '" << config.uploadUrl << "'.\n";
+        return false;
+    }
+
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << " for upload.\n";
+        return false;
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    const size_t length = info.st_size;
+    const size_t chunkSize = config.uploadChunkSize;
+
+    UploadProgress progress;
+    if (!loadProgress(path, length, chunkSize, progress)) {
+        HttpConnection connection{ server, config.uploadTimeout };
+
+        progress = UploadProgress{};
+        if (!createSession(connection, server, path, length, checksum, progress.session)) {
+            close(fd);
+            return false;
+        }
+
+        progress.length = length;
+        progress.chunkSize = chunkSize;
+        progress.done.assign((length + chunkSize - 1) / chunkSize, false);
+
+        std::ofstream file{ getProgressPath(path), std::ios::trunc };
+        file << "session " << progress.session << "\n" << "length " << length << " " << chunkSize << "\n";
+    } else {
+        std::cout << "Resuming upload, " << std::count(progress.done.begin(), progress.done.end(), true) << " of " << progress.done.size()
+            << " chunks already sent.\n";
+    }
+
+    Url session;
+    if (!parseUrl(progress.session, session, &server)) {
+        std::cerr << "Invalid upload session '" << progress.session << "'.\n";
+        std::filesystem::remove(getProgressPath(path));
+        close(fd);
+        return false;
+    }
+
+    std::vector<size_t> pending;
+    for (size_t chunk = 0; chunk < progress.done.size(); ++chunk) {
+        if (!progress.done[chunk]) {
+            pending.push_back(chunk);
+        }
+    }
+
+    FILE* progressFile = fopen(getProgressPath(path).c_str(), "a");
+    std::mutex progressLock;
+    std::atomic<size_t> nextChunk = 0;
+    std::atomic<bool> failed = false;
+    std::atomic<bool> expired = false;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // Each worker keeps its own connection alive across chunks and pulls the next missing chunk until none are left.
+    auto worker = [&] {
+        HttpConnection connection{ session, config.uploadTimeout };
+
+        for (size_t index; !failed && (index = nextChunk.fetch_add(1)) < pending.size();) {
+            const auto chunk = pending[index];
+            const size_t offset = chunk * chunkSize;
+            const size_t size = std::min(chunkSize, length - offset);
+
+            const auto range = "bytes " + std::to_string(offset) + "-" + std::to_string(offset + size - 1) + "/" + std::to_string(length);
+
+            bool sent = false;
+            bool refresh = false;
+            auto backoff = std::chrono::milliseconds{ 500 };
+
+            for (int attempt = 0; attempt < config.uploadRetries && !sent && !failed; ++attempt) {
+                ZoneScopedN("upload_chunk");
+
+                HttpResponse response;
+                const auto headers = withAuthorization({ { "Content-Range", range }, { "Content-Type", "application/octet-stream" } }, refresh);
+
+                if (connection.request("PUT", session.target, headers, HttpBody{ nullptr, fd, static_cast<off_t>(offset), size, &getUploadThrottle().getBandwidth() }, response)) {
+                    if (response.status >= 200 && response.status < 300) {
+                        sent = true;
+                        break;
+                    }
+
+                    if (response.status == 404 || response.status == 410) {
+                        expired = true;
+                        failed = true;
+                        break;
+                    }
+
+                    // Authorization may have expired, anything else in the 4xx range won't get better with a retry.
+                    refresh = response.status == 401;
+                    if (response.status >= 400 && response.status < 500 && !refresh && response.status != 408 && response.status != 429) {
+                        std::cerr << "Upload chunk rejected: HTTP " << response.status << "\n";
+                        break;
+                    }
+                }
+
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, std::chrono::milliseconds{ 30000 });
+            }
+
+            if (!sent) {
+                failed = true;
+                break;
+            }
+
+            std::scoped_lock scopeLock{ progressLock };
+            if (progressFile) {
+                fprintf(progressFile, "chunk %zu\n", chunk);
+                fflush(progressFile);
+                fdatasync(fileno(progressFile));
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    const auto workerCount = std::min<size_t>(config.uploadConnections, pending.size());
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    if (progressFile) {
+        fclose(progressFile);
+    }
+
+    close(fd);
+
+    if (expired) {
+        std::cerr << "Upload session expired, starting over next time.\n";
+        std::filesystem::remove(getProgressPath(path));
+        return false;
+    }
+
+    if (failed) {
+        std::cerr << "Upload interrupted, progress kept for the next attempt.\n";
+        return false;
+    }
+
+    HttpConnection connection{ session, config.uploadTimeout };
+    HttpResponse response;
+    if (!connection.request("POST", session.target, withAuthorization({ { "Upload-Complete", "1" } }), {}, response)
+        || response.status < 200 || response.status >= 300) {
+        std::cerr << "Failed to complete upload: HTTP " << response.status << "\n";
+
+        // Gone, or the server found the assembled file doesn't match the checksum. Either way it has to be sent again.
+        if (response.status == 404 || response.status == 410 || response.status == 422) {
+            std::filesystem::remove(getProgressPath(path));
+        }
+
+        return false;
+    }
+
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const auto sentBytes = std::min(length, pending.size() * chunkSize);
+    std::cout << "Uploaded " << sentBytes / (1024.0 * 1024.0) << " MB in " << seconds << " s (" << sentBytes / (1024.0 * 1024.0) / std::max(seconds, 0.001)
+        << " MB/s) over " << workerCount << " connections.\n";
+
+    std::filesystem::remove(getProgressPath(path));
+
+    return true;
+}
+
+// Uploads with the native uploader if an upload URL is configured, and the Google Drive script otherwise.
+bool uploadFile(const std::filesystem::path& path, uint32_t checksum) {
+    if (!getConfig().uploadUrl.empty()) {
+        return uploadResumable(path, checksum);
+    }
+
+    const auto uploadCommand = "./python/upload.py --file " + path.string();
+    if (auto returnCode = runThrottled(uploadCommand); returnCode != 0) {
+        std::cerr << "Upload script failed! Code: " << returnCode << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+int uploadMedia(bool recording) {
     ZoneScoped;
 
-    // Find all clips and upload them to the remote storage.
+    // A dropped connection must fail the request, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    // The caps only apply while there's a recorder to protect, at boot everything runs at full speed.
+    getUploadThrottle().setEnabled(recording);
+
+    auto& manifest = getManifest();
+    manifest.reconcile();
+
+    // Find all clips and upload them to the remote storage, most important first.
     // TODO: Pipeline conversion and uploading to greatly speed this up.
     int failures = 0;
 
-    for (const auto& entry : std::filesystem::directory_iterator{ storageLocation }) {
-        std::cout << "Converting " << entry << " to MP4...\n";
+    for (auto entry : manifest.getPending(getConfig().uploadOrder)) {
+        ZoneScopedN("upload_file");
+        ZoneText(entry.name.c_str(), entry.name.size());
+
         ++failures;
 
-        setState(DashcamState::CONVERTING);
+        const auto source = std::filesystem::path{ storageLocation } / entry.name;
 
-        const auto convertCommand = "./python/convert.py --file " + entry.path().string() + " --dest " + storageLocation;
-        auto returnCode = system(convertCommand.c_str());
+        // Files adopted from a crash or from before the manifest existed are checksummed once, here.
+        if (!entry.checksum) {
+            if (entry.checksum = checksumFile(source); !entry.checksum) {
+                std::cerr << "Failed to read " << source << "!\n";
+                continue;
+            }
 
-        std::array<char, 128> convertBuffer;
-        std::string convertStdout;
-        std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(convertCommand.c_str(), "r"), pclose);
-        if (!pipe) {
-            std::cerr << "Failed to launch conversion subprocess!\n";
-            continue;
+            manifest.update(entry);
         }
 
-        while (fgets(convertBuffer.data(), convertBuffer.size(), pipe.get()) != nullptr) {
-            convertStdout += convertBuffer.data();
+        auto uploadPath = source;
+        auto uploadChecksum = *entry.checksum;
+
+        // The main segment's raw video is converted to MP4 first, everything else is uploaded as it is. That includes the proxy, which
+        // convert.py would re-encode at the main stream's frame rate and bitrate, undoing what makes it small.
+        if (entry.name == getSegmentStem(entry.name) + segmentSuffix) {
+            if (entry.state == SegmentState::RECORDED) {
+                std::cout << "Converting " << source << " to MP4...\n";
+                if (!recording) {
+                    setState(DashcamState::CONVERTING);
+                }
+
+                const auto convertCommand = "./python/convert.py --file " + source.string() + " --dest " + storageLocation;
+
+                ZoneScopedN("upload_convert");
+
+                std::string convertStdout;
+                if (auto returnCode = runThrottled(convertCommand, &convertStdout); returnCode != 0) {
+                    std::cerr << "Failed to convert! Code: " << returnCode << "\n";
+                    continue;
+                }
+
+                convertStdout.erase(convertStdout.find_last_not_of("\r\n") + 1);
+
+                const auto converted = std::filesystem::path{ convertStdout }.filename();
+                const auto convertedChecksum = checksumFile(std::filesystem::path{ storageLocation } / converted);
+                if (!convertedChecksum) {
+                    std::cerr << "Failed to read converted file '" << converted << "'!\n";
+                    continue;
+                }
+
+                // The source is kept until the upload succeeds.
+                entry.state = SegmentState::CONVERTED;
+                entry.converted = converted.string();
+                entry.convertedChecksum = *convertedChecksum;
+                manifest.update(entry);
+            }
+
+            uploadPath = std::filesystem::path{ storageLocation } / entry.converted;
+            uploadChecksum = entry.convertedChecksum;
         }
 
-        if (returnCode != 0) {
-            std::cerr << "Failed to convert! Code: " << returnCode << "\n";
-            continue;
+        std::cout << "Uploading " << uploadPath << (entry.isProtected ? " (protected)" : "") << "...\n";
+        if (!recording) {
+            setState(DashcamState::UPLOADING);
         }
 
-        // Delete the source clip.
-        if (!std::filesystem::remove(entry.path())) {
-            std::cerr << "Failed to delete source file!\n";
+        if (!uploadFile(uploadPath, uploadChecksum)) {
+            std::cerr << "Failed to upload!\n";
             continue;
         }
 
-        std::cout << "Uploading...\n";
-        setState(DashcamState::UPLOADING);
-
-        auto convertedPath = std::filesystem::path(convertStdout);
-        convertedPath.replace_extension(".mp4");
-        const auto uploadCommand = "./python/upload.py --file " + convertedPath.string();
-        returnCode = system(uploadCommand.c_str());
+        // Recorded before anything is deleted, so an interruption from here on only leaves cleanup for the next run.
+        entry.state = SegmentState::UPLOADED;
+        manifest.update(entry);
+        manifest.sync();
 
-        if (returnCode != 0) {
-            std::cerr << "Failed to upload! Code: " << returnCode << "\n";
-            continue;
+        std::error_code error;
+        std::filesystem::remove(source, error);
+        if (!entry.converted.empty()) {
+            std::filesystem::remove(std::filesystem::path{ storageLocation } / entry.converted, error);
         }
 
-        // Delete the converted clip.
-        if (!std::filesystem::remove(convertedPath)) {
-            std::cerr << "Failed to delete converted file!\n";
-            continue;
+        manifest.remove(entry.name);
+
+        // The marker is no longer needed once nothing of the segment is left.
+        if (entry.isProtected) {
+            const auto stem = getSegmentStem(entry.name);
+            const auto remaining = std::count_if(std::filesystem::directory_iterator{ storageLocation }, {}, [&](const auto& file) {
+                return getSegmentStem(file.path()) == stem && file.path().extension() != protectSuffix;
+            });
+
+            if (remaining == 0) {
+                std::filesystem::remove(std::filesystem::path{ storageLocation } / (stem + protectSuffix), error);
+            }
         }
 
         --failures;
@@ -73,3 +502,33 @@ int uploadMedia() {
 
     return failures;
 }
+
+void uploadContinuously(bool (*connected)()) {
+    ZoneScoped;
+
+    applySchedule(Stage::UPLOAD);
+
+    const auto& config = getConfig();
+    auto& throttle = getUploadThrottle();
+
+    // Follows the recorder's health for as long as the process runs, uploading or not, so the caps are current when a window opens.
+    std::thread controller{ [&throttle] {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds{ 1 });
+            throttle.update();
+        }
+    } };
+    controller.detach();
+
+    while (true) {
+        if (connected()) {
+            std::cout << "Operator connected, uploading alongside recording.\n";
+
+            if (auto failures = uploadMedia(true); failures > 0) {
+                std::cerr << failures << " uploads failed, retrying on the next pass.\n";
+            }
+        }
+
+        std::this_thread::sleep_for(config.uploadPollInterval);
+    }
+}
@@ -1,3 +1,8 @@
 #pragma once
 
-int uploadMedia();
+// Uploads everything pending in the manifest. While recording, the state light is left to the recorder and the work is throttled to
+// protect it. Returns the number of failed files.
+int uploadMedia(bool recording = false);
+
+// Uploads in the background for the life of the process, whenever connected() reports a connection. Runs on the calling thread.
+void uploadContinuously(bool (*connected)());
@@ -1,6 +1,11 @@
 #include "video.h"
+#include "config.h"
+#include "budget.h"
+#include "segment.h"
+#include "faults.h"
 
 #include <iostream>
+#include <atomic>
 
 extern "C"
 {
@@ -18,18 +23,14 @@ extern "C"
 
 #include <tracy/Tracy.hpp>
 
-bool setupInput(AVFormatContext** input, int frameRate) {
-    ZoneScoped;
+constexpr const char* deviceName = "/dev/video0";
 
-    auto deviceName = "/dev/video0";
+std::atomic<int> encoderCaptureBuffers{ 0 };
+std::atomic<int64_t> encoderBitRate{ 0 };
+std::atomic<int64_t> builtEncoderBitRate{ 0 };
 
-    // Configure the device to be in the correct format. FFmpeg doesn't always configure it properly without this.
-    auto v4l2CommandBase = std::string{ "v4l2-ctl --device=" } + deviceName;
-    auto v4l2Set = v4l2CommandBase + " --set-fmt-video=width=1920,height=1080,pixelformat=MJPG";  // Use MJPG compression for high framerate and high resolution.
-    auto v4l2Get = v4l2CommandBase + " --get-fmt-video";
-
-    system(v4l2Set.c_str());
-    system(v4l2Get.c_str());
+bool openInputDevice(AVFormatContext** input) {
+    ZoneScoped;
 
     auto* inputFormat = av_find_input_format("v4l2");  // Capturing from a v4l2 device
     AVDictionary* options = nullptr;
@@ -41,12 +42,33 @@ bool setupInput(AVFormatContext** input, int frameRate) {
     //av_dict_set(&options, "framerate", std::to_string(frameRate).c_str(), 0);
 
     *input = nullptr;
-    if (auto ret = avformat_open_input(input, deviceName, inputFormat, &options); ret != 0) {
+    auto ret = avformat_open_input(input, deviceName, inputFormat, &options);
+    av_dict_free(&options);
+
+    if (ret != 0) {
         char buffer[256];
         std::cerr << "Failed to open input device: error: " << av_make_error_string(buffer, sizeof(buffer), ret) << "\n";
         return false;
     }
 
+    return true;
+}
+
+bool setupInput(AVFormatContext** input, int frameRate) {
+    ZoneScoped;
+
+    // Configure the device to be in the correct format. FFmpeg doesn't always configure it properly without this.
+    auto v4l2CommandBase = std::string{ "v4l2-ctl --device=" } + deviceName;
+    auto v4l2Set = v4l2CommandBase + " --set-fmt-video=width=1920,height=1080,pixelformat=MJPG";  // Use MJPG compression for high framerate and high resolution.
+    auto v4l2Get = v4l2CommandBase + " --get-fmt-video";
+
+    system(v4l2Set.c_str());
+    system(v4l2Get.c_str());
+
+    if (!openInputDevice(input)) {
+        return false;
+    }
+
     if (avformat_find_stream_info(*input, nullptr) < 0) {
         std::cerr << "Failed to find stream info for input context.\n";
         return false;
@@ -55,7 +77,22 @@ bool setupInput(AVFormatContext** input, int frameRate) {
     return true;
 }
 
-bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext) {
+bool reopenInput(AVFormatContext** input) {
+    ZoneScoped;
+
+    // The v4l2 demuxer sets the format and creates its stream when opened, probing is only needed to set up the decoder in the first place.
+    avformat_close_input(input);
+
+#if FAULT_INJECTION
+    if (simulatingCapture()) {
+        return openFakeCapture(input);
+    }
+#endif
+
+    return openInputDevice(input);
+}
+
+bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext, int threadCount) {
     ZoneScoped;
 
     // Find the video stream.
@@ -105,7 +142,7 @@ bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext) {
     std::cout << "Decoder pixel format is: " << dec->pix_fmt << "\n";
 
     // Try to enable multithreading, if supported by the codec.
-    dec->thread_count = 0;
+    dec->thread_count = threadCount;
 
     if (decCodec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
         std::cout << "Decoder multithreading with frame threads.\n";
@@ -118,83 +155,157 @@ bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext) {
         dec->thread_count = 1;  // Force single thread.
     }
 
+#ifdef TRACY_ENABLE
+    // Carries the capture number from each packet to its frame, see profile.h.
+    dec->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+#endif
+
     if (avcodec_open2(dec, decCodec, nullptr) < 0) {
         std::cerr << "Failed to open the decoding codec.\n";
         return false;
     }
 
     std::cout << "Decode HW accel status: " << (dec->hwaccel ? "ENABLED" : "DISABLED/UNKNOWN") << "\n";
+    std::cout << "Decoder is using " << dec->thread_count << " threads.\n";
 
     *decoder = dec;
 
     return true;
 }
 
+// Estimate of the driver buffers held by the encoder. Output buffers hold raw frames, capture buffers hold compressed frames.
+size_t encoderMemory(const AVCodecContext* encoder) {
+    // The driver sizes capture buffers itself, this is a conservative bound for a 1080p H.264 frame.
+    constexpr size_t captureBufferSize = 1024ULL * 1024ULL;
+
+    // Read back from the encoder, so that what's released matches what was reserved even if the count changed since.
+    int64_t outputBuffers = 0;
+    int64_t captureBuffers = 0;
+    av_opt_get_int(encoder->priv_data, "num_output_buffers", 0, &outputBuffers);
+    av_opt_get_int(encoder->priv_data, "num_capture_buffers", 0, &captureBuffers);
+
+    const size_t rawFrameSize = av_image_get_buffer_size(encoder->pix_fmt, encoder->width, encoder->height, 1);
+
+    return outputBuffers * rawFrameSize + captureBuffers * captureBufferSize;
+}
+
+void setEncoderBitRate(int64_t bitRate) {
+    encoderBitRate.store(bitRate, std::memory_order_relaxed);
+}
+
+int64_t getEncoderBitRate() {
+    const auto bitRate = encoderBitRate.load(std::memory_order_relaxed);
+
+    return bitRate > 0 ? bitRate : getConfig().encoderBitRate;
+}
+
+int64_t getBuiltEncoderBitRate() {
+    return builtEncoderBitRate.load(std::memory_order_relaxed);
+}
+
+void setEncoderCaptureBuffers(int count) {
+    encoderCaptureBuffers.store(count, std::memory_order_relaxed);
+}
+
+int getEncoderCaptureBuffers() {
+    const auto count = encoderCaptureBuffers.load(std::memory_order_relaxed);
+
+    return count > 0 ? count : getConfig().encoderCaptureBuffers;
+}
+
 bool setupEncoder(AVCodecContext** encoder, int frameRate) {
     ZoneScoped;
 
-    // Note: if this changes to MPEG1 or MPEG2, we need to write a special endcode.
-    auto encCodec = avcodec_find_encoder_by_name("h264_v4l2m2m");  // Can use AV_CODEC_ID_H264 for the SW encoder.
-    if (!encCodec) {
-        std::cerr << "Failed to find a suitable encoder.\n";
-        return false;
-    }
+    // Fault scenarios also run on machines without the hardware encoder, where the software encoder stands in for it.
+#if FAULT_INJECTION
+    const auto encoderNames = { "h264_v4l2m2m", "libx264" };
+#else
+    const auto encoderNames = { "h264_v4l2m2m" };
+#endif
 
-    std::cout << "Found encoder " << encCodec->long_name << "\n";
+    const AVCodec* encCodec = nullptr;
+    AVCodecContext* enc = nullptr;
 
-    auto enc = avcodec_alloc_context3(encCodec);
-    if (!enc) {
-        std::cerr << "Failed to allocate encoder context.\n";
-        return false;
+    for (const auto* name : encoderNames) {
+        // Note: if this changes to MPEG1 or MPEG2, we need to write a special endcode.
+        encCodec = avcodec_find_encoder_by_name(name);
+        if (!encCodec) {
+            std::cerr << "Failed to find encoder " << name << "\n";
+            continue;
+        }
+
+        std::cout << "Found encoder " << encCodec->long_name << "\n";
+
+        enc = avcodec_alloc_context3(encCodec);
+        if (!enc) {
+            std::cerr << "Failed to allocate encoder context.\n";
+            return false;
+        }
+
+        enc->width = 1920;
+        enc->height = 1080;
+        enc->bit_rate = getEncoderBitRate();
+        enc->compression_level = 0;
+        enc->time_base = (AVRational){ 1, frameRate };
+        enc->framerate = (AVRational){ frameRate, 1 };
+        enc->pix_fmt = AV_PIX_FMT_YUV420P;  // v4l2m2m encoder requires this pixel format, it cannot encode with YUYV422.
+        enc->gop_size = alignGopSize(10, frameRate, getConfig());  // https://github.com/FFmpeg/FFmpeg/blob/3d5edb89e75fe3ab3a6757208ef121fa2b0f54c7/doc/examples/encode_video.c#L119
+        enc->max_b_frames = 1;  // See above
+        enc->thread_count = getConfig().encoderThreads;
+        // TODO: CRF might be unused by v4l2m2m encoder!
+        av_opt_set(enc, "crf", "17", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#a1.ChooseaCRFvalue
+        av_opt_set(enc, "preset", "veryfast", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#Preset
+        av_opt_set(enc, "tune", "zerolatency", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#Tune
+        av_opt_set(enc, "bufsize", "1000000", 0);
+
+        // The driver allocates these buffers, so they're invisible to the pipeline. Size them explicitly and reserve them against the memory budget.
+        // These are private options of the encoder, so they have to be searched for in its private context.
+        const auto& config = getConfig();
+        av_opt_set_int(enc, "num_output_buffers", config.encoderOutputBuffers, AV_OPT_SEARCH_CHILDREN);
+        av_opt_set_int(enc, "num_capture_buffers", getEncoderCaptureBuffers(), AV_OPT_SEARCH_CHILDREN);
+
+        if (avcodec_open2(enc, encCodec, nullptr) == 0) {
+            break;
+        }
+
+        std::cerr << "Failed to open encoder " << name << "\n";
+        avcodec_free_context(&enc);
     }
 
-    enc->width = 1920;
-    enc->height = 1080;
-    enc->bit_rate = 200000000;  // 200kb/s
-    enc->compression_level = 0;
-    enc->time_base = (AVRational){ 1, frameRate };
-    enc->framerate = (AVRational){ frameRate, 1 };
-    enc->pix_fmt = AV_PIX_FMT_YUV420P;  // v4l2m2m encoder requires this pixel format, it cannot encode with YUYV422.
-    enc->gop_size = 10;  // https://github.com/FFmpeg/FFmpeg/blob/3d5edb89e75fe3ab3a6757208ef121fa2b0f54c7/doc/examples/encode_video.c#L119
-    enc->max_b_frames = 1;  // See above
-    // TODO: CRF might be unused by v4l2m2m encoder!
-    av_opt_set(enc, "crf", "17", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#a1.ChooseaCRFvalue
-    av_opt_set(enc, "preset", "veryfast", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#Preset
-    av_opt_set(enc, "tune", "zerolatency", 0);  // https://trac.ffmpeg.org/wiki/Encode/H.264#Tune
-    av_opt_set(enc, "bufsize", "1000000", 0);
-
-    // #TEMP: testing with pipelined execution
-    av_opt_set(enc, "num_capture_buffers", "64", 0);
-
-    if (avcodec_open2(enc, encCodec, nullptr) < 0) {
-        std::cerr << "Failed to open the encoding codec.";
+    if (!enc) {
         return false;
     }
 
+    acquireMemory(MemoryPool::CODEC, encoderMemory(enc), MemoryPriority::CRITICAL);
+
     std::cout << "Encode HW accel status: " << (enc->hwaccel ? "ENABLED" : "DISABLED/UNKNOWN") << "\n";
+    std::cout << "Encoder is using " << enc->thread_count << " threads.\n";
 
     *encoder = enc;
+    builtEncoderBitRate.store(enc->bit_rate, std::memory_order_relaxed);
 
     return true;
 }
 
-bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, AVCodecContext* encoder) {
+void freeEncoder(AVCodecContext** encoder) {
+    ZoneScoped;
 
+    if (*encoder) {
+        releaseMemory(MemoryPool::CODEC, encoderMemory(*encoder));
+        avcodec_free_context(encoder);
+    }
+}
+
+// Builds a graph from a filter description, fed with decoded frames. The description must produce frames the encoder accepts.
+bool buildFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, const char* graphDesc) {
     ZoneScoped;
 
-#if DEFERRED_FILTERING
-    // When deferring filtering, just set the AV points to null and early out.
-    *graph = nullptr;
-    *filterSource = nullptr;
-    *filterSink = nullptr;
-#else
     const AVFilter* bufferSource = avfilter_get_by_name("buffer");
     const AVFilter* bufferSink = avfilter_get_by_name("buffersink");
     AVFilterContext* bufferSourceContext;
     AVFilterContext* bufferSinkContext;
     AVFilterInOut *outputs = avfilter_inout_alloc();
     AVFilterInOut *inputs  = avfilter_inout_alloc();
-    AVRational time_base = encoder->time_base;
 
     AVFilterGraph* grph = avfilter_graph_alloc();
 
@@ -203,6 +314,8 @@ bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVF
         return false;
     }
 
+    grph->nb_threads = getConfig().filterThreads;
+
     // Source filter: do nothing
     char sourceArgs[512];
     snprintf(sourceArgs, sizeof(sourceArgs), "video_size=1920x1080:pix_fmt=%d:time_base=1/30", decoder->pix_fmt);
@@ -235,10 +348,6 @@ bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVF
     inputs->pad_idx = 0;
     inputs->next = NULL;
 
-    // Modify the format to be of the encoder's expected format.
-    char graphDesc[64];
-    snprintf(graphDesc, sizeof(graphDesc), "format=%d", encoder->pix_fmt);
-
     if (avfilter_graph_parse_ptr(grph, graphDesc, &inputs, &outputs, nullptr) < 0) {
         std::cerr << "Failed to parse filter graph string.\n";
         return false;
@@ -252,7 +361,95 @@ bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVF
     *graph = grph;
     *filterSource = bufferSourceContext;
     *filterSink = bufferSinkContext;
+
+    return true;
+}
+
+bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, AVCodecContext* encoder) {
+
+    ZoneScoped;
+
+#if DEFERRED_FILTERING
+    // When deferring filtering, just set the AV points to null and early out.
+    *graph = nullptr;
+    *filterSource = nullptr;
+    *filterSink = nullptr;
+#else
+    // Modify the format to be of the encoder's expected format.
+    char graphDesc[64];
+    snprintf(graphDesc, sizeof(graphDesc), "format=%d", encoder->pix_fmt);
+
+    if (!buildFilterGraph(graph, filterSource, filterSink, decoder, graphDesc)) {
+        return false;
+    }
 #endif
 
     return true;
 }
+
+bool setupProxyEncoder(AVCodecContext** encoder) {
+    ZoneScoped;
+
+    const auto& config = getConfig();
+
+    // The hardware encoder is preferred, but it might not have room for a second stream. Fall back to the software encoder, which is
+    // cheap at proxy resolutions.
+    const AVCodec* encCodec = nullptr;
+    AVCodecContext* enc = nullptr;
+
+    for (const auto* name : { config.proxyEncoder.c_str(), "libx264" }) {
+        encCodec = avcodec_find_encoder_by_name(name);
+        if (!encCodec) {
+            std::cerr << "Failed to find proxy encoder " << name << "\n";
+            continue;
+        }
+
+        enc = avcodec_alloc_context3(encCodec);
+        if (!enc) {
+            std::cerr << "Failed to allocate proxy encoder context.\n";
+            return false;
+        }
+
+        enc->width = config.proxyWidth;
+        enc->height = config.proxyHeight;
+        enc->bit_rate = config.proxyBitRate;
+        enc->time_base = (AVRational){ 1, config.proxyFrameRate };
+        enc->framerate = (AVRational){ config.proxyFrameRate, 1 };
+        enc->pix_fmt = AV_PIX_FMT_YUV420P;
+        enc->gop_size = config.proxyFrameRate * 2;  // Proxies are for scrubbing, so keep seeking cheap.
+        enc->max_b_frames = 0;
+        enc->thread_count = 1;
+        av_opt_set(enc, "preset", "ultrafast", 0);
+        av_opt_set(enc, "tune", "zerolatency", 0);
+
+        if (avcodec_open2(enc, encCodec, nullptr) == 0) {
+            break;
+        }
+
+        std::cerr << "Failed to open proxy encoder " << name << "\n";
+        avcodec_free_context(&enc);
+    }
+
+    if (!enc) {
+        return false;
+    }
+
+    // Reserved like the main encoder's, freeEncoder() releases it for both.
+    acquireMemory(MemoryPool::CODEC, encoderMemory(enc), MemoryPriority::CRITICAL);
+
+    std::cout << "Proxy encoder is " << encCodec->long_name << ", " << enc->width << "x" << enc->height << " at " << config.proxyFrameRate << " fps\n";
+
+    *encoder = enc;
+
+    return true;
+}
+
+bool setupProxyFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, AVCodecContext* encoder) {
+    ZoneScoped;
+
+    // Downscale straight from the decoded frame, this works the same whether or not the main stream defers filtering.
+    char graphDesc[128];
+    snprintf(graphDesc, sizeof(graphDesc), "scale=%d:%d:flags=fast_bilinear,format=%d", encoder->width, encoder->height, encoder->pix_fmt);
+
+    return buildFilterGraph(graph, filterSource, filterSink, decoder, graphDesc);
+}
@@ -1,11 +1,34 @@
 #pragma once
 
+#include <cstdint>
+
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVFilterGraph;
 struct AVFilterContext;
 
 bool setupInput(AVFormatContext** input, int frameRate);
-bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext);
+
+// Closes and opens the capture device again, with the same stream as before. Quick, for recovering from a device fault mid-recording.
+bool reopenInput(AVFormatContext** input);
+// Thread count is passed to FFmpeg, 0 lets it decide.
+bool setupDecoder(AVCodecContext** decoder, AVFormatContext* inputContext, int threadCount);
 bool setupEncoder(AVCodecContext** encoder, int frameRate);
+
+// Target bitrate of the main encoder, set by the retention controller. Read by setupEncoder(), and by the encode stage to retarget a
+// running encoder. Zero goes back to encoder.bitrate_kbps.
+void setEncoderBitRate(int64_t bitRate);
+int64_t getEncoderBitRate();
+
+// Bitrate the running encoder was built with, which the hardware encoder keeps until it's rebuilt. Zero before the first one.
+int64_t getBuiltEncoderBitRate();
+
+// Capture buffers requested by encoders set up from now on, instead of encoder.capture_buffers. Zero goes back to the config.
+void setEncoderCaptureBuffers(int count);
+int getEncoderCaptureBuffers();
+void freeEncoder(AVCodecContext** encoder);
 bool setupFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, AVCodecContext* encoder);
+
+// Low resolution, low frame rate stream recorded alongside the main one, for a quick look at the footage before the full upload.
+bool setupProxyEncoder(AVCodecContext** encoder);
+bool setupProxyFilterGraph(AVFilterGraph** graph, AVFilterContext** filterSource, AVFilterContext** filterSink, AVCodecContext* decoder, AVCodecContext* encoder);
@@ -0,0 +1,186 @@
+#include "writer.h"
+#include "budget.h"
+#include "log.h"
+#include "recovery.h"
+#include "faults.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include <tracy/Tracy.hpp>
+
+BlockWriter::BlockWriter(size_t blockSize, std::chrono::milliseconds deadline) : deadline(deadline) {
+    // Round up to a whole number of pages so that blocks never straddle a page in the page cache.
+    pageSize = sysconf(_SC_PAGESIZE);
+    this->blockSize = (blockSize + pageSize - 1) / pageSize * pageSize;
+
+    if (posix_memalign(reinterpret_cast<void**>(&buffer), pageSize, this->blockSize) != 0) {
+        logError("Failed to allocate write buffer.");
+        buffer = nullptr;
+        return;
+    }
+
+    acquireMemory(MemoryPool::WRITE_BUFFERS, this->blockSize, MemoryPriority::CRITICAL);
+}
+
+BlockWriter::~BlockWriter() {
+    if (buffer) {
+        releaseMemory(MemoryPool::WRITE_BUFFERS, blockSize);
+        free(buffer);
+    }
+}
+
+void BlockWriter::open(int fileDescriptor) {
+    fd = fileDescriptor;
+    used = 0;
+    flushed = 0;
+    blockOffset = 0;
+    unsynced = false;
+}
+
+bool BlockWriter::write(const uint8_t* data, size_t size) {
+    ZoneScoped;
+
+    if (!buffer || fd < 0) {
+        return false;
+    }
+
+    while (size > 0) {
+        // Start the deadline when the first byte that isn't on disk arrives.
+        if (used == flushed) {
+            oldestPending = std::chrono::steady_clock::now();
+        }
+
+        const auto count = std::min(size, blockSize - used);
+        memcpy(buffer + used, data, count);
+        used += count;
+        data += count;
+        size -= count;
+
+        if (used == blockSize) {
+            if (!writeBlock(blockSize)) {
+                return false;
+            }
+
+            blockOffset += blockSize;
+            used = 0;
+            flushed = 0;
+        }
+    }
+
+    return true;
+}
+
+bool BlockWriter::flush() {
+    ZoneScoped;
+
+    if (!buffer || fd < 0) {
+        return true;
+    }
+
+    if (used != flushed) {
+        if (!writeBlock(used)) {
+            return false;
+        }
+
+        flushed = used;
+    }
+
+    // Full blocks are written without a sync, they're covered by this one.
+    if (unsynced) {
+        ZoneScopedN("sync_to_disk");
+
+        if (fdatasync(fd) != 0) {
+            logError("Failed to sync storage: %s", strerror(errno));
+            return false;
+        }
+
+        unsynced = false;
+    }
+
+    return true;
+}
+
+std::chrono::milliseconds BlockWriter::timeUntilDue() const {
+    if (used == flushed) {
+        return std::chrono::milliseconds::max();
+    }
+
+    const auto age = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - oldestPending);
+
+    return std::max(deadline - age, std::chrono::milliseconds{ 0 });
+}
+
+void BlockWriter::report() {
+    uint64_t writes = 0;
+    for (auto count : histogram) {
+        writes += count;
+    }
+
+    // Called from the output thread, so through the log. The histogram takes a single line, the log limits lines per call site.
+    logInfo("Wrote %llu bytes in %llu writes, %llu bytes rewritten by early flushes.", static_cast<unsigned long long>(bytesWritten),
+        static_cast<unsigned long long>(writes), static_cast<unsigned long long>(bytesRewritten));
+
+    std::string sizes;
+    for (size_t i = 0; i < histogramBuckets; ++i) {
+        if (histogram[i] > 0) {
+            sizes += " <= " + std::to_string(4ULL << i) + " KB: " + std::to_string(histogram[i]) + ",";
+        }
+    }
+
+    if (!sizes.empty()) {
+        sizes.pop_back();
+        logInfo("Write sizes:%s", sizes.c_str());
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+    bytesWritten = 0;
+    bytesRewritten = 0;
+}
+
+bool BlockWriter::writeBlock(size_t size) {
+    ZoneScopedN("write_to_disk");
+
+    // What an early flush left on disk is only rewritten from the page it ended in, the pages before it are complete.
+    const size_t start = flushed / pageSize * pageSize;
+
+    size_t written = start;
+    int retries = 0;
+    while (written < size) {
+        const auto result = writeStorage(fd, buffer + written, size - written, blockOffset + written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // SD cards occasionally fail a write they take fine a moment later. Anything more persistent is left to the caller.
+            if ((errno == EIO || errno == EAGAIN || errno == EBUSY) && retries < maxRetries) {
+                logWarning("Failed to write to storage: %s, retrying.", strerror(errno));
+                recordRecovery(RecoveryAction::RETRY_WRITE);
+                std::this_thread::sleep_for(std::chrono::milliseconds{ 10 << retries++ });
+                continue;
+            }
+
+            logError("Failed to write to storage: %s", strerror(errno));
+            return false;
+        }
+
+        written += result;
+    }
+
+    // Bucket by power of two, starting with everything up to 4 KB.
+    size_t bucket = 0;
+    while (bucket < histogramBuckets - 1 && size - start > (4096ULL << bucket)) {
+        ++bucket;
+    }
+
+    histogram[bucket]++;
+    bytesWritten += size - flushed;
+    bytesRewritten += flushed - start;
+    unsynced = true;
+
+    return true;
+}
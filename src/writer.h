@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+// Coalesces small writes into fixed-size blocks before they reach the storage medium. SD cards handle small scattered writes very poorly,
+// so full blocks are always written at block-aligned file offsets. When a partial block has to be flushed early, the next flush rewrites
+// it from the start of the page the previous one ended in rather than appending to it, which keeps every write page aligned without
+// writing the whole block again.
+class BlockWriter {
+public:
+    BlockWriter(size_t blockSize, std::chrono::milliseconds deadline);
+    ~BlockWriter();
+
+    BlockWriter(const BlockWriter&) = delete;
+    BlockWriter& operator=(const BlockWriter&) = delete;
+
+    // Switches to a new file descriptor, starting at offset zero. Anything pending must be flushed first.
+    void open(int fileDescriptor);
+
+    bool write(const uint8_t* data, size_t size);
+
+    // Writes out any pending data and syncs it, so that it survives a power loss. The pending data is kept if the block isn't full, since
+    // its last page will be rewritten with the rest of the block.
+    bool flush();
+
+    // Time until the oldest pending byte reaches the flush deadline. Zero if a flush is due, max if nothing is pending.
+    std::chrono::milliseconds timeUntilDue() const;
+
+    // Reports the write size histogram since the last report.
+    void report();
+
+private:
+    static constexpr int maxRetries = 3;  // For write errors that may be transient, 10, 20 then 40 ms apart.
+
+    // Writes the buffer from the page that holds the first byte not on disk up to size.
+    bool writeBlock(size_t size);
+
+    size_t blockSize;
+    size_t pageSize;
+    std::chrono::milliseconds deadline;
+
+    int fd = -1;
+    uint8_t* buffer = nullptr;
+    size_t used = 0;  // Bytes in the buffer.
+    size_t flushed = 0;  // Bytes in the buffer that are already on disk from an early flush.
+    size_t blockOffset = 0;  // File offset of the start of the buffer.
+    bool unsynced = false;  // Written since the last sync.
+    std::chrono::steady_clock::time_point oldestPending{};
+
+    // Histogram of write sizes, bucketed by powers of two from 4 KB (and below) up.
+    static constexpr size_t histogramBuckets = 12;
+    uint64_t histogram[histogramBuckets]{};
+    uint64_t bytesWritten = 0;
+    uint64_t bytesRewritten = 0;
+};
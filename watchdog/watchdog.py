@@ -3,7 +3,9 @@
 import argparse
 from enum import Enum
 import time
-import socket
+import os
+import mmap
+import struct
 import sys
 import threading
 import RPi.GPIO as gpio
@@ -24,6 +26,7 @@ class DashcamState(Enum):
     FALLING_BEHIND = 4
     CONVERTING = 5
     UPLOADING = 6
+    PARKED = 7
 
 def setLight(parsedArgs, color):
     if color == StatusColors.OFF:
@@ -53,38 +56,116 @@ def setLight(parsedArgs, color):
     else:
         print(f"Unknown color '{color}'", file=sys.stderr)
 
-def watchdogRunner(queue, cv):
-    watchdogPort = 5505
-
-    listener = socket.socket(family=socket.AF_INET, proto=socket.IPPROTO_TCP)
-    listener.bind(("localhost", watchdogPort))
-    listener.listen()
+# Layout of StatusBlock in src/status.h.
+statusPath = "/dev/shm/dashcam-status"
+statusMagic = 0x44534853
+statusVersion = 2
+statusHeader = struct.Struct("=IIII")
+statusHeartbeat = struct.Struct("=Q")
+statusFields = struct.Struct("=QII7Q")
+statusSize = 160
+
+def attachStatus():
+    try:
+        with open(statusPath, "rb") as file:
+            status = mmap.mmap(file.fileno(), statusSize, access=mmap.ACCESS_READ)
+            identity = os.fstat(file.fileno()).st_ino
+    except (OSError, ValueError):
+        return None, None
+
+    magic, version, _, _ = statusHeader.unpack_from(status, 0)
+    if magic != statusMagic or version != statusVersion:
+        status.close()
+        return None, None
+
+    return status, identity
+
+# Returns (pid, heartbeat, state, late frames), or None if no consistent copy could be read.
+def readStatus(status):
+    # Seqlock, an odd sequence means an update is in progress, a changed one that we raced it.
+    for _ in range(1000):
+        _, _, before, pid = statusHeader.unpack_from(status, 0)
+        if before % 2 != 0:
+            continue
+
+        fields = statusFields.unpack_from(status, 24)
+        heartbeat, = statusHeartbeat.unpack_from(status, 16)
+
+        _, _, after, _ = statusHeader.unpack_from(status, 0)
+        if after == before:
+            return pid, heartbeat, DashcamState(fields[1]), fields[4]
+
+    return None
+
+def processAlive(pid):
+    try:
+        os.kill(pid, 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+
+    return True
+
+def watchdogRunner(parsedArgs, queue, cv):
+    status, identity = None, None
+    lastState = None
+    lastHeartbeat = None
+    lastLateFrames = None
+    heartbeatTime = time.monotonic()
 
     # Repeat this loop until the OS shuts down.
     while True:
-        print("Listening for incoming connection...")
-        client, _ = listener.accept()
-        print("Connected!")
+        time.sleep(parsedArgs.poll_interval)
 
+        # The dashcam creates a new segment each time it starts, follow it.
         try:
-            while True:
-                buffer = client.recv(1024).decode()
-                messages = buffer.split(sep="\n")
+            currentIdentity = os.stat(statusPath).st_ino
+        except OSError:
+            currentIdentity = None
+
+        if status is None or currentIdentity != identity:
+            if status is not None:
+                status.close()
+
+            status, identity = attachStatus()
+            lastHeartbeat = None
+            lastLateFrames = None
+
+            if status is None:
+                state = DashcamState.DEAD
+            else:
+                print("Attached to dashcam status.")
 
-                if len(messages) == 0:
-                    continue
+        snapshot = readStatus(status) if status is not None else None
 
-                with cv:
-                    for message in messages:
-                        queue.append(DashcamState(message))
+        if snapshot is None:
+            state = DashcamState.DEAD
+        else:
+            pid, heartbeat, state, lateFrames = snapshot
+            now = time.monotonic()
 
-                    cv.notify_all()
+            if heartbeat != lastHeartbeat:
+                lastHeartbeat = heartbeat
+                heartbeatTime = now
 
-        except BaseException as exception:
-            print(f"Exception thrown: {exception}\nRebooting listener...", file=sys.stderr)
+            # Only recording publishes frames, other states are allowed a still heartbeat.
+            recording = state in (DashcamState.RECORDING, DashcamState.FALLING_BEHIND, DashcamState.PARKED)
+
+            if not processAlive(pid):
+                state = DashcamState.DEAD
+            elif recording and now - heartbeatTime > parsedArgs.stall_timeout:
+                state = DashcamState.ERROR
+            elif state == DashcamState.RECORDING and lastLateFrames is not None and lateFrames != lastLateFrames:
+                state = DashcamState.FALLING_BEHIND
+
+            lastLateFrames = lateFrames
+
+        if state != lastState:
+            lastState = state
 
             with cv:
-                queue.append(DashcamState.DEAD)
+                queue.append(state)
                 cv.notify_all()
 
 def processMessage(parsedArgs, message):
@@ -105,6 +186,8 @@ def processMessage(parsedArgs, message):
         setLight(parsedArgs, StatusColors.GREEN)
     elif message == DashcamState.UPLOADING:
         setLight(parsedArgs, StatusColors.BLUE)
+    elif message == DashcamState.PARKED:
+        setLight(parsedArgs, StatusColors.OFF)
     else:
         print(f"Unknown message '{message}'", file=sys.stderr)
 
@@ -113,6 +196,8 @@ def main():
     parser.add_argument("-r", "--gpio-red", type=int, default=7, required=False)
     parser.add_argument("-g", "--gpio-green", type=int, default=9, required=False)
     parser.add_argument("-b", "--gpio-blue", type=int, default=15, required=False)
+    parser.add_argument("-p", "--poll-interval", type=float, default=0.25, required=False, help="Seconds between reads of the dashcam status")
+    parser.add_argument("-s", "--stall-timeout", type=float, default=3.0, required=False, help="Seconds without a heartbeat before reporting a stall")
     parsedArgs = parser.parse_args()
 
     gpio.setmode(gpio.BCM)
@@ -125,7 +210,7 @@ def main():
     messageQueue = list()
     queueCondition = threading.Condition()
 
-    runnerThread = threading.Thread(target=watchdogRunner, name="Watchdog runner", args=(messageQueue, queueCondition))
+    runnerThread = threading.Thread(target=watchdogRunner, name="Watchdog runner", args=(parsedArgs, messageQueue, queueCondition))
     runnerThread.start()
 
     # Repeat this loop until the OS shuts down.